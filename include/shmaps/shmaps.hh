@@ -9,11 +9,47 @@
 #include <boost/interprocess/containers/string.hpp>
 #include <boost/interprocess/containers/vector.hpp>
 #include <boost/interprocess/detail/managed_memory_impl.hpp>
+#include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/utility.hpp>
 
 #include <libcuckoo/cuckoohash_map.hh>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/membarrier.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <new>
+#include <optional>
 #include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 #define SHMEM_SEG_NAME "SharedMemorySegment"
 
@@ -22,429 +58,5832 @@
 #define SHMAPS_SEG_SIZE 1024 * 1024 * 1024 // 1GB
 #endif
 
+/*
+ address space reserved for a new segment: the shm object is sparse, so pages are only committed as blocks are handed
+ out and the segment grows on demand in every attached process (no remapping, no restart); SHMAPS_SEG_SIZE is a
+ minimum. the backing (tmpfs for the shm object) may be smaller, allocations fail with bip::bad_alloc once it's full
+*/
+#ifndef SHMAPS_SEG_RESERVE
+#if UINTPTR_MAX > 0xffffffffUL
+#define SHMAPS_SEG_RESERVE (64UL * 1024 * 1024 * 1024) // 64GB
+#else
+#define SHMAPS_SEG_RESERVE (SHMAPS_SEG_SIZE)
+#endif
+#endif
+
+// segment pages committed at once, ahead of the blocks handed out (see CommittedBestFit)
+#define SEGMENT_EXTENT (4UL * 1024 * 1024)
+
 #define INIT_MAP_SIZE libcuckoo::DEFAULT_SIZE
 
+// number of cuckoo tables a map's entries are split into, each grows on its own (see ShardedTable)
+#ifndef TABLE_SHARDS
+#define TABLE_SHARDS 16
+#endif
+
+// spinlocks a flat table's groups are striped over, per shard (see FlatTable)
+#define FLAT_LOCKS 64
+
+// lock-free tries of a flat table read before it takes the stripe lock (see FlatTable::find_fn())
+#define FLAT_READ_TRIES 4
+
+// number of per-cpu stats shards kept for every map
+#define STATS_SHARDS 64
+
+// number of robust stripe locks kept for every map (see StripeLocks) and how long to spin before checking the owner
+#define ROBUST_STRIPES 4096
+#define ROBUST_SPINS 1024
+// readers a map records in its table at once, and how many stripe locks a thread takes between two looks for dead
+// ones (see StripeLocks::read())
+#define READER_SLOTS 64
+#define READER_CHECK_LOCKS 4096
+
+// number of per-cpu free lists kept for every slab size class, and how much a list takes from the segment at once
+#define SLAB_SHARDS 16
+#define SLAB_CHUNK (16 * 1024)
+
+// resolution of the segment's coarse clock (see CoarseClock), entries expire with this precision
+#define COARSE_TICKS_PER_SEC 16
+
+// seconds covered by a map's ttl index (see TtlIndex), and how long it keeps filing keys after the last sweep
+#define TTL_WHEEL 1024
+#define TTL_SWEEPER_TIMEOUT 5
+#define TTL_SWEEP_BUDGET 10000
+
+// entries sampled per eviction round, and how many rounds an insert into a full map tries (see Map::evict())
+#define EVICT_SAMPLES 8
+#define EVICT_ROUNDS 4
+
+// number of per-thread pass counters in the segment, and how long snapshot() waits for them to drain (see Gate)
+#define GATE_SLOTS 1024
+#define SNAPSHOT_TIMEOUT 10
+
+// bytes of change log records the segment holds until the log writer gets them to the file (see ChangeLog)
+#define LOG_RING_SIZE (8UL * 1024 * 1024)
+
+// named segments (see Segment) a process may have open at once
+#define MAX_SEGMENTS 64
+
+// maps a segment's directory keeps handles of, and the longest name it keeps (see MapDirectory)
+#define MAP_DIRECTORY_SIZE 4096
+#define MAP_DIRECTORY_NAME 64
+
+// number of bucket locks in a libcuckoo table (its kMaxNumLocks), batches are grouped by lock stripe
+#define LOCK_STRIPES (1UL << 16)
+// how many keys ahead of the one being processed a batch prefetches the table lines of (see Map::mget())
+#define BATCH_PREFETCH 4
+
+// bytes of members a MapSet's set keeps inline in the map entry, and the most it keeps sorted (see CompactSet)
+#define SET_INLINE_BYTES 64
+#define SET_SORTED_MAX 256
+
 namespace bip = boost::interprocess;
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
 namespace shmaps {
-    typedef bip::managed_shared_memory::segment_manager SegmentManager;
-    typedef bip::allocator<void, SegmentManager> VoidAllocator;
-    typedef bip::allocator<char, SegmentManager> CharAllocator;
-    // TODO: redeclare String so app doesn't crash if String is defined before init() is called (null allocator)
-    typedef bip::basic_string<char, std::char_traits<char>, CharAllocator> String;
+    /*
+     the segments' memory algorithm: boost's rbtree_best_fit, which commits the pages a block may take before handing
+     it out. segments are sparse (see SHMAPS_SEG_RESERVE) and their pages would otherwise come from the backing on
+     first write, as a SIGBUS if it's full by then; here they're committed in SEGMENT_EXTENT steps ahead of the highest
+     block handed out (and of the allocations in flight), so a shortfall is a failed allocation instead (bip::bad_alloc
+     from the segment manager and the allocators). its own header goes ahead of the segment manager's.
+    */
+    class CommittedBestFit : public bip::rbtree_best_fit<bip::mutex_family> {
+        typedef bip::rbtree_best_fit<bip::mutex_family> Base;
 
-    typedef std::chrono::time_point<std::chrono::steady_clock> TimePoint;
-    typedef std::chrono::seconds Seconds;
+    public:
+        CommittedBestFit(size_type size, size_type extra_hdr_bytes) : Base(size, extra_hdr_bytes + header_bytes()) {}
 
-    template<typename T> using TAllocator = bip::allocator<T, SegmentManager>;
-    template<typename T> using Vector = bip::vector<T, TAllocator<T>>;
-    template<typename T> using List = bip::list<T, TAllocator<T>>;
-    template<typename T> using Set = bip::set<T, std::less<T>, TAllocator<T>>;
+        static size_type get_min_size(size_type extra_hdr_bytes) {
+            return Base::get_min_size(extra_hdr_bytes + header_bytes());
+        }
 
-    const std::string shmem_seg_name = SHMEM_SEG_NAME;
+        void *allocate(size_type nbytes) {
+            return committed(nbytes, [&] { return Base::allocate(nbytes); });
+        }
 
-    inline bip::managed_shared_memory *segment_ = nullptr;
-    inline VoidAllocator *seg_alloc = nullptr;
+        void *allocate_aligned(size_type nbytes, size_type alignment) {
+            return committed(nbytes + alignment, [&] { return Base::allocate_aligned(nbytes, alignment); });
+        }
+
+        template<class T>
+        T *allocation_command(bip::allocation_type command, size_type limit_size,
+                              size_type &prefer_in_recvd_out_size, T *&reuse) {
+            const size_type nbytes = prefer_in_recvd_out_size * sizeof(T);
+            return static_cast<T *>(committed(nbytes, [&] {
+                return Base::allocation_command<T>(command, limit_size, prefer_in_recvd_out_size, reuse);
+            }, prefer_in_recvd_out_size, sizeof(T)));
+        }
+
+        void *raw_allocation_command(bip::allocation_type command, size_type limit_object,
+                                     size_type &prefer_in_recvd_out_size, void *&reuse, size_type sizeof_object = 1) {
+            const size_type nbytes = prefer_in_recvd_out_size * sizeof_object;
+            return committed(nbytes, [&] {
+                return Base::raw_allocation_command(command, limit_object, prefer_in_recvd_out_size, reuse,
+                                                    sizeof_object);
+            }, prefer_in_recvd_out_size, sizeof_object);
+        }
+
+        // one block per element, all or none of them
+        void allocate_many(size_type elem_bytes, size_type num_elements, multiallocation_chain &chain) {
+            multiallocation_chain blocks;
+            for (size_type i = 0; i < num_elements; ++i) {
+                void *block = allocate(elem_bytes);
+                if (block == nullptr) {
+                    Base::deallocate_many(blocks);
+                    return;
+                }
+                blocks.push_back(block);
+            }
+            chain.splice_after(chain.last(), blocks);
+        }
+
+        void allocate_many(const size_type *elem_sizes, size_type n_elements, size_type sizeof_element,
+                           multiallocation_chain &chain) {
+            multiallocation_chain blocks;
+            for (size_type i = 0; i < n_elements; ++i) {
+                void *block = allocate(elem_sizes[i] * sizeof_element);
+                if (block == nullptr) {
+                    Base::deallocate_many(blocks);
+                    return;
+                }
+                blocks.push_back(block);
+            }
+            chain.splice_after(chain.last(), blocks);
+        }
+
+        // what can still be allocated: the uncommitted part of the segment counts as far as the backing has room
+        size_type get_free_memory() const {
+            const uint64_t size = get_size(), top = std::min<uint64_t>(top_.load(), size);
+            const uint64_t committed = std::max<uint64_t>(std::min<uint64_t>(committed_.load(), size), top);
+            const uint64_t tail = size - top, free = Base::get_free_memory();
+            const uint64_t reachable = std::min(tail, committed - top + std::min(backing_room(), tail));
+            return free > tail ? free - tail + reachable : std::min<uint64_t>(free, reachable);
+        }
+
+        // bytes taken by the blocks handed out (and the headers), regardless of the backing
+        size_type used_memory() const {
+            return get_size() - Base::get_free_memory();
+        }
+
+        // the file the pages come from (/dev/shm/<name> for a shm object on Linux), for the checks above
+        void set_backing(const std::string &path) {
+            int state = 0;
+            if (path.size() < sizeof(backing_) && backing_state_.compare_exchange_strong(state, 1)) {
+                memcpy(backing_, path.c_str(), path.size() + 1);
+                backing_state_ = 2;
+            }
+        }
+
+        // after the segment's pages were replaced (see restore()): commits them again as blocks are handed out
+        void restored(const std::string &backing) {
+            committed_ = 0;
+            pending_ = 0;
+            backing_state_ = 0;
+            set_backing(backing);
+        }
+
+    private:
+        static constexpr size_type header_bytes() {
+            return sizeof(CommittedBestFit) - sizeof(Base);
+        }
 
-    inline void reset() {
         /*
-         do not call if you have static or other active shared tables in your app - they'll all become invalidated and
-         your app will hang\crash; so you should either call reset() before anything else or restart app immediately
-         after reset()
+         runs alloc() once the pages nbytes may take are committed and records where its block ends; received (in
+         elements of elem_size) is the size of the block handed out if the allocation can change it
         */
-        bip::shared_memory_object::remove(SHMEM_SEG_NAME);
-        segment_ = nullptr;
-        return;
-    }
+        template<typename F>
+        void *committed(size_type nbytes, F alloc, const size_type &received = 0, size_type elem_size = 0) {
+            const uint64_t pending = pending_.fetch_add(nbytes) + nbytes;
+            void *block = nullptr;
+            if (commit(top_.load() + pending)) {
+                block = alloc();
+            }
+            if (block != nullptr) {
+                const uint64_t end = static_cast<char *>(block) - reinterpret_cast<char *>(this) +
+                                     (elem_size ? received * elem_size : nbytes);
+                uint64_t top = top_.load();
+                while (top < end && !top_.compare_exchange_weak(top, end)) {}
+            }
+            pending_.fetch_sub(nbytes);
+            return block;
+        }
 
-    inline uint64_t segment_size() {
-        assert(segment_);
-        return segment_->get_size();
-    }
+        /*
+         commits the segment's pages up to need and a page beyond (block headers of the allocator), an extent beyond
+         if the backing has room for it
+        */
+        bool commit(uint64_t need) {
+            const uint64_t size = get_size(), page = sysconf(_SC_PAGESIZE);
+            need = std::min(need + page, size);
+            uint64_t committed = committed_.load();
+            while (committed < need) {
+                uint64_t to = std::min((need + 2 * SEGMENT_EXTENT - 1) / SEGMENT_EXTENT * SEGMENT_EXTENT, size);
+                if (!populate(committed, to)) {
+                    to = std::min((need + page - 1) / page * page, size);
+                    if (!populate(committed, to)) {
+                        return false;
+                    }
+                }
+                while (committed < to && !committed_.compare_exchange_weak(committed, to)) {}
+            }
+            return true;
+        }
 
-    inline uint64_t grow(uint64_t add_size) {
-        assert(segment_);
-        uint cur_seg_size = segment_size();
-        delete segment_;
-        bip::managed_shared_memory::grow(shmem_seg_name.c_str(), add_size);
-        segment_ = new bip::managed_shared_memory(bip::open_only, shmem_seg_name.c_str());
-        assert(segment_size() == cur_seg_size + add_size);
-        return cur_seg_size + add_size;
-    }
+        // commits [from, to) of the segment, false if the backing is out of space
+        bool populate(uint64_t from, uint64_t to) {
+#ifdef __linux__
+            char *addr = reinterpret_cast<char *>(this);
+            while (madvise(addr + from, to - from, MADV_POPULATE_WRITE) != 0) {
+                if (errno == EINVAL) {
+                    // pre 5.14 kernels: reserve the blocks of the backing file instead
+                    const int fd = backing_state_ == 2 ? open(backing_, O_RDWR) : -1;
+                    if (fd < 0) {
+                        return true;
+                    }
+                    const uint64_t offset = bip::ipcdetail::managed_open_or_create_impl<bip::shared_memory_object,
+                            Alignment, true, false>::ManagedOpenOrCreateUserOffset;
+                    const bool res = fallocate(fd, 0, offset + from, to - from) == 0 || errno == EOPNOTSUPP;
+                    close(fd);
+                    return res;
+                }
+                if (errno != EINTR) {
+                    return false;
+                }
+            }
+#endif
+            return true;
+        }
 
-    inline uint64_t init(uint64_t size) {
-        if (segment_ == nullptr) {
-            try {
-                segment_ = new bip::managed_shared_memory(bip::open_or_create, SHMEM_SEG_NAME, size);
-                assert(segment_ != nullptr);
+        // free bytes of the backing's filesystem, unlimited if unknown
+        uint64_t backing_room() const {
+            struct statvfs fs;
+            if (backing_state_ != 2 || statvfs(backing_, &fs) != 0) {
+                return UINT64_MAX;
+            }
+            return static_cast<uint64_t>(fs.f_bavail) * fs.f_frsize;
+        }
+
+        // segment offsets: pages below committed_ are committed, top_ is where the highest block handed out ends
+        std::atomic<uint64_t> committed_{0};
+        std::atomic<uint64_t> top_{0};
+        // bytes of the allocations in flight, they may land above top_
+        std::atomic<uint64_t> pending_{0};
+        // 0: no backing path, 1: being set, 2: set
+        std::atomic<int> backing_state_{0};
+        char backing_[256];
+    };
+
+    typedef bip::basic_managed_shared_memory<char, CommittedBestFit, bip::iset_index> ShmSegment;
+    typedef bip::basic_managed_mapped_file<char, CommittedBestFit, bip::iset_index> FileSegment;
+    typedef ShmSegment::segment_manager SegmentManager;
+
+    /*
+     segment-resident size-class allocator for small blocks (string bodies, set nodes, ...): every class has a
+     lock-free free list per cpu shard, so allocations and frees don't go through the segment manager's mutex;
+     a shard's list is refilled by carving a chunk out of the segment manager. blocks are never given back to the
+     segment manager, but they can be reused by any class shard of the same size. larger blocks go to the segment
+     manager directly.
+    */
+    class SlabPool {
+    public:
+        // 16 byte steps up to 256, then 384\512\768\1024
+        static const std::size_t CLASSES = 20;
+        static const std::size_t MAX_BLOCK = 1024;
+
+        explicit SlabPool(SegmentManager *segment_manager) : segment_manager_(segment_manager) {}
+
+        SegmentManager *segment_manager() const {
+            return segment_manager_.get();
+        }
+
+        void *allocate(std::size_t size) {
+            if (size > MAX_BLOCK) {
+                return segment_manager_->allocate(size);
             }
-            catch (const std::exception &exc) {
-                std::cout << "error creating shared memory segment: " << exc.what() << std::endl;
-                // try again
-                reset();
-                segment_ = new bip::managed_shared_memory(bip::open_or_create, SHMEM_SEG_NAME, size);
+            const std::size_t cls = size_class(size);
+            std::atomic<uint64_t> &head = lists_[cls][shard()].head;
+            if (void *p = pop(head)) {
+                return p;
             }
-            assert(segment_ != nullptr);
-            seg_alloc = new VoidAllocator(segment_->get_segment_manager());
-            assert(seg_alloc != nullptr);
+            return refill(cls, head);
         }
-        if (segment_size() < size) {
-            /*
-             this happens on the very first run when there is a static map defined in your app,
-             and it was instantiated with the default SHMAPS_SEG_SIZE;
-             then you've called init() explicitly requesting a larger segment size.
-            */
-            grow(size - segment_size());
-            assert(segment_size() == size);
-            std::cout << "shmaps segment size has been changed, restart your app\n" << std::endl;
-            exit(0);
+
+        void deallocate(void *p, std::size_t size) {
+            if (size > MAX_BLOCK) {
+                segment_manager_->deallocate(p);
+                return;
+            }
+            push(lists_[size_class(size)][shard()].head, static_cast<Block *>(p), static_cast<Block *>(p));
         }
-        return segment_size();
-    }
 
-    inline TimePoint now() {
-        return std::chrono::steady_clock::now();
-    }
+    private:
+        // a free block; its first word links to the next one (see offset())
+        struct Block {
+            std::atomic<uint64_t> next;
+        };
 
-    struct Stats {
-        struct {
-            struct {
-                std::atomic<uint64_t> total;
-                std::atomic<uint64_t> expiring;
-                std::atomic<uint64_t> permanent;
-                std::atomic<uint64_t> error;
-            } insert;
-            struct {
-                std::atomic<uint64_t> total;
-                std::atomic<uint64_t> hit;
-                std::atomic<uint64_t> miss;
-            } purge;
-            std::atomic<uint64_t> update;
-        } write;
+        // list head: [ABA tag: 24 bits][block offset: 40 bits]
+        struct alignas(64) FreeList {
+            std::atomic<uint64_t> head{0};
+        };
 
-        struct {
-            std::atomic<uint64_t> total;
-            std::atomic<uint64_t> hit;
-            std::atomic<uint64_t> miss;
-        } read;
+        static const uint64_t OFFSET_BITS = 40;
+        static const uint64_t OFFSET_MASK = (1UL << OFFSET_BITS) - 1;
 
-        void print() {
-            fprintf(stdout, "    stats\n"
-                            "        inserts: %lu (%lu%% expiring, %lu%% errors)\n"
-                            "        updates: %lu\n"
-                            "        purges: %lu/%lu (%lu%% hits)\n"
-                            "        reads: %lu/%lu (%lu%% hits)\n",
-                    write.insert.total.load(std::memory_order_acquire),
-                    write.insert.total ? static_cast<uint64_t>(write.insert.expiring * 100 / write.insert.total) : 0,
-                    write.insert.total ? static_cast<uint64_t>(write.insert.error * 100 / write.insert.total) : 0,
-                    write.update.load(std::memory_order_acquire),
-                    write.purge.hit.load(std::memory_order_acquire),
-                    write.purge.total.load(std::memory_order_acquire),
-                    write.purge.total ? static_cast<uint64_t>(write.purge.hit * 100 / write.purge.total) : 0,
-                    read.hit.load(std::memory_order_acquire),
-                    read.total.load(std::memory_order_acquire),
-                    read.total ? static_cast<uint64_t>(read.hit * 100 / read.total) : 0);
+        static std::size_t size_class(std::size_t size) {
+            if (size <= 256) {
+                return size ? (size - 1) / 16 : 0;
+            }
+            return size <= 384 ? 16 : size <= 512 ? 17 : size <= 768 ? 18 : 19;
+        }
+
+        static std::size_t class_size(std::size_t cls) {
+            static const std::size_t large[] = {384, 512, 768, 1024};
+            return cls < 16 ? (cls + 1) * 16 : large[cls - 16];
+        }
+
+        static std::size_t shard() {
+            int cpu = sched_getcpu();
+            return cpu < 0 ? 0 : cpu % SLAB_SHARDS;
+        }
+
+        // blocks are linked by their offset from the segment manager (it's at the start of the segment, so the
+        // offset is the same in every process and 0 is never a block)
+        uint64_t offset(const Block *b) const {
+            return reinterpret_cast<const char *>(b) - reinterpret_cast<const char *>(segment_manager_.get());
+        }
+
+        Block *at(uint64_t offset) const {
+            return offset ? reinterpret_cast<Block *>(reinterpret_cast<char *>(segment_manager_.get()) + offset)
+                          : nullptr;
         }
+
+        static uint64_t pack(uint64_t offset, uint64_t tag) {
+            return (tag << OFFSET_BITS) | offset;
+        }
+
+        static uint64_t unpack(uint64_t head) {
+            return head & OFFSET_MASK;
+        }
+
+        // pushes the chain first..last (already linked) onto the list
+        void push(std::atomic<uint64_t> &head, Block *first, Block *last) {
+            uint64_t cur = head.load(std::memory_order_relaxed);
+            do {
+                last->next.store(unpack(cur), std::memory_order_relaxed);
+            } while (!head.compare_exchange_weak(cur, pack(offset(first), (cur >> OFFSET_BITS) + 1),
+                                                 std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        Block *pop(std::atomic<uint64_t> &head) {
+            uint64_t cur = head.load(std::memory_order_acquire);
+            while (Block *b = at(unpack(cur))) {
+                // b may be popped and reused meanwhile, then next is garbage but the tag makes the CAS fail
+                const uint64_t next = b->next.load(std::memory_order_relaxed);
+                if (head.compare_exchange_weak(cur, pack(next, (cur >> OFFSET_BITS) + 1),
+                                               std::memory_order_acquire, std::memory_order_acquire)) {
+                    return b;
+                }
+            }
+            return nullptr;
+        }
+
+        // carves a chunk of blocks of class cls, returns one and puts the rest onto the list
+        void *refill(std::size_t cls, std::atomic<uint64_t> &head) {
+            const std::size_t size = class_size(cls);
+            const std::size_t count = std::max<std::size_t>(SLAB_CHUNK / size, 2);
+            char *chunk = static_cast<char *>(segment_manager_->allocate(count * size));
+            Block *first = reinterpret_cast<Block *>(chunk + size);
+            Block *last = reinterpret_cast<Block *>(chunk + (count - 1) * size);
+            for (char *p = chunk + size; p < reinterpret_cast<char *>(last); p += size) {
+                reinterpret_cast<Block *>(p)->next.store(offset(reinterpret_cast<Block *>(p + size)),
+                                                         std::memory_order_relaxed);
+            }
+            push(head, first, last);
+            return chunk;
+        }
+
+        bip::offset_ptr<SegmentManager> segment_manager_;
+        FreeList lists_[CLASSES][SLAB_SHARDS];
     };
 
-    template<class PayloadType>  // PayloadType could be a simple int, a set or a complex struct (with strings)
-    class MappedValType {
+    inline SlabPool *slab_pool_ = nullptr;
+
+    // STL\boost.container allocator on top of the segment's SlabPool
+    template<typename T>
+    class SlabAllocator {
     public:
-        MappedValType() {}
+        typedef T value_type;
+        typedef bip::offset_ptr<T> pointer;
+        typedef bip::offset_ptr<const T> const_pointer;
+        typedef bip::offset_ptr<void> void_pointer;
+        typedef std::size_t size_type;
+        typedef std::ptrdiff_t difference_type;
 
-        MappedValType(Seconds &ttl, const VoidAllocator &void_alloc) :
-                payload_(void_alloc),
-                created_at_(now()),
-                ttl_(ttl) {}
+        template<typename U>
+        struct rebind {
+            typedef SlabAllocator<U> other;
+        };
 
-        MappedValType(const PayloadType &payload, Seconds &ttl) :
-                payload_(payload),
-                created_at_(now()),
-                ttl_(ttl) {}
+        // the pool of the segment segment_manager manages (see init() and SegmentContext::pool)
+        SlabAllocator(SegmentManager *segment_manager);
 
-        ~MappedValType() {}
+        explicit SlabAllocator(SlabPool *pool) : pool_(pool) {}
 
-        bool expired() const {
-            return ttl_ != Seconds(0) && (now() - created_at_ > ttl_);
+        template<typename U>
+        SlabAllocator(const SlabAllocator<U> &other) : pool_(other.pool()) {}
+
+        pointer allocate(size_type n) {
+            return pointer(static_cast<T *>(pool_->allocate(n * sizeof(T))));
         }
 
-        void reset(const PayloadType &payload, Seconds &ttl) {
-            reset(payload);
-            reset(ttl);
+        void deallocate(const pointer &p, size_type n) {
+            pool_->deallocate(bip::ipcdetail::to_raw_pointer(p), n * sizeof(T));
         }
 
-        void reset(Seconds &ttl) {
-            created_at_ = now();
-            ttl_ = ttl;
+        size_type max_size() const {
+            return pool_->segment_manager()->get_size() / sizeof(T);
         }
 
-        void reset(const PayloadType &payload) {
-            payload_ = payload;
+        SegmentManager *get_segment_manager() const {
+            return pool_->segment_manager();
         }
 
-        PayloadType &payload() {
-            return payload_;
+        SlabPool *pool() const {
+            return pool_.get();
         }
 
-        const PayloadType &cpayload() const {
-            return payload_;
+        template<typename U>
+        bool operator==(const SlabAllocator<U> &other) const {
+            return pool_ == other.pool();
+        }
+
+        template<typename U>
+        bool operator!=(const SlabAllocator<U> &other) const {
+            return pool_ != other.pool();
         }
 
     private:
-        PayloadType payload_;
-        TimePoint created_at_;
-        Seconds ttl_;
+        bip::offset_ptr<SlabPool> pool_;
+    };
+
+#ifndef SHMAPS_DISABLE_SLAB
+    typedef SlabAllocator<void> VoidAllocator;
+    typedef SlabAllocator<char> CharAllocator;
+    template<typename T> using TAllocator = SlabAllocator<T>;
+#else
+    typedef bip::allocator<void, SegmentManager> VoidAllocator;
+    typedef bip::allocator<char, SegmentManager> CharAllocator;
+    template<typename T> using TAllocator = bip::allocator<T, SegmentManager>;
+#endif
+    // TODO: redeclare String so app doesn't crash if String is defined before init() is called (null allocator)
+    typedef bip::basic_string<char, std::char_traits<char>, CharAllocator> String;
+
+    typedef std::chrono::time_point<std::chrono::steady_clock> TimePoint;
+    typedef std::chrono::seconds Seconds;
+
+    template<typename T> using Vector = bip::vector<T, TAllocator<T>>;
+    template<typename T> using List = bip::list<T, TAllocator<T>>;
+    template<typename T> using Set = bip::set<T, std::less<T>, TAllocator<T>>;
+
+    /*
+     string of up to N chars stored inline: no allocator (so it can be built before init()), no separate block to
+     allocate, free or chase while a bucket is scanned, and trivially copyable. use it for keys and payload fields
+     of a bounded length, assigning a longer value throws std::length_error. String inlines up to 22 chars only.
+    */
+    template<std::size_t N>
+    class FixedString {
+        static_assert(N > 0 && N < 65536, "FixedString capacity must be in [1, 65535]");
+        typedef std::conditional_t<(N < 256), uint8_t, uint16_t> SizeType;
+
+    public:
+        FixedString() = default;
+
+        FixedString(std::string_view s) {
+            assign(s);
+        }
+
+        FixedString(const char *s) : FixedString(std::string_view(s)) {}
+
+        FixedString(const std::string &s) : FixedString(std::string_view(s)) {}
+
+        FixedString(const String &s) : FixedString(std::string_view(s.data(), s.size())) {}
+
+        void assign(std::string_view s) {
+            if (s.size() > N) {
+                throw std::length_error("shmaps: " + std::to_string(s.size()) +
+                                        " chars don't fit in FixedString<" + std::to_string(N) + ">");
+            }
+            size_ = static_cast<SizeType>(s.size());
+            memcpy(data_, s.data(), s.size());
+            data_[s.size()] = '\0';
+        }
+
+        const char *data() const {
+            return data_;
+        }
+
+        const char *c_str() const {
+            return data_;
+        }
+
+        std::size_t size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        static constexpr std::size_t capacity() {
+            return N;
+        }
+
+        operator std::string_view() const {
+            return std::string_view(data_, size_);
+        }
+
+        bool operator==(const FixedString &other) const {
+            return size_ == other.size_ && memcmp(data_, other.data_, size_) == 0;
+        }
+
+        bool operator!=(const FixedString &other) const {
+            return !(*this == other);
+        }
+
+        bool operator<(const FixedString &other) const {
+            return std::string_view(*this) < std::string_view(other);
+        }
+
+    private:
+        SizeType size_ = 0;
+        char data_[N + 1] = {};
+    };
+
+    inline std::string_view as_view(const String &s) {
+        return std::string_view(s.data(), s.size());
+    }
+
+    inline std::string_view as_view(const std::string &s) {
+        return std::string_view(s.data(), s.size());
+    }
+
+    inline std::string_view as_view(std::string_view s) {
+        return s;
+    }
+
+    inline std::string_view as_view(const char *s) {
+        return std::string_view(s);
+    }
+
+    template<std::size_t N>
+    inline std::string_view as_view(const FixedString<N> &s) {
+        return std::string_view(s.data(), s.size());
+    }
+
+    /*
+     transparent hash and predicate for String (and FixedString) keys: a map can be probed with a std::string_view, std::string or
+     const char * without building a segment-allocated String; hash_range() over chars is exactly what
+     boost::hash<String> computes, so tables created with the default boost::hash stay readable
+    */
+    struct StringHash {
+        typedef void is_transparent;
+
+        template<typename S>
+        std::size_t operator()(const S &s) const {
+            std::string_view v = as_view(s);
+            return boost::hash_range(v.begin(), v.end());
+        }
+    };
+
+    struct StringEqual {
+        typedef void is_transparent;
+
+        template<typename S1, typename S2>
+        bool operator()(const S1 &s1, const S2 &s2) const {
+            return as_view(s1) == as_view(s2);
+        }
+    };
+
+    template<class KeyType>
+    struct DefaultHash {
+        typedef boost::hash<KeyType> type;
+    };
+
+    template<>
+    struct DefaultHash<String> {
+        typedef StringHash type;
+    };
+
+    template<std::size_t N>
+    struct DefaultHash<FixedString<N>> {
+        typedef StringHash type;
+    };
+
+    template<class KeyType>
+    struct DefaultPred {
+        typedef std::equal_to<KeyType> type;
+    };
+
+    template<>
+    struct DefaultPred<String> {
+        typedef StringEqual type;
     };
 
-    template<class KeyType, class PayloadType, class Hash = boost::hash<KeyType>, class Pred = std::equal_to<KeyType>>
-    class Map {
-    public:
-        typedef std::pair<const KeyType, MappedValType<PayloadType> > ValueType;
-        typedef bip::allocator<ValueType, SegmentManager> ValueTypeAllocator;
-        typedef libcuckoo::cuckoohash_map<KeyType, MappedValType<PayloadType>, Hash, Pred, ValueTypeAllocator> MapImpl;
+    template<std::size_t N>
+    struct DefaultPred<FixedString<N>> {
+        typedef StringEqual type;
+    };
+
+    // a lookup key with its hash computed up front (see Map::mget()), the map's hasher returns it as is
+    template<typename K>
+    struct PrehashedKey {
+        const K &key;
+        std::size_t hash;
+    };
+
+    template<class Hash>
+    struct PrehashedHash : public Hash {
+        using Hash::operator();
+
+        template<typename K>
+        std::size_t operator()(const PrehashedKey<K> &k) const {
+            return k.hash;
+        }
+    };
+
+    template<class Pred>
+    struct PrehashedPred : public Pred {
+        using Pred::operator();
+
+        template<typename S, typename K>
+        bool operator()(const S &stored, const PrehashedKey<K> &k) const {
+            return Pred::operator()(stored, k.key);
+        }
+
+        template<typename K, typename S>
+        bool operator()(const PrehashedKey<K> &k, const S &stored) const {
+            return Pred::operator()(k.key, stored);
+        }
+    };
+
+    const std::string shmem_seg_name = SHMEM_SEG_NAME;
+
+    /*
+     the part of a segment maps use, common to both backings: ShmSegment (default) and FileSegment
+     (see SegmentOptions::file) share the segment manager and the layout
+    */
+    typedef bip::ipcdetail::basic_managed_memory_impl<char, CommittedBestFit, bip::iset_index,
+            bip::ipcdetail::managed_open_or_create_impl<bip::shared_memory_object,
+                    CommittedBestFit::Alignment, true, false>::ManagedOpenOrCreateUserOffset>
+            ManagedSegment;
+    static_assert(std::is_base_of_v<ManagedSegment, ShmSegment> && std::is_base_of_v<ManagedSegment, FileSegment>,
+                  "segment backings must share a base");
+
+    // the memory algorithm of segment, a private base of its segment manager
+    inline CommittedBestFit *memory_algorithm(ManagedSegment *segment) {
+        return (CommittedBestFit *) segment->get_segment_manager();
+    }
+
+    // the file a segment's pages come from, see CommittedBestFit::set_backing()
+    inline std::string backing_path(const std::string &shm_name, const std::string &file) {
+#ifdef __linux__
+        return file.empty() ? "/dev/shm/" + shm_name : file;
+#else
+        return file;
+#endif
+    }
+
+    inline ManagedSegment *segment_ = nullptr;
+    // the backing segment_ points into, one of them is set
+    inline ShmSegment *shm_segment_ = nullptr;
+    inline FileSegment *file_segment_ = nullptr;
+    inline std::string segment_file_;
+    inline VoidAllocator *seg_alloc = nullptr;
+    inline std::atomic<bool> syncer_running_{false};
+
+    /*
+     segment-wide coarse clock for expiration: ticks of 1/COARSE_TICKS_PER_SEC s since the segment was created, kept up
+     to date by a ticker thread in every process using maps; reads get the time with a plain load instead of a clock
+     call. it follows CLOCK_MONOTONIC (steady_clock), so setting the wall clock neither expires entries early nor keeps
+     them late; a segment which outlives the boot (file backed, restored) is rebased when it's attached after a reboot
+     and its ticks go on from where they were (see attach()). entries keep 31 bits of ticks (see MappedValType), that
+     lasts for ~4 years of a segment's life.
+    */
+    struct CoarseClock {
+        CoarseClock() : epoch_ms(monotonic_ms()), boot(boot_id()), ticks(0) {}
+
+        static int64_t wall_ms() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        static int64_t monotonic_ms() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // the boot the monotonic clock counts from: its random boot_id on Linux, the boot time to a minute elsewhere
+        static uint64_t boot_id() {
+            static const uint64_t id = [] {
+                char buf[64] = {};
+                const int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+                const ssize_t len = fd >= 0 ? read(fd, buf, sizeof(buf)) : -1;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                if (len > 0) {
+                    return std::hash<std::string_view>()(std::string_view(buf, len)) | 1;
+                }
+                return static_cast<uint64_t>((wall_ms() - monotonic_ms()) / 60000) | 1;
+            }();
+            return id;
+        }
+
+        // rebases a clock of an earlier boot so its ticks go on from the last one; every attaching process calls it
+        void attach() {
+            if (boot.load(std::memory_order_acquire) != boot_id()) {
+                epoch_ms.store(monotonic_ms() - int64_t(ticks.load()) * 1000 / COARSE_TICKS_PER_SEC);
+                boot.store(boot_id(), std::memory_order_release);
+            }
+        }
+
+        void tick() {
+            // not rebased yet: the epoch is of another boot
+            if (boot.load(std::memory_order_acquire) != boot_id()) {
+                return;
+            }
+            // monotonic, but the coarse clock never goes back even if a rebase raced with a tick
+            const uint32_t t = std::max<int64_t>(monotonic_ms() - epoch_ms.load(std::memory_order_relaxed), 0) *
+                               COARSE_TICKS_PER_SEC / 1000;
+            uint32_t cur = ticks.load(std::memory_order_relaxed);
+            while (cur < t && !ticks.compare_exchange_weak(cur, t, std::memory_order_relaxed)) {}
+        }
+
+        // wall clock ms at tick t, as far as the wall clock tells now
+        int64_t wall_ms_at(uint32_t t) const {
+            const int64_t ago = int64_t(ticks.load(std::memory_order_relaxed)) - int64_t(t);
+            return wall_ms() - ago * 1000 / COARSE_TICKS_PER_SEC;
+        }
+
+        // monotonic ms of the boot below at tick 0
+        std::atomic<int64_t> epoch_ms;
+        std::atomic<uint64_t> boot;
+        std::atomic<uint32_t> ticks;
+    };
+
+    inline std::atomic<CoarseClock *> coarse_clock_{nullptr};
+
+    struct Gate;
+    inline std::atomic<Gate *> gate_{nullptr};
+    // bumped when the gate slots claimed so far become invalid: reset(), grow(), fork(), a Segment going away
+    inline std::atomic<uint64_t> gate_epoch_{1};
+
+    struct MapDirectory;
+    inline std::atomic<MapDirectory *> map_directory_{nullptr};
+
+    /*
+     what map operations on a named Segment use in place of the globals above (segment_, seg_alloc, slab_pool_,
+     coarse_clock_, gate_, map_directory_); set for the calling thread while an operation runs, see SegmentScope
+    */
+    struct SegmentContext {
+        ManagedSegment *segment = nullptr;
+        VoidAllocator *alloc = nullptr;
+        SlabPool *pool = nullptr;
+        CoarseClock *clock = nullptr;
+        std::atomic<Gate *> gate{nullptr};
+        std::atomic<MapDirectory *> directory{nullptr};
+    };
+
+    inline thread_local SegmentContext *segment_context_ = nullptr;
+
+    // the default segment's pool, or the calling thread's named segment's; others are looked up by name
+    template<typename T>
+    SlabAllocator<T>::SlabAllocator(SegmentManager *segment_manager) : pool_(slab_pool_) {
+        if (slab_pool_ == nullptr || slab_pool_->segment_manager() != segment_manager) {
+            SlabPool *pool = segment_context_ != nullptr ? segment_context_->pool : nullptr;
+            pool_ = pool != nullptr && pool->segment_manager() == segment_manager
+                    ? pool : segment_manager->find<SlabPool>("shmaps_slab_pool").first;
+        }
+        assert(pool_ != nullptr);
+    }
+
+    // clocks of the named segments open in this process, ticked along with the default one
+    inline std::atomic<CoarseClock *> segment_clocks_[MAX_SEGMENTS];
+
+    // the segment the calling thread's map operation is in
+    inline ManagedSegment *active_segment() {
+        return segment_context_ != nullptr ? segment_context_->segment : segment_;
+    }
+
+    inline VoidAllocator &active_alloc() {
+        return segment_context_ != nullptr ? *segment_context_->alloc : *seg_alloc;
+    }
+
+    // a value of T to assign to, built with the segment allocator if T takes one (String etc.)
+    template<typename T>
+    inline T make_value() {
+        if constexpr (std::is_constructible_v<T, const VoidAllocator &>) {
+            return T(active_alloc());
+        } else {
+            return T();
+        }
+    }
+
+    /*
+     MapSet's set: the representation follows the number of members. up to SET_INLINE_BYTES of them are kept inline
+     (in the map entry, no allocation, a linear scan), up to SET_SORTED_MAX in an array in the segment sorted by hash
+     (binary search), more in an open addressing hash set in the segment (linear probing, a byte of the hash per slot).
+     every representation tells members apart with Hash and Pred only. growing past a representation's capacity moves
+     the members to the next one; erasing down to an eighth of it moves them back. members take sizeof(T) each, up to
+     4/3 of it in a hash set, vs 3 pointers and a color of a tree node plus an allocation header. iteration order is
+     unspecified.
+    */
+    template<typename T, class Hash = typename DefaultHash<T>::type, class Pred = typename DefaultPred<T>::type>
+    class CompactSet {
+        typedef typename std::allocator_traits<VoidAllocator>::template rebind_alloc<T> Allocator;
+        typedef typename std::allocator_traits<VoidAllocator>::template rebind_alloc<uint8_t> CtrlAllocator;
+        typedef typename std::allocator_traits<Allocator>::pointer Pointer;
+        typedef typename std::allocator_traits<CtrlAllocator>::pointer CtrlPointer;
+
+        static constexpr uint32_t INLINE = std::max<std::size_t>(SET_INLINE_BYTES / sizeof(T), 1);
+
+        enum class Mode : uint8_t {
+            Inline,
+            Sorted,
+            Hashed
+        };
+
+    public:
+        typedef T value_type;
+        typedef T key_type;
+        typedef uint32_t size_type;
+
+        class const_iterator {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef const T &reference;
+            typedef const T *pointer;
+            typedef std::ptrdiff_t difference_type;
+
+            const_iterator(const T *slots, const uint8_t *ctrl, uint32_t pos, uint32_t end) :
+                    slots_(slots), ctrl_(ctrl), pos_(pos), end_(end) {
+                skip();
+            }
+
+            reference operator*() const {
+                return slots_[pos_];
+            }
+
+            pointer operator->() const {
+                return slots_ + pos_;
+            }
+
+            const_iterator &operator++() {
+                ++pos_;
+                skip();
+                return *this;
+            }
+
+            bool operator==(const const_iterator &other) const {
+                return pos_ == other.pos_;
+            }
+
+            bool operator!=(const const_iterator &other) const {
+                return pos_ != other.pos_;
+            }
+
+        private:
+            // free slots of a hash set
+            void skip() {
+                while (ctrl_ != nullptr && pos_ < end_ && ctrl_[pos_] == 0) {
+                    ++pos_;
+                }
+            }
+
+            const T *slots_;
+            const uint8_t *ctrl_;
+            uint32_t pos_;
+            uint32_t end_;
+        };
+
+        typedef const_iterator iterator;
+
+        explicit CompactSet(const VoidAllocator &alloc) : alloc_(alloc) {}
+
+        CompactSet(const CompactSet &other) : alloc_(other.alloc_) {
+            reshape(other.size_);
+            for (const T &member: other) {
+                insert(member);
+            }
+        }
+
+        // members of a set in another segment are moved one by one into storage allocated here, which may throw
+        CompactSet(CompactSet &&other) : alloc_(other.alloc_) {
+            take(other);
+        }
+
+        CompactSet &operator=(const CompactSet &other) {
+            if (this != &other) {
+                clear();
+                reshape(other.size_);
+                for (const T &member: other) {
+                    insert(member);
+                }
+            }
+            return *this;
+        }
+
+        CompactSet &operator=(CompactSet &&other) {
+            if (this != &other) {
+                clear();
+                take(other);
+            }
+            return *this;
+        }
+
+        ~CompactSet() {
+            clear();
+        }
+
+        size_type size() const {
+            return size_;
+        }
+
+        bool empty() const {
+            return size_ == 0;
+        }
+
+        const_iterator begin() const {
+            return const_iterator(slots(), ctrl(), 0, slots_end());
+        }
+
+        const_iterator end() const {
+            return const_iterator(slots(), ctrl(), slots_end(), slots_end());
+        }
+
+        const_iterator find(const T &member) const {
+            const uint32_t pos = locate(member);
+            return pos == NONE ? end() : const_iterator(slots(), ctrl(), pos, slots_end());
+        }
+
+        bool contains(const T &member) const {
+            return locate(member) != NONE;
+        }
+
+        /*
+         a member picked by r (end() if the set is empty): uniformly in inline and sorted sets, a hash set's is the
+         first one from slot r on, so members after longer free runs come up more often
+        */
+        const_iterator sample(uint64_t r) const {
+            if (size_ == 0) {
+                return end();
+            }
+            if (mode_ != Mode::Hashed) {
+                return const_iterator(slots(), ctrl(), r % size_, size_);
+            }
+            const const_iterator it(slots(), ctrl(), r & (capacity_ - 1), capacity_);
+            return it != end() ? it : begin();
+        }
+
+        // false if it's a member already
+        bool insert(const T &member) {
+            return add(member);
+        }
+
+        bool insert(T &&member) {
+            return add(std::move(member));
+        }
+
+        // false if it's not a member
+        bool erase(const T &member) {
+            const uint32_t pos = locate(member);
+            if (pos == NONE) {
+                return false;
+            }
+            T *data = slots();
+            if (mode_ == Mode::Hashed) {
+                unplace(pos);
+            } else {
+                std::move(data + pos + 1, data + size_, data + pos);
+                data[size_ - 1].~T();
+            }
+            --size_;
+            if (mode_ != Mode::Inline && size_ * 8 <= capacity_) {
+                reshape(size_ * 2);
+            }
+            return true;
+        }
+
+        void clear() {
+            destroy();
+            release();
+        }
+
+    private:
+        static constexpr uint32_t NONE = ~0U;
+
+        struct Heap {
+            Pointer slots;
+            CtrlPointer ctrl;
+        };
+
+        union Storage {
+            Storage() {}
+
+            ~Storage() {}
+
+            std::aligned_storage_t<sizeof(T), alignof(T)> members[INLINE];
+            Heap heap;
+        };
+
+        T *slots() {
+            if (mode_ == Mode::Inline) {
+                return std::launder(reinterpret_cast<T *>(storage_.members));
+            }
+            return bip::ipcdetail::to_raw_pointer(storage_.heap.slots);
+        }
+
+        const T *slots() const {
+            return const_cast<CompactSet *>(this)->slots();
+        }
+
+        uint8_t *ctrl() {
+            return mode_ == Mode::Hashed ? bip::ipcdetail::to_raw_pointer(storage_.heap.ctrl) : nullptr;
+        }
+
+        const uint8_t *ctrl() const {
+            return const_cast<CompactSet *>(this)->ctrl();
+        }
+
+        uint32_t slots_end() const {
+            return mode_ == Mode::Hashed ? capacity_ : size_;
+        }
+
+        static std::size_t hash_of(const T &member) {
+            return Hash()(member);
+        }
+
+        // fibonacci hashing: the slot from the top bits, so an int (hashing to itself) doesn't probe in runs
+        uint32_t home(std::size_t hash) const {
+            return (hash * 0x9E3779B97F4A7C15UL) >> (64 - __builtin_ctz(capacity_));
+        }
+
+        static uint8_t tag_of(std::size_t hash) {
+            return 0x80 | (hash & 0x7F);
+        }
+
+        // a sorted set's first member whose hash isn't below hash; members of the same hash follow it in no order
+        const T *first_of(std::size_t hash) const {
+            const T *data = slots();
+            return std::lower_bound(data, data + size_, hash, [](const T &member, std::size_t h) {
+                return hash_of(member) < h;
+            });
+        }
+
+        uint32_t locate(const T &member) const {
+            const T *data = slots();
+            switch (mode_) {
+                case Mode::Inline:
+                    for (uint32_t i = 0; i < size_; ++i) {
+                        if (Pred()(data[i], member)) {
+                            return i;
+                        }
+                    }
+                    return NONE;
+                case Mode::Sorted: {
+                    const std::size_t hash = hash_of(member);
+                    for (const T *it = first_of(hash); it != data + size_ && hash_of(*it) == hash; ++it) {
+                        if (Pred()(*it, member)) {
+                            return it - data;
+                        }
+                    }
+                    return NONE;
+                }
+                case Mode::Hashed: {
+                    const uint8_t *tags = ctrl();
+                    const std::size_t hash = hash_of(member);
+                    const uint8_t tag = tag_of(hash);
+                    for (uint32_t i = home(hash);; i = (i + 1) & (capacity_ - 1)) {
+                        if (tags[i] == 0) {
+                            return NONE;
+                        }
+                        if (tags[i] == tag && Pred()(data[i], member)) {
+                            return i;
+                        }
+                    }
+                }
+            }
+            return NONE;
+        }
+
+        template<typename V>
+        bool add(V &&member) {
+            if (locate(member) != NONE) {
+                return false;
+            }
+            const bool full = mode_ == Mode::Hashed ? (size_ + 1) * 4 > capacity_ * 3
+                                                    : size_ == (mode_ == Mode::Inline ? INLINE : capacity_);
+            if (full) {
+                reshape(size_ * 2);
+            }
+            if (mode_ == Mode::Sorted) {
+                T *data = slots();
+                const uint32_t pos = first_of(hash_of(member)) - data;
+                if (pos == size_) {
+                    new(data + size_) T(std::forward<V>(member));
+                } else {
+                    new(data + size_) T(std::move(data[size_ - 1]));
+                    std::move_backward(data + pos, data + size_ - 1, data + size_);
+                    data[pos] = std::forward<V>(member);
+                }
+                ++size_;
+            } else {
+                append(std::forward<V>(member));
+            }
+            return true;
+        }
+
+        // adds a member known not to be there, in order if the set is sorted
+        template<typename V>
+        void append(V &&member) {
+            if (mode_ != Mode::Hashed) {
+                new(slots() + size_) T(std::forward<V>(member));
+                ++size_;
+                return;
+            }
+            const std::size_t hash = hash_of(member);
+            uint8_t *tags = ctrl();
+            uint32_t i = home(hash);
+            while (tags[i] != 0) {
+                i = (i + 1) & (capacity_ - 1);
+            }
+            new(slots() + i) T(std::forward<V>(member));
+            tags[i] = tag_of(hash);
+            ++size_;
+        }
+
+        // frees a hash set's slot, shifting back the members of its probe run which may take it
+        void unplace(uint32_t pos) {
+            T *data = slots();
+            uint8_t *tags = ctrl();
+            data[pos].~T();
+            tags[pos] = 0;
+            for (uint32_t i = (pos + 1) & (capacity_ - 1); tags[i] != 0; i = (i + 1) & (capacity_ - 1)) {
+                const uint32_t at = home(hash_of(data[i]));
+                // stays if its home is cyclically in (pos, i]
+                if (pos < i ? (at > pos && at <= i) : (at > pos || at <= i)) {
+                    continue;
+                }
+                new(data + pos) T(std::move(data[i]));
+                data[i].~T();
+                tags[pos] = tags[i];
+                tags[i] = 0;
+                pos = i;
+            }
+        }
+
+        /*
+         moves the members to the representation for n of them. the new storage is allocated first: a bad_alloc
+         leaves the set as it was
+        */
+        void reshape(uint32_t n) {
+            CompactSet next(alloc_);
+            next.allocate(n);
+            T *data = slots();
+            for (uint32_t i = 0; i < slots_end(); ++i) {
+                if (mode_ != Mode::Hashed || ctrl()[i] != 0) {
+                    next.append(std::move(data[i]));
+                }
+            }
+            if (next.mode_ == Mode::Sorted && mode_ != Mode::Sorted) {
+                next.sort();
+            }
+            destroy();
+            release();
+            take(next);
+        }
+
+        // storage for n members in their representation, the set is inline and empty
+        void allocate(uint32_t n) {
+            if (n > SET_SORTED_MAX) {
+                uint32_t capacity = 1;
+                while (capacity * 3 < n * 4) {
+                    capacity *= 2;
+                }
+                const Pointer members = Allocator(alloc_).allocate(capacity);
+                CtrlPointer tags;
+                try {
+                    tags = CtrlAllocator(alloc_).allocate(capacity);
+                } catch (...) {
+                    Allocator(alloc_).deallocate(members, capacity);
+                    throw;
+                }
+                new(&storage_.heap) Heap{members, tags};
+                mode_ = Mode::Hashed;
+                capacity_ = capacity;
+                std::memset(ctrl(), 0, capacity_);
+            } else if (n > INLINE) {
+                new(&storage_.heap) Heap{Allocator(alloc_).allocate(n), nullptr};
+                mode_ = Mode::Sorted;
+                capacity_ = n;
+            }
+        }
+
+        // destroys the members, keeps the storage
+        void destroy() {
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                T *data = slots();
+                for (uint32_t i = 0; i < slots_end(); ++i) {
+                    if (mode_ != Mode::Hashed || ctrl()[i] != 0) {
+                        data[i].~T();
+                    }
+                }
+            }
+            size_ = 0;
+        }
+
+        // frees the storage of the destroyed members, the set is inline and empty
+        void release() {
+            if (mode_ != Mode::Inline) {
+                Allocator(alloc_).deallocate(storage_.heap.slots, capacity_);
+                if (mode_ == Mode::Hashed) {
+                    CtrlAllocator(alloc_).deallocate(storage_.heap.ctrl, capacity_);
+                }
+                storage_.heap.~Heap();
+            }
+            mode_ = Mode::Inline;
+            capacity_ = 0;
+        }
+
+        // a sorted set's members appended in another order into hash order
+        void sort() {
+            T *members = slots();
+            std::sort(members, members + size_, [](const T &a, const T &b) {
+                return hash_of(a) < hash_of(b);
+            });
+        }
+
+        /*
+         other's members into this empty set: its storage if both are in the same segment, other is left empty.
+         otherwise they're moved into storage allocated here first, a bad_alloc leaves both sets as they were
+        */
+        void take(CompactSet &other) {
+            if (other.mode_ == Mode::Inline || !(alloc_ == other.alloc_)) {
+                if (other.size_ > INLINE) {
+                    reshape(other.size_);
+                }
+                for (const T &member: other) {
+                    append(std::move(const_cast<T &>(member)));
+                }
+                // a shrunk hash set may be small enough to come out sorted
+                if (mode_ == Mode::Sorted && other.mode_ != Mode::Sorted) {
+                    sort();
+                }
+                other.clear();
+                return;
+            }
+            new(&storage_.heap) Heap{other.storage_.heap.slots, other.storage_.heap.ctrl};
+            mode_ = other.mode_;
+            capacity_ = other.capacity_;
+            size_ = other.size_;
+            other.storage_.heap.~Heap();
+            other.mode_ = Mode::Inline;
+            other.capacity_ = 0;
+            other.size_ = 0;
+        }
+
+        VoidAllocator alloc_;
+        Storage storage_;
+        uint32_t size_ = 0;
+        // of the heap storage, 0 while the members are inline
+        uint32_t capacity_ = 0;
+        Mode mode_ = Mode::Inline;
+    };
+
+    struct ChangeLog;
+    inline std::atomic<ChangeLog *> change_log_{nullptr};
+    inline std::atomic<bool> ticker_running_{false};
+    inline std::atomic<bool> ticker_stop_{false};
+    inline std::thread *ticker_ = nullptr;
+    inline pid_t ticker_pid_ = 0;
+
+    inline void start_ticker() {
+        // threads don't survive fork(), a child starts its own ticker
+        static bool atfork_registered = (pthread_atfork(nullptr, nullptr, [] { ticker_running_ = false; }) == 0);
+        (void) atfork_registered;
+        if (ticker_running_.exchange(true)) {
+            return;
+        }
+        ticker_stop_ = false;
+        ticker_pid_ = getpid();
+        ticker_ = new std::thread([] {
+            while (!ticker_stop_) {
+                if (CoarseClock *clock = coarse_clock_.load()) {
+                    clock->tick();
+                }
+                for (std::atomic<CoarseClock *> &segment_clock: segment_clocks_) {
+                    if (CoarseClock *clock = segment_clock.load()) {
+                        clock->tick();
+                    }
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1000 / COARSE_TICKS_PER_SEC / 4));
+            }
+        });
+    }
+
+    // stops this process' ticker (see detach()), the next map operation starts it again
+    inline void stop_ticker() {
+        // a fork child's ticker_ is its parent's thread
+        if (ticker_ != nullptr && ticker_pid_ == getpid()) {
+            ticker_stop_ = true;
+            ticker_->join();
+            delete ticker_;
+        }
+        ticker_ = nullptr;
+        ticker_running_ = false;
+    }
+
+    // the clock of the segment the calling thread's map operation is in
+    inline CoarseClock *active_clock() {
+        return segment_context_ != nullptr ? segment_context_->clock : coarse_clock_.load(std::memory_order_relaxed);
+    }
+
+    // current time in coarse ticks, see CoarseClock
+    inline uint32_t coarse_now() {
+        CoarseClock *clock = active_clock();
+        assert(clock != nullptr);
+        if (!ticker_running_.load(std::memory_order_relaxed)) {
+            start_ticker();
+            clock->tick();
+        }
+        return clock->ticks.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t now_seconds() {
+        return coarse_now() / COARSE_TICKS_PER_SEC;
+    }
+
+    /*
+     forgets the segment, so the next init() (or restore()) attaches anew; the segment itself stays as it is. the
+     mapping is left in place, maps opened so far keep pointing into it but must not be used anymore. stops the
+     ticker as well, the next map operation starts it again
+    */
+    inline void detach() {
+        stop_ticker();
+        segment_ = nullptr;
+        shm_segment_ = nullptr;
+        file_segment_ = nullptr;
+        segment_file_.clear();
+        seg_alloc = nullptr;
+        slab_pool_ = nullptr;
+        coarse_clock_ = nullptr;
+        gate_ = nullptr;
+        ++gate_epoch_;
+        change_log_ = nullptr;
+        map_directory_ = nullptr;
+        syncer_running_ = false;
+    }
+
+    inline void reset() {
+        /*
+         do not call if you have static or other active shared tables in your app - they'll all become invalidated and
+         your app will hang\crash; so you should either call reset() before anything else or restart app immediately
+         after reset()
+         removes the backing of the attached segment: its file if it's file backed, the shm object otherwise
+        */
+        if (file_segment_ != nullptr) {
+            bip::file_mapping::remove(segment_file_.c_str());
+        } else {
+            bip::shared_memory_object::remove(SHMEM_SEG_NAME);
+        }
+        detach();
+        return;
+    }
+
+    inline uint64_t segment_size() {
+        assert(segment_);
+        return segment_->get_size();
+    }
+
+    // bytes of the segment taken by blocks, whether or not the backing has room for the rest
+    inline uint64_t segment_used() {
+        assert(segment_);
+        return memory_algorithm(segment_)->used_memory();
+    }
+
+    /*
+     offline growth: remaps the segment, so no other process may have it attached (and no map of this process may be
+     used afterwards); new segments don't need it, see SHMAPS_SEG_RESERVE
+    */
+    inline uint64_t grow(uint64_t add_size) {
+        assert(segment_);
+        uint64_t cur_seg_size = segment_size();
+        if (file_segment_ != nullptr) {
+            delete file_segment_;
+            FileSegment::grow(segment_file_.c_str(), add_size);
+            segment_ = file_segment_ = new FileSegment(bip::open_only, segment_file_.c_str());
+        } else {
+            delete shm_segment_;
+            ShmSegment::grow(shmem_seg_name.c_str(), add_size);
+            segment_ = shm_segment_ = new ShmSegment(bip::open_only, shmem_seg_name.c_str());
+        }
+        slab_pool_ = segment_->find<SlabPool>("shmaps_slab_pool").first;
+        coarse_clock_ = segment_->find<CoarseClock>("shmaps_coarse_clock").first;
+        gate_ = nullptr;
+        ++gate_epoch_;
+        change_log_ = nullptr;
+        map_directory_ = nullptr;
+        assert(segment_size() == cur_seg_size + add_size);
+        return cur_seg_size + add_size;
+    }
+
+    /*
+     how the segment is backed, applied by init() (or advise() later on).
+     by default it's a shm object, file puts it in a file instead (e.g. on NVMe or a DAX mount): the segment survives
+     reboots, may be larger than RAM and its pages are read in as they're touched; sync tells how dirty pages get
+     written back (see sync()). the file is sparse, created with SHMAPS_SEG_RESERVE bytes like the shm object.
+     page options are best effort and Linux-only. huge pages are transparent ones on the shm object (they also need
+     /sys/kernel/mm/transparent_hugepage/shmem_enabled set to advise or always), for hugetlbfs put the file there;
+     numa policies only apply to a shm object.
+    */
+    struct SegmentOptions {
+        enum class Sync {
+            None,           // writeback is left to the kernel, sync() does nothing
+            OnDemand,       // sync() msyncs
+            Periodic        // sync() msyncs, and so does a background thread every sync_interval
+        };
+
+        enum class Numa {
+            Unchanged,
+            Local,          // back to the default policy: allocate on the node of the faulting cpu
+            Interleave,     // spread pages round-robin over numa_nodes
+            Bind            // allocate on numa_nodes only
+        };
+
+        bool huge_pages = false;    // madvise(MADV_HUGEPAGE) the whole segment
+        bool populate = false;      // pre-fault the first init() size bytes, so first accesses don't page fault
+        Numa numa = Numa::Unchanged;
+        unsigned long numa_nodes = 0;   // node mask for Interleave\Bind, 0 - all online nodes
+        std::string file;           // backing file, empty - shm object
+        Sync sync = Sync::OnDemand;
+        std::chrono::milliseconds sync_interval{1000};
+    };
+
+    inline std::atomic<SegmentOptions::Sync> sync_policy_{SegmentOptions::Sync::None};
+
+    /*
+     writes a file backed segment's dirty pages back to the file and waits for it (msync(MS_SYNC)); whatever was
+     written before the call is durable once it returns true. nothing to do for a shm segment or Sync::None.
+    */
+    inline bool sync() {
+        if (file_segment_ == nullptr || sync_policy_ == SegmentOptions::Sync::None) {
+            return true;
+        }
+        if (msync(segment_->get_address(), segment_size(), MS_SYNC) != 0) {
+            std::cout << "shmaps: msync failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    inline void start_syncer(std::chrono::milliseconds interval) {
+        static bool atfork_registered = (pthread_atfork(nullptr, nullptr, [] { syncer_running_ = false; }) == 0);
+        (void) atfork_registered;
+        if (syncer_running_.exchange(true)) {
+            return;
+        }
+        std::thread([interval] {
+            while (syncer_running_) {
+                std::this_thread::sleep_for(interval);
+                if (syncer_running_) {
+                    sync();
+                }
+            }
+        }).detach();
+    }
+
+    // mask of online numa nodes (node 0 only if it's unknown)
+    inline unsigned long numa_online_nodes() {
+        unsigned long mask = 0;
+        FILE *f = fopen("/sys/devices/system/node/online", "r");
+        if (f != nullptr) {
+            // e.g. "0-3,6"
+            unsigned long from, to;
+            int n;
+            while ((n = fscanf(f, "%lu-%lu", &from, &to)) >= 1) {
+                if (n == 1) {
+                    to = from;
+                }
+                for (unsigned long node = from; node <= to && node < sizeof(mask) * 8; ++node) {
+                    mask |= 1UL << node;
+                }
+                if (fgetc(f) != ',') {
+                    break;
+                }
+            }
+            fclose(f);
+        }
+        return mask ? mask : 1UL;
+    }
+
+    // applies opts to segment (the default one if null), populating (if asked) its first size bytes; false on failure
+    inline bool advise(const SegmentOptions &opts, uint64_t size, ManagedSegment *segment = nullptr) {
+        segment = segment != nullptr ? segment : segment_;
+        assert(segment);
+        bool res = true;
+#ifdef __linux__
+        char *addr = static_cast<char *>(segment->get_address());
+        const uint64_t len = segment->get_size();
+        if (opts.numa != SegmentOptions::Numa::Unchanged) {
+            // mbind() sets the shm object's own policy, so it's shared by every process and applies to new pages
+            const int modes[] = {0, 0 /* MPOL_DEFAULT */, 3 /* MPOL_INTERLEAVE */, 2 /* MPOL_BIND */};
+            const int mode = modes[static_cast<int>(opts.numa)];
+            unsigned long nodes = opts.numa_nodes ? opts.numa_nodes : numa_online_nodes();
+            if (syscall(SYS_mbind, addr, len, mode, mode ? &nodes : nullptr, mode ? sizeof(nodes) * 8 : 0, 0) != 0) {
+                std::cout << "shmaps: mbind failed: " << strerror(errno) << std::endl;
+                res = false;
+            }
+        }
+        if (opts.huge_pages && madvise(addr, len, MADV_HUGEPAGE) != 0) {
+            std::cout << "shmaps: madvise(MADV_HUGEPAGE) failed: " << strerror(errno) << std::endl;
+            res = false;
+        }
+        if (opts.populate) {
+            const uint64_t populate_len = std::min(size, len);
+            if (madvise(addr, populate_len, MADV_POPULATE_WRITE) != 0) {
+                // pre 5.14 kernels: fault the pages in one by one, a read fault allocates a shm page as well
+                const long page_size = sysconf(_SC_PAGESIZE);
+                for (uint64_t off = 0; off < populate_len; off += page_size) {
+                    (void) *static_cast<volatile char *>(addr + off);
+                }
+            }
+        }
+#else
+        if (opts.huge_pages || opts.populate || opts.numa != SegmentOptions::Numa::Unchanged) {
+            std::cout << "shmaps: segment options are only supported on Linux" << std::endl;
+            res = false;
+        }
+#endif
+        return res;
+    }
+
+    inline uint64_t init(uint64_t size, const SegmentOptions &opts = SegmentOptions()) {
+        if (segment_ == nullptr) {
+            if (!opts.file.empty()) {
+                // no retry like for the shm object: a file which can't be opened is never reset
+                segment_ = file_segment_ = new FileSegment(bip::open_or_create, opts.file.c_str(),
+                                                                        std::max<uint64_t>(size, SHMAPS_SEG_RESERVE));
+                segment_file_ = opts.file;
+                sync_policy_ = opts.sync;
+                if (opts.sync == SegmentOptions::Sync::Periodic) {
+                    start_syncer(opts.sync_interval);
+                }
+            } else {
+                try {
+                    segment_ = shm_segment_ = new ShmSegment(
+                            bip::open_or_create, SHMEM_SEG_NAME, std::max<uint64_t>(size, SHMAPS_SEG_RESERVE));
+                }
+                catch (const std::exception &exc) {
+                    std::cout << "error creating shared memory segment: " << exc.what() << std::endl;
+                    // try again
+                    reset();
+                    segment_ = shm_segment_ = new ShmSegment(
+                            bip::open_or_create, SHMEM_SEG_NAME, std::max<uint64_t>(size, SHMAPS_SEG_RESERVE));
+                }
+            }
+            assert(segment_ != nullptr);
+            memory_algorithm(segment_)->set_backing(backing_path(SHMEM_SEG_NAME, opts.file));
+            slab_pool_ = segment_->find_or_construct<SlabPool>("shmaps_slab_pool")(segment_->get_segment_manager());
+            assert(slab_pool_ != nullptr);
+            coarse_clock_ = segment_->find_or_construct<CoarseClock>("shmaps_coarse_clock")();
+            assert(coarse_clock_ != nullptr);
+            coarse_clock_.load()->attach();
+            seg_alloc = new VoidAllocator(segment_->get_segment_manager());
+            assert(seg_alloc != nullptr);
+        }
+        if (segment_size() < size) {
+            /*
+             only an existing segment can be smaller: one created with a smaller reserve (or by an older version), or
+             a request beyond SHMAPS_SEG_RESERVE; other processes may be attached to it, so it can't be grown here
+            */
+            std::cout << "shmaps segment is smaller than requested (" << segment_size() << " < " << size
+                      << " bytes), reset it to use the new size" << std::endl;
+        }
+        advise(opts, size);
+        return segment_size();
+    }
+
+    /*
+     a segment of its own for maps which shouldn't share the default one (see Map(Segment &, name)): its own size,
+     allocator, clock and lifetime, so its maps don't contend with others on the segment manager, can't starve them
+     of memory and go away with it. opens the shm object name (the file opts ask for instead), creating it with size
+     bytes - its cap, unlike the default segment there's no reserve beyond it; throws bip::interprocess_exception if
+     it can't. snapshots, the change log and grow() are the default segment's; sync() is on demand only.
+     keys and payloads with allocator members (String etc.) must be built with its alloc(), not seg_alloc.
+     destroying the object unmaps the segment, its maps must not be used anymore.
+    */
+    class Segment {
+    public:
+        Segment(const std::string &name, uint64_t size, const SegmentOptions &opts = SegmentOptions()) :
+                name_(name), file_(opts.file), sync_policy_(opts.sync) {
+            if (file_.empty()) {
+                shm_segment_ = new ShmSegment(bip::open_or_create, name_.c_str(), size);
+                context_.segment = shm_segment_;
+            } else {
+                file_segment_ = new FileSegment(bip::open_or_create, file_.c_str(), size);
+                context_.segment = file_segment_;
+            }
+            SegmentManager *segment_manager = context_.segment->get_segment_manager();
+            memory_algorithm(context_.segment)->set_backing(backing_path(name_, file_));
+            context_.pool = context_.segment->find_or_construct<SlabPool>("shmaps_slab_pool")(segment_manager);
+            context_.clock = context_.segment->find_or_construct<CoarseClock>("shmaps_coarse_clock")();
+            context_.clock->attach();
+            context_.clock->tick();
+#ifndef SHMAPS_DISABLE_SLAB
+            context_.alloc = new VoidAllocator(context_.pool);
+#else
+            context_.alloc = new VoidAllocator(segment_manager);
+#endif
+            for (clock_slot_ = 0; clock_slot_ < MAX_SEGMENTS; ++clock_slot_) {
+                CoarseClock *free_slot = nullptr;
+                if (segment_clocks_[clock_slot_].compare_exchange_strong(free_slot, context_.clock)) {
+                    break;
+                }
+            }
+            assert(clock_slot_ < MAX_SEGMENTS);
+            advise(opts, size, context_.segment);
+        }
+
+        ~Segment() {
+            segment_clocks_[clock_slot_] = nullptr;
+            ++gate_epoch_;
+            delete context_.alloc;
+            delete shm_segment_;
+            delete file_segment_;
+        }
+
+        Segment(const Segment &) = delete;
+
+        Segment &operator=(const Segment &) = delete;
+
+        const std::string &name() const {
+            return name_;
+        }
+
+        ManagedSegment *managed() const {
+            return context_.segment;
+        }
+
+        // for Strings and other payload members of the segment's maps
+        VoidAllocator &alloc() const {
+            return *context_.alloc;
+        }
+
+        uint64_t size() const {
+            return context_.segment->get_size();
+        }
+
+        uint64_t free_memory() const {
+            return context_.segment->get_free_memory();
+        }
+
+        // see shmaps::sync()
+        bool sync() {
+            if (file_segment_ == nullptr || sync_policy_ == SegmentOptions::Sync::None) {
+                return true;
+            }
+            if (msync(context_.segment->get_address(), size(), MS_SYNC) != 0) {
+                std::cout << "shmaps: msync failed: " << strerror(errno) << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // removes the backing: the memory is freed once every process destroyed its Segment object
+        void remove() {
+            file_.empty() ? bip::shared_memory_object::remove(name_.c_str()) : bip::file_mapping::remove(file_.c_str());
+        }
+
+        SegmentContext *context() const {
+            return &context_;
+        }
+
+    private:
+        std::string name_;
+        std::string file_;
+        SegmentOptions::Sync sync_policy_;
+        ShmSegment *shm_segment_ = nullptr;
+        FileSegment *file_segment_ = nullptr;
+        mutable SegmentContext context_;
+        uint clock_slot_;
+    };
+
+    // makes the calling thread's map operations use segment (the default one if null) until the scope ends
+    class SegmentScope {
+    public:
+        explicit SegmentScope(const Segment *segment) : prev_(segment_context_) {
+            segment_context_ = segment != nullptr ? segment->context() : nullptr;
+        }
+
+        ~SegmentScope() {
+            segment_context_ = prev_;
+        }
+
+        SegmentScope(const SegmentScope &) = delete;
+
+        SegmentScope &operator=(const SegmentScope &) = delete;
+
+    private:
+        SegmentContext *prev_;
+    };
+
+    inline TimePoint now() {
+        return std::chrono::steady_clock::now();
+    }
+
+
+    /*
+     per-map counters, sharded by cpu: an operation adds to the shard of the cpu it runs on, so processes on different
+     cpus don't fight over the same cache lines; shards are only summed up by snapshot()\print().
+     define SHMAPS_DISABLE_STATS to compile the counting out entirely.
+    */
+    struct Stats {
+        // plain counters: collected by one operation (or a whole batch) and added to a shard in one go
+        struct Counters {
+            uint64_t insert_total = 0;
+            uint64_t insert_expiring = 0;
+            uint64_t insert_permanent = 0;
+            uint64_t insert_error = 0;
+            uint64_t update = 0;
+            uint64_t purge_total = 0;
+            uint64_t purge_hit = 0;
+            uint64_t sweep_total = 0;
+            uint64_t sweep_hit = 0;
+            uint64_t evict = 0;
+            uint64_t del = 0;
+            uint64_t read_total = 0;
+            uint64_t read_hit = 0;
+            uint64_t read_miss = 0;
+
+            void inserted(Seconds expires) {
+                ++insert_total;
+                if (expires != Seconds(0)) {
+                    ++insert_expiring;
+                } else {
+                    ++insert_permanent;
+                }
+            }
+
+            void read(bool hit) {
+                ++read_total;
+                hit ? ++read_hit : ++read_miss;
+            }
+        };
+
+        struct Shard {
+            std::atomic<uint64_t> insert_total;
+            std::atomic<uint64_t> insert_expiring;
+            std::atomic<uint64_t> insert_permanent;
+            std::atomic<uint64_t> insert_error;
+            std::atomic<uint64_t> update;
+            std::atomic<uint64_t> purge_total;
+            std::atomic<uint64_t> purge_hit;
+            std::atomic<uint64_t> sweep_total;
+            std::atomic<uint64_t> sweep_hit;
+            std::atomic<uint64_t> evict;
+            std::atomic<uint64_t> del;
+            std::atomic<uint64_t> read_total;
+            std::atomic<uint64_t> read_hit;
+            std::atomic<uint64_t> read_miss;
+            // segment blocks are only 16-byte aligned, a full line of padding keeps neighbouring shards apart
+            char pad[64];
+        };
+
+        Shard shards[STATS_SHARDS];
+
+        void add(const Counters &c) {
+#ifndef SHMAPS_DISABLE_STATS
+            Shard &shard = shards[shard_index()];
+            if (c.insert_total) {
+                shard.insert_total.fetch_add(c.insert_total, std::memory_order_relaxed);
+                shard.insert_expiring.fetch_add(c.insert_expiring, std::memory_order_relaxed);
+                shard.insert_permanent.fetch_add(c.insert_permanent, std::memory_order_relaxed);
+            }
+            if (c.insert_error) {
+                shard.insert_error.fetch_add(c.insert_error, std::memory_order_relaxed);
+            }
+            if (c.update) {
+                shard.update.fetch_add(c.update, std::memory_order_relaxed);
+            }
+            if (c.purge_total) {
+                shard.purge_total.fetch_add(c.purge_total, std::memory_order_relaxed);
+                shard.purge_hit.fetch_add(c.purge_hit, std::memory_order_relaxed);
+            }
+            if (c.sweep_total) {
+                shard.sweep_total.fetch_add(c.sweep_total, std::memory_order_relaxed);
+                shard.sweep_hit.fetch_add(c.sweep_hit, std::memory_order_relaxed);
+            }
+            if (c.evict) {
+                shard.evict.fetch_add(c.evict, std::memory_order_relaxed);
+            }
+            if (c.del) {
+                shard.del.fetch_add(c.del, std::memory_order_relaxed);
+            }
+            if (c.read_total) {
+                shard.read_total.fetch_add(c.read_total, std::memory_order_relaxed);
+                shard.read_hit.fetch_add(c.read_hit, std::memory_order_relaxed);
+                shard.read_miss.fetch_add(c.read_miss, std::memory_order_relaxed);
+            }
+#endif
+        }
+
+        Counters snapshot() const {
+            Counters c;
+            for (const Shard &shard: shards) {
+                c.insert_total += shard.insert_total.load(std::memory_order_relaxed);
+                c.insert_expiring += shard.insert_expiring.load(std::memory_order_relaxed);
+                c.insert_permanent += shard.insert_permanent.load(std::memory_order_relaxed);
+                c.insert_error += shard.insert_error.load(std::memory_order_relaxed);
+                c.update += shard.update.load(std::memory_order_relaxed);
+                c.purge_total += shard.purge_total.load(std::memory_order_relaxed);
+                c.purge_hit += shard.purge_hit.load(std::memory_order_relaxed);
+                c.sweep_total += shard.sweep_total.load(std::memory_order_relaxed);
+                c.sweep_hit += shard.sweep_hit.load(std::memory_order_relaxed);
+                c.evict += shard.evict.load(std::memory_order_relaxed);
+                c.del += shard.del.load(std::memory_order_relaxed);
+                c.read_total += shard.read_total.load(std::memory_order_relaxed);
+                c.read_hit += shard.read_hit.load(std::memory_order_relaxed);
+                c.read_miss += shard.read_miss.load(std::memory_order_relaxed);
+            }
+            return c;
+        }
+
+        void print() const {
+#ifdef SHMAPS_DISABLE_STATS
+            fprintf(stdout, "    stats disabled\n");
+#else
+            Counters c = snapshot();
+            fprintf(stdout, "    stats\n"
+                            "        inserts: %lu (%lu%% expiring, %lu%% errors)\n"
+                            "        updates: %lu\n"
+                            "        purges: %lu/%lu (%lu%% hits)\n"
+                            "        sweeps: %lu/%lu (%lu%% hits)\n"
+                            "        evictions: %lu\n"
+                            "        deletes: %lu\n"
+                            "        reads: %lu/%lu (%lu%% hits)\n",
+                    c.insert_total,
+                    c.insert_total ? c.insert_expiring * 100 / c.insert_total : 0,
+                    c.insert_total ? c.insert_error * 100 / c.insert_total : 0,
+                    c.update,
+                    c.purge_hit,
+                    c.purge_total,
+                    c.purge_total ? c.purge_hit * 100 / c.purge_total : 0,
+                    c.sweep_hit,
+                    c.sweep_total,
+                    c.sweep_total ? c.sweep_hit * 100 / c.sweep_total : 0,
+                    c.evict,
+                    c.del,
+                    c.read_hit,
+                    c.read_total,
+                    c.read_total ? c.read_hit * 100 / c.read_total : 0);
+#endif
+        }
+
+    private:
+        static uint shard_index() {
+            int cpu = sched_getcpu();
+            return cpu < 0 ? 0 : static_cast<uint>(cpu) % STATS_SHARDS;
+        }
+    };
+
+    // start time of a process (in clock ticks since boot), 0 if it's unknown (no procfs)
+    inline uint64_t process_start_time(pid_t pid) {
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+        FILE *f = fopen(path, "r");
+        if (f == nullptr) {
+            return 0;
+        }
+        char buf[1024];
+        size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[len] = '\0';
+        // comm (2nd field) may contain spaces, fields are counted from the last ')'; starttime is the 22nd one
+        const char *p = strrchr(buf, ')');
+        for (int field = 2; p != nullptr && field < 22; ++field) {
+            p = strchr(p + 1, ' ');
+        }
+        return p ? strtoull(p + 1, nullptr, 10) : 0;
+    }
+
+    inline std::atomic<uint64_t> process_token_{0};
+
+    /*
+     identifies a process incarnation in StripeLocks: pid in the high half, start time in the low 31 bits (so a
+     recycled pid doesn't pass for the dead owner), bit 31 is left for the owner's "in table" flag
+    */
+    inline uint64_t process_token() {
+        uint64_t token = process_token_.load(std::memory_order_relaxed);
+        if (token == 0) {
+            static bool atfork_registered = (pthread_atfork(nullptr, nullptr, [] { process_token_ = 0; }) == 0);
+            (void) atfork_registered;
+            pid_t pid = getpid();
+            token = (static_cast<uint64_t>(pid) << 32) | (process_start_time(pid) & 0x7fffffff);
+            process_token_ = token;
+        }
+        return token;
+    }
+
+    inline bool process_alive(uint64_t token) {
+        pid_t pid = static_cast<pid_t>(token >> 32);
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            return false;
+        }
+        uint64_t start_time = process_start_time(pid);
+        return start_time == 0 || (start_time & 0x7fffffff) == (token & 0x7fffffff);
+    }
+
+    /*
+     robust locks which map writes take (by key hash) before they go into the table, reads only wait for a writer
+     in the table on their stripe (see pass()). a stripe's owner word records who holds it (see process_token()) and
+     whether the holder is inside the table right now, for which key and whether the call may take every bucket lock
+     of the key's shard (an insert, which may displace entries or resize). a waiter which finds the owner dead takes
+     the stripe over; if the owner died inside the table, recover(hash, whole_shard) is called first with what the
+     dead call may have held, so those bucket locks can be quarantined (see ShardedTable::quarantine()).
+     readers hold bucket locks in the table too (and run their callbacks there), they're recorded in reader slots
+     instead, see read().
+    */
+    struct StripeLocks {
+        static const uint64_t IN_TABLE = 1UL << 31;
+
+        // a reader in the table, see read()
+        struct Reader {
+            std::atomic<uint64_t> owner;    // process_token() of the reader, | IN_TABLE once hash is set; 0 if free
+            std::atomic<std::size_t> hash;
+            // segment blocks are only 16-byte aligned, a full line of padding keeps neighbouring slots apart
+            char pad[64];
+        };
+
+        std::atomic<uint64_t> owners[ROBUST_STRIPES];
+        // the key hash a holder in the table is there for, and whether its call may take the whole shard
+        std::atomic<std::size_t> hashes[ROBUST_STRIPES];
+        std::atomic<bool> whole_shard[ROBUST_STRIPES];
+        Reader readers[READER_SLOTS];
+
+        template<typename F>
+        void lock(std::size_t hash, F recover) {
+            static thread_local uint locks = 0;
+            if (++locks % READER_CHECK_LOCKS == 0) {
+                recover_readers(recover);
+            }
+            const std::size_t s = hash % ROBUST_STRIPES;
+            const uint64_t me = process_token();
+            for (uint spins = 1;; ++spins) {
+                uint64_t cur = owners[s].load(std::memory_order_relaxed);
+                if (cur == 0) {
+                    if (owners[s].compare_exchange_weak(cur, me, std::memory_order_acquire)) {
+                        return;
+                    }
+                    continue;
+                }
+                if (spins % ROBUST_SPINS == 0) {
+                    if (take_over(s, cur, me, recover)) {
+                        return;
+                    }
+                    sched_yield();
+                }
+            }
+        }
+
+        void lock(std::size_t hash) {
+            lock(hash, [](std::size_t, bool) {});
+        }
+
+        // waits while a writer is in the table on the stripe of hash; a dead one is taken over (and let go)
+        template<typename F>
+        void pass(std::size_t hash, F recover) {
+            const std::size_t s = hash % ROBUST_STRIPES;
+            for (uint spins = 1;; ++spins) {
+                const uint64_t cur = owners[s].load(std::memory_order_acquire);
+                if (!(cur & IN_TABLE)) {
+                    return;
+                }
+                if (spins % ROBUST_SPINS == 0) {
+                    if (take_over(s, cur, process_token(), recover)) {
+                        unlock(hash);
+                        return;
+                    }
+                    sched_yield();
+                }
+            }
+        }
+
+        void enter(std::size_t hash, bool whole) {
+            const std::size_t s = hash % ROBUST_STRIPES;
+            hashes[s].store(hash, std::memory_order_relaxed);
+            whole_shard[s].store(whole, std::memory_order_relaxed);
+            owners[s].store(process_token() | IN_TABLE, std::memory_order_release);
+        }
+
+        void leave(std::size_t hash) {
+            owners[hash % ROBUST_STRIPES].store(process_token(), std::memory_order_release);
+        }
+
+        void unlock(std::size_t hash) {
+            owners[hash % ROBUST_STRIPES].store(0, std::memory_order_release);
+        }
+
+        /*
+         runs f(), a read in the table for hash, recorded in a reader slot: a reader killed in there (in a callback
+         of with_value() say) leaves the key's bucket locks locked, recover_readers() finds it and has them
+         quarantined like a dead writer's. a thread looks for dead readers once every READER_CHECK_LOCKS stripe locks
+         it takes, Map::quarantined() and Map::repair() look every time; a writer which needs such a bucket lock
+         before then waits for it in the table.
+        */
+        template<typename R, typename F>
+        auto read(std::size_t hash, R recover, F f) -> decltype(f()) {
+            static thread_local std::size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+            const uint64_t me = process_token();
+            std::size_t i = hint % READER_SLOTS;
+            for (uint spins = 1;; ++spins, i = (i + 1) % READER_SLOTS) {
+                uint64_t cur = readers[i].owner.load(std::memory_order_relaxed);
+                if (cur == 0 && readers[i].owner.compare_exchange_weak(cur, me, std::memory_order_acquire)) {
+                    break;
+                }
+                // every slot taken: by readers killed outside the table too, maybe
+                if (spins % (ROBUST_SPINS * READER_SLOTS) == 0) {
+                    recover_readers(recover);
+                } else if (spins % READER_SLOTS == 0) {
+                    sched_yield();
+                }
+            }
+            hint = i;
+            struct Leave {
+                std::atomic<uint64_t> &owner;
+
+                ~Leave() {
+                    owner.store(0, std::memory_order_release);
+                }
+            } leave{readers[i].owner};
+            readers[i].hash.store(hash, std::memory_order_relaxed);
+            readers[i].owner.store(me | IN_TABLE, std::memory_order_release);
+            return f();
+        }
+
+        // frees the reader slots of dead processes, calling recover(hash, false) for those which died in the table
+        template<typename F>
+        void recover_readers(F &recover) {
+            for (Reader &reader: readers) {
+                uint64_t cur = reader.owner.load(std::memory_order_acquire);
+                if (cur == 0 || (cur >> 32) == (process_token() >> 32) || process_alive(cur)) {
+                    continue;
+                }
+                const std::size_t hash = reader.hash.load(std::memory_order_relaxed);
+                if (reader.owner.compare_exchange_strong(cur, 0) && (cur & IN_TABLE)) {
+                    recover(hash, false);
+                }
+            }
+        }
+
+        // runs f() marked in the table for hash, whose stripe the caller holds
+        template<typename F>
+        auto in_table(std::size_t hash, F f, bool whole = false) -> decltype(f()) {
+            struct Leave {
+                StripeLocks *locks;
+                std::size_t hash;
+
+                ~Leave() {
+                    locks->leave(hash);
+                }
+            } leave{this, hash};
+            enter(hash, whole);
+            return f();
+        }
+
+    private:
+        // takes stripe s over from cur if that process is dead, after recovering what it held in the table
+        template<typename F>
+        bool take_over(std::size_t s, uint64_t cur, uint64_t me, F &recover) {
+            if (process_alive(cur) || !owners[s].compare_exchange_strong(cur, me, std::memory_order_acquire)) {
+                return false;
+            }
+            if (cur & IN_TABLE) {
+                recover(hashes[s].load(std::memory_order_relaxed), whole_shard[s].load(std::memory_order_relaxed));
+            }
+            return true;
+        }
+    };
+
+    // holds a StripeLocks stripe for its lifetime, table calls go through in_table()
+    class StripeGuard {
+    public:
+        template<typename F>
+        StripeGuard(StripeLocks *locks, std::size_t hash, F recover) : locks_(locks), hash_(hash) {
+            locks_->lock(hash, recover);
+        }
+
+        StripeGuard(StripeLocks *locks, std::size_t hash) : locks_(locks), hash_(hash) {
+            locks_->lock(hash);
+        }
+
+        ~StripeGuard() {
+            locks_->unlock(hash_);
+        }
+
+        StripeGuard(const StripeGuard &) = delete;
+
+        StripeGuard &operator=(const StripeGuard &) = delete;
+
+        // whole: the call may take every bucket lock of the key's shard (see StripeLocks)
+        template<typename F>
+        auto in_table(F f, bool whole = false) -> decltype(f()) {
+            return locks_->in_table(hash_, f, whole);
+        }
+
+    private:
+        StripeLocks *locks_;
+        std::size_t hash_;
+    };
+
+    // a full memory barrier on every running thread of every process (see Gate), false if the kernel can't
+    inline bool global_barrier() {
+#if defined(__linux__) && defined(SYS_membarrier)
+        return syscall(SYS_membarrier, MEMBARRIER_CMD_GLOBAL, 0) == 0;
+#else
+        return false;
+#endif
+    }
+
+    inline bool global_barrier_supported() {
+#if defined(__linux__) && defined(SYS_membarrier)
+        static const long commands = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0);
+        return commands > 0 && (commands & MEMBARRIER_CMD_GLOBAL);
+#else
+        return false;
+#endif
+    }
+
+    /*
+     lets snapshot() stop map operations for a consistent copy of the segment: every operation holds a GatePass while
+     it's in the segment, counted in a slot of its thread; snapshot() closes the gate and waits for the passes of
+     live processes to drain (a process killed in an operation leaves its pass behind), operations arriving meanwhile
+     wait for the gate to reopen. a gate left closed by a dead process is reopened by the waiters.
+     a thread is the only writer of its slot's count, so where the kernel has a global barrier (membarrier()) a pass is
+     a plain increment and a plain load of closed_by, with no locked instruction or fence: close() issues the barrier
+     between closing and reading the counts instead, which orders every running thread's pass against it. otherwise a
+     pass is a seq_cst increment and load, paired with close()'s seq_cst ones. threads beyond GATE_SLOTS live ones
+     share an overflow count the seq_cst way, a killed one's pass there makes closing time out.
+     define SHMAPS_DISABLE_SNAPSHOT to compile the passes (and snapshot()) out.
+    */
+    struct Gate {
+        struct Slot {
+            std::atomic<uint64_t> owner;    // process_token() of the process using the slot, 0 if free
+            std::atomic<int64_t> passes;
+            // segment blocks are only 16-byte aligned, a full line of padding keeps neighbouring slots apart
+            char pad[64];
+        };
+
+        std::atomic<uint64_t> closed_by{0};     // process_token() of the closing process, 0 if open
+        // set once some process passes without a fence, close() needs the global barrier from then on
+        std::atomic<bool> unfenced{false};
+        std::atomic<int64_t> overflow{0};
+        Slot slots[GATE_SLOTS];
+
+        // the slot the pass is counted in, GATE_SLOTS for the overflow count
+        uint enter() {
+            Claim &claim = this->claim();
+            const uint slot = claim.owned ? claim.slot : GATE_SLOTS;
+            for (uint spins = 1;; ++spins) {
+                uint64_t owner = closed_by.load(std::memory_order_acquire);
+                if (owner == 0) {
+                    if (claim.unfenced) {
+                        std::atomic<int64_t> &passes = slots[slot].passes;
+                        passes.store(passes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                        std::atomic_signal_fence(std::memory_order_seq_cst);
+                        owner = closed_by.load(std::memory_order_acquire);
+                    } else {
+                        // seq_cst both here and in close(): either the closer sees the pass or the pass sees it closed
+                        counter(slot).fetch_add(1);
+                        owner = closed_by.load();
+                        // the first seq_cst pass of an owned slot announces the unfenced ones after it
+                        if (owner == 0 && claim.owned && global_barrier_supported()) {
+                            unfenced.store(true);
+                            claim.unfenced = closed_by.load() == 0;
+                        }
+                    }
+                    if (owner == 0) {
+                        return slot;
+                    }
+                    leave(slot);
+                }
+                if (spins % ROBUST_SPINS == 0 && !process_alive(owner)) {
+                    closed_by.compare_exchange_strong(owner, 0);
+                }
+                if (spins < ROBUST_SPINS) {
+                    sched_yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+
+        void leave(uint slot) {
+            if (slot == GATE_SLOTS) {
+                overflow.fetch_sub(1, std::memory_order_release);
+            } else {
+                std::atomic<int64_t> &passes = slots[slot].passes;
+                passes.store(passes.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+            }
+        }
+
+        // closes the gate and waits for the passes to drain; false (and left open) on timeout or if already closed
+        bool close(std::chrono::seconds timeout) {
+            uint64_t open = 0;
+            if (!closed_by.compare_exchange_strong(open, process_token())) {
+                return false;
+            }
+            if (unfenced.load() && !global_barrier()) {
+                std::cout << "shmaps: can't close the gate, processes pass it unfenced and membarrier() failed"
+                          << std::endl;
+                reopen();
+                return false;
+            }
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            for (uint i = 0; i <= GATE_SLOTS; ++i) {
+                for (uint spins = 1; counter(i).load() != 0; ++spins) {
+                    uint64_t owner = i < GATE_SLOTS ? slots[i].owner.load() : 0;
+                    if (owner != 0 && spins % ROBUST_SPINS == 0 && !process_alive(owner)) {
+                        release(i, owner);
+                    } else if (std::chrono::steady_clock::now() > deadline) {
+                        reopen();
+                        return false;
+                    }
+                    sched_yield();
+                }
+            }
+            return true;
+        }
+
+        void reopen() {
+            closed_by = 0;
+        }
+
+        // a restored image comes with the slots of the processes which used the snapshotted segment
+        void reset() {
+            for (Slot &slot: slots) {
+                slot.passes = 0;
+                slot.owner = 0;
+            }
+            overflow = 0;
+            reopen();
+        }
+
+    private:
+        // gates (segments) a thread keeps a slot in at once, the least recently claimed one is given up beyond that
+        static const uint CLAIMS = 8;
+
+        struct Claim {
+            Gate *gate = nullptr;
+            int slot = -1;
+            bool owned = false;
+            // passes go without a fence, see enter()
+            bool unfenced = false;
+            uint64_t epoch = 0;
+
+            void release() {
+                if (owned && epoch == gate_epoch_.load()) {
+                    gate->slots[slot].owner = 0;
+                }
+                owned = false;
+            }
+        };
+
+        struct Claims {
+            Claim claims[CLAIMS];
+            uint next = 0;
+
+            ~Claims() {
+                for (Claim &claim: claims) {
+                    claim.release();
+                }
+            }
+        };
+
+        std::atomic<int64_t> &counter(uint slot) {
+            return slot == GATE_SLOTS ? overflow : slots[slot].passes;
+        }
+
+        // the calling thread's slot: threads of a process don't share a counter, a slot is freed when its thread exits
+        Claim &claim() {
+            static thread_local Claims claims;
+            const uint64_t epoch = gate_epoch_.load(std::memory_order_relaxed);
+            for (Claim &claim: claims.claims) {
+                if (claim.gate == this && claim.epoch == epoch) {
+                    return claim;
+                }
+            }
+            static bool atfork_registered = (pthread_atfork(nullptr, nullptr, [] { ++gate_epoch_; }) == 0);
+            (void) atfork_registered;
+            Claim &claim = claims.claims[claims.next++ % CLAIMS];
+            claim.release();
+            claim.gate = this;
+            claim.unfenced = false;
+            const uint64_t me = process_token();
+            const uint first = (std::hash<std::thread::id>()(std::this_thread::get_id()) ^ (me >> 32)) % GATE_SLOTS;
+            claim.slot = -1;
+            for (uint n = 0; claim.slot < 0; ++n) {
+                const uint i = (first + n) % GATE_SLOTS;
+                uint64_t owner = slots[i].owner.load();
+                if (owner != 0 && n >= GATE_SLOTS && !process_alive(owner)) {
+                    // second round: all slots were taken, reclaim the ones of dead processes
+                    release(i, owner);
+                    owner = 0;
+                }
+                if (owner == 0 && slots[i].owner.compare_exchange_strong(owner, me)) {
+                    claim.slot = i;
+                    claim.owned = true;
+                } else if (n == 2 * GATE_SLOTS) {
+                    // more live threads than slots: count in the overflow
+                    claim.slot = GATE_SLOTS;
+                    claim.owned = false;
+                }
+            }
+            claim.epoch = epoch;
+            return claim;
+        }
+
+        void release(uint i, uint64_t owner) {
+            slots[i].passes = 0;
+            slots[i].owner.compare_exchange_strong(owner, 0);
+        }
+    };
+
+    // the gate of the segment the calling thread's map operation is in
+    inline Gate *gate() {
+        std::atomic<Gate *> &gate_ptr = segment_context_ != nullptr ? segment_context_->gate : gate_;
+        Gate *gate = gate_ptr.load(std::memory_order_relaxed);
+        if (gate == nullptr) {
+            assert(active_segment() != nullptr);
+            gate = active_segment()->find_or_construct<Gate>("shmaps_gate")();
+            gate_ptr = gate;
+        }
+        return gate;
+    }
+
+    /*
+     a segment's directory of map handles (see Map::Handle): attaching to an existing map is a lock-free probe of this
+     open-addressing table instead of a named object search under the segment manager's lock. a new map's handle is
+     still created as a named object, under that lock, and published here; maps with longer names than
+     MAP_DIRECTORY_NAME, or past a full directory, are only found by name. an entry is free (0), being written (BUSY),
+     dropped (DROPPED, reusable, probes go past it) or holds the tagged hash of its name.
+    */
+    struct MapDirectory {
+        static const uint64_t BUSY = 1;
+        static const uint64_t DROPPED = 2;
+
+        struct Entry {
+            std::atomic<uint64_t> key{0};
+            char name[MAP_DIRECTORY_NAME];
+            bip::offset_ptr<void> handle;
+        };
+
+        void *find(std::string_view name) const {
+            const uint64_t key = tag(name);
+            for (uint n = 0; n < MAP_DIRECTORY_SIZE; ++n) {
+                const Entry &entry = entries[(key + n) % MAP_DIRECTORY_SIZE];
+                const uint64_t cur = entry.key.load(std::memory_order_acquire);
+                if (cur == 0) {
+                    break;
+                }
+                if (cur == key && name == entry.name) {
+                    return entry.handle.get();
+                }
+            }
+            return nullptr;
+        }
+
+        // two processes publishing the same map at once may both add it, their entries point to the same handle
+        void publish(std::string_view name, void *handle) {
+            if (name.size() >= MAP_DIRECTORY_NAME) {
+                return;
+            }
+            const uint64_t key = tag(name);
+            for (uint n = 0; n < MAP_DIRECTORY_SIZE; ++n) {
+                Entry &entry = entries[(key + n) % MAP_DIRECTORY_SIZE];
+                uint64_t cur = entry.key.load(std::memory_order_acquire);
+                if (cur == key && name == entry.name) {
+                    return;
+                }
+                if ((cur == 0 || cur == DROPPED) && entry.key.compare_exchange_strong(cur, BUSY)) {
+                    memcpy(entry.name, name.data(), name.size());
+                    entry.name[name.size()] = '\0';
+                    entry.handle = handle;
+                    entry.key.store(key, std::memory_order_release);
+                    return;
+                }
+            }
+        }
+
+        void drop(std::string_view name) {
+            const uint64_t key = tag(name);
+            for (uint n = 0; n < MAP_DIRECTORY_SIZE; ++n) {
+                Entry &entry = entries[(key + n) % MAP_DIRECTORY_SIZE];
+                uint64_t cur = entry.key.load(std::memory_order_acquire);
+                if (cur == 0) {
+                    break;
+                }
+                if (cur == key && name == entry.name) {
+                    entry.key.compare_exchange_strong(cur, DROPPED);
+                }
+            }
+        }
+
+    private:
+        // never one of the special values: the top bit is set
+        static uint64_t tag(std::string_view name) {
+            return std::hash<std::string_view>()(name) | (1UL << 63);
+        }
+
+        Entry entries[MAP_DIRECTORY_SIZE];
+    };
+
+    // the directory of the segment the calling thread's map operation is in
+    inline MapDirectory *map_directory() {
+        std::atomic<MapDirectory *> &directory_ptr =
+                segment_context_ != nullptr ? segment_context_->directory : map_directory_;
+        MapDirectory *directory = directory_ptr.load(std::memory_order_relaxed);
+        if (directory == nullptr) {
+            assert(active_segment() != nullptr);
+            directory = active_segment()->find_or_construct<MapDirectory>("shmaps_map_directory")();
+            directory_ptr = directory;
+        }
+        return directory;
+    }
+
+    // held by map operations for as long as they're in the segment (the default one, unless given), see Gate
+    class GatePass {
+    public:
+#ifndef SHMAPS_DISABLE_SNAPSHOT
+        explicit GatePass(const Segment *segment = nullptr) : scope_(segment), gate_(gate()), shard_(gate_->enter()) {}
+
+        ~GatePass() {
+            gate_->leave(shard_);
+        }
+#else
+        explicit GatePass(const Segment *segment = nullptr) : scope_(segment) {}
+#endif
+
+        GatePass(const GatePass &) = delete;
+
+        GatePass &operator=(const GatePass &) = delete;
+
+    private:
+        SegmentScope scope_;
+#ifndef SHMAPS_DISABLE_SNAPSHOT
+        Gate *gate_;
+        uint shard_;
+#endif
+    };
+
+    /*
+     how keys and payloads are written to the change log (see ChangeLog): encode() appends a value's bytes to out,
+     decode() reads one from the front of in into v (built by make_value()). trivially copyable types, String and
+     Sets of those are covered; specialize it for other types (e.g. structs with String fields) to log their maps.
+    */
+    template<class T, class = void>
+    struct LogCodec {
+        static constexpr bool supported = false;
+    };
+
+    template<class T>
+    struct LogCodec<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+        static constexpr bool supported = true;
+
+        static void encode(const T &v, std::string &out) {
+            out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+        }
+
+        static bool decode(std::string_view &in, T &v) {
+            if (in.size() < sizeof(T)) {
+                return false;
+            }
+            memcpy(static_cast<void *>(&v), in.data(), sizeof(T));
+            in.remove_prefix(sizeof(T));
+            return true;
+        }
+    };
+
+    template<>
+    struct LogCodec<String> {
+        static constexpr bool supported = true;
+
+        // any string type as_view() takes, so heterogeneous keys are logged as they are
+        template<typename S>
+        static void encode(const S &v, std::string &out) {
+            std::string_view s = as_view(v);
+            LogCodec<uint32_t>::encode(s.size(), out);
+            out.append(s);
+        }
+
+        static bool decode(std::string_view &in, String &v) {
+            uint32_t size;
+            if (!LogCodec<uint32_t>::decode(in, size) || in.size() < size) {
+                return false;
+            }
+            v.assign(in.data(), size);
+            in.remove_prefix(size);
+            return true;
+        }
+    };
+
+    template<class T>
+    struct LogCodec<Set<T>, std::enable_if_t<LogCodec<T>::supported>> {
+        static constexpr bool supported = true;
+
+        static void encode(const Set<T> &v, std::string &out) {
+            LogCodec<uint32_t>::encode(v.size(), out);
+            for (const T &elem: v) {
+                LogCodec<T>::encode(elem, out);
+            }
+        }
+
+        static bool decode(std::string_view &in, Set<T> &v) {
+            uint32_t size;
+            if (!LogCodec<uint32_t>::decode(in, size)) {
+                return false;
+            }
+            v.clear();
+            for (uint32_t i = 0; i < size; ++i) {
+                T elem = make_value<T>();
+                if (!LogCodec<T>::decode(in, elem)) {
+                    return false;
+                }
+                v.insert(std::move(elem));
+            }
+            return true;
+        }
+    };
+
+    template<class T>
+    struct LogCodec<CompactSet<T>, std::enable_if_t<LogCodec<T>::supported>> {
+        static constexpr bool supported = true;
+
+        static void encode(const CompactSet<T> &v, std::string &out) {
+            LogCodec<uint32_t>::encode(v.size(), out);
+            for (const T &elem: v) {
+                LogCodec<T>::encode(elem, out);
+            }
+        }
+
+        static bool decode(std::string_view &in, CompactSet<T> &v) {
+            uint32_t size;
+            if (!LogCodec<uint32_t>::decode(in, size)) {
+                return false;
+            }
+            v.clear();
+            for (uint32_t i = 0; i < size; ++i) {
+                T elem = make_value<T>();
+                if (!LogCodec<T>::decode(in, elem)) {
+                    return false;
+                }
+                v.insert(std::move(elem));
+            }
+            return true;
+        }
+    };
+
+    enum class Durability : uint32_t {
+        None,       // not logged
+        Async,      // logged, the log writer fsyncs its records every flush interval (see open_log())
+        Sync        // logged, an operation returns once its record is fsynced (one fsync covers all waiting records)
+    };
+
+    enum class LogOp : uint8_t {
+        Set = 1,
+        Del,
+        Add,
+        Clear,
+        Remove
+    };
+
+    /*
+     a change log record: a header word (length including padding to 8 bytes in the low half, COMMITTED flag in the
+     high half), then this fixed part, then the map name, key and value bytes (see LogCodec)
+    */
+    struct LogRecord {
+        /*
+         header word: the record's length in the low 32 bits, COMMITTED once it's published; RESERVED with the pid of
+         the appender above OWNER_SHIFT while it's copied, both bits if the appender died (see ChangeLog::drain())
+        */
+        static const uint64_t COMMITTED = 1UL << 32;
+        static const uint64_t RESERVED = 1UL << 33;
+        static const uint64_t OWNER_SHIFT = 34;
+        static const uint64_t HEADER = sizeof(uint64_t);
+
+        struct Fixed {
+            LogOp op;
+            uint8_t name_size;
+            uint16_t pad;
+            uint32_t key_size;
+            uint32_t val_size;
+            uint32_t pad2;
+            int64_t expires_ms;     // wall clock ms the entry expires at, 0 - permanent
+        };
+
+        LogOp op;
+        int64_t expires_ms;
+        std::string_view name;
+        std::string_view key;
+        std::string_view val;
+
+        bool parse(std::string_view body) {
+            Fixed fixed;
+            if (body.size() < sizeof(fixed)) {
+                return false;
+            }
+            memcpy(&fixed, body.data(), sizeof(fixed));
+            body.remove_prefix(sizeof(fixed));
+            if (body.size() < uint64_t(fixed.name_size) + fixed.key_size + fixed.val_size) {
+                return false;
+            }
+            op = fixed.op;
+            expires_ms = fixed.expires_ms;
+            name = body.substr(0, fixed.name_size);
+            key = body.substr(fixed.name_size, fixed.key_size);
+            val = body.substr(fixed.name_size + fixed.key_size, fixed.val_size);
+            return true;
+        }
+    };
+
+    /*
+     segment-wide change log of the maps set to a Durability: their changes are appended to a ring in the segment as
+     records, under the key's stripe lock (so the records of a key are in the order its changes were made), and the
+     process which opened the log (see open_log()) writes them to a file from a thread, a batch per write and fsync.
+     a record's position in the stream is its offset in the file. a record is published by its header word alone,
+     the writer zeroes what it consumed before the space is reused. a record whose appender died before publishing it
+     goes to the file as a gap; only a death right between taking the space and marking it reserved stalls the log.
+    */
+    struct ChangeLog {
+        std::atomic<uint64_t> head{0};      // end of the records appended so far
+        std::atomic<uint64_t> tail{0};      // records before it are written to the file
+        std::atomic<uint64_t> durable{0};   // records before it are fsynced
+        std::atomic<uint64_t> writer{0};    // process_token() of the process writing the file, 0 if none
+        std::atomic<uint64_t> sync_waiters{0};
+        std::atomic<uint64_t> dropped{0};   // records given up on: the ring stayed full and there's no writer
+        alignas(8) char ring[LOG_RING_SIZE];
+
+        /*
+         appends a record with the given body; returns its end position, 0 if it was dropped. waits for room while
+         the ring is full and a live writer drains it, so it's not called inside the table (see Map::log_record())
+        */
+        uint64_t append(std::string_view body) {
+            const uint64_t len = (LogRecord::HEADER + body.size() + 7) & ~7UL;
+            if (len > LOG_RING_SIZE) {
+                ++dropped;
+                return 0;
+            }
+            uint64_t pos = head.load();
+            for (uint spins = 1;; ++spins) {
+                if (pos + len - tail.load(std::memory_order_acquire) <= LOG_RING_SIZE) {
+                    if (head.compare_exchange_weak(pos, pos + len)) {
+                        break;
+                    }
+                    continue;
+                }
+                // full: nobody to drain it
+                if (writer.load() == 0 || (spins % ROBUST_SPINS == 0 && !writer_alive())) {
+                    ++dropped;
+                    return 0;
+                }
+                sched_yield();
+                pos = head.load();
+            }
+            // the header word never wraps: positions and the ring size are multiples of 8
+            uint64_t *word = reinterpret_cast<uint64_t *>(ring + pos % LOG_RING_SIZE);
+            const uint64_t reserved = LogRecord::RESERVED | (process_token() >> 32 << LogRecord::OWNER_SHIFT) | len;
+            __atomic_store_n(word, reserved, __ATOMIC_RELAXED);
+            copy(pos + LogRecord::HEADER, body.data(), body.size(), true);
+            uint64_t expected = reserved;
+            if (!__atomic_compare_exchange_n(word, &expected, LogRecord::COMMITTED | len, false, __ATOMIC_RELEASE,
+                                             __ATOMIC_RELAXED)) {
+                // the writer took this process for dead
+                ++dropped;
+                return 0;
+            }
+            return pos + len;
+        }
+
+        // writes the records committed from tail on to fd (at their positions); returns the new tail
+        uint64_t drain(int fd, std::string &buf) {
+            const uint64_t from = tail.load();
+            uint64_t to = from;
+            buf.clear();
+            while (buf.size() < LOG_RING_SIZE / 4) {
+                uint64_t *header = reinterpret_cast<uint64_t *>(ring + to % LOG_RING_SIZE);
+                uint64_t word = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+                if (!(word & LogRecord::COMMITTED)) {
+                    // given up on if its appender died, a pid which isn't there anymore
+                    const pid_t owner = static_cast<pid_t>(word >> LogRecord::OWNER_SHIFT);
+                    const uint64_t dead = LogRecord::COMMITTED | LogRecord::RESERVED | static_cast<uint32_t>(word);
+                    if (!(word & LogRecord::RESERVED) || kill(owner, 0) == 0 || errno != ESRCH ||
+                        !__atomic_compare_exchange_n(header, &word, dead, false, __ATOMIC_ACQUIRE,
+                                                     __ATOMIC_ACQUIRE)) {
+                        break;
+                    }
+                    word = dead;
+                    ++dropped;
+                }
+                const uint32_t len = static_cast<uint32_t>(word);
+                buf.resize(buf.size() + len);
+                if (word & LogRecord::RESERVED) {
+                    // a gap in the file, see for_each_log_record()
+                    memset(&buf[buf.size() - len], 0, len);
+                } else {
+                    copy(to, &buf[buf.size() - len], len, false);
+                }
+                to += len;
+            }
+            for (uint64_t off = 0; off < buf.size();) {
+                ssize_t n = pwrite(fd, buf.data() + off, buf.size() - off, from + off);
+                if (n <= 0) {
+                    std::cout << "shmaps: change log write failed: " << strerror(errno) << std::endl;
+                    return from;
+                }
+                off += n;
+            }
+            // appenders only write behind the tail, so the consumed space is zeroed before it's given back
+            for (uint64_t off = from; off < to;) {
+                const uint64_t n = std::min(to - off, LOG_RING_SIZE - off % LOG_RING_SIZE);
+                memset(ring + off % LOG_RING_SIZE, 0, n);
+                off += n;
+            }
+            tail.store(to, std::memory_order_release);
+            return to;
+        }
+
+        // drain()s until the ring is empty, or a record stays unpublished for ROBUST_SPINS tries
+        void drain_all(int fd, std::string &buf) {
+            for (uint spins = 0; drain(fd, buf) != head.load() && spins < ROBUST_SPINS; ++spins) {
+                sched_yield();
+            }
+        }
+
+        // waits until the records before pos are fsynced; false if there's no writer to do it
+        bool wait_durable(uint64_t pos) {
+            if (writer.load() == 0) {
+                return durable.load(std::memory_order_acquire) >= pos;
+            }
+            ++sync_waiters;
+            bool res = true;
+            for (uint spins = 1; durable.load(std::memory_order_acquire) < pos; ++spins) {
+                if (spins % ROBUST_SPINS == 0 && !writer_alive()) {
+                    res = false;
+                    break;
+                }
+                if (spins < ROBUST_SPINS) {
+                    sched_yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+            --sync_waiters;
+            return res;
+        }
+
+        bool writer_alive() const {
+            const uint64_t token = writer.load();
+            return token != 0 && process_alive(token);
+        }
+
+    private:
+        void copy(uint64_t pos, const char *src, uint64_t n, bool in) {
+            char *dst = const_cast<char *>(src);
+            for (uint64_t done = 0; done < n;) {
+                const uint64_t at = (pos + done) % LOG_RING_SIZE;
+                const uint64_t chunk = std::min(n - done, LOG_RING_SIZE - at);
+                in ? memcpy(ring + at, src + done, chunk) : memcpy(dst + done, ring + at, chunk);
+                done += chunk;
+            }
+        }
+    };
+
+    inline ChangeLog *change_log() {
+        ChangeLog *log = change_log_.load(std::memory_order_relaxed);
+        if (log == nullptr) {
+            assert(segment_ != nullptr);
+            log = segment_->find_or_construct<ChangeLog>("shmaps_change_log")();
+            change_log_ = log;
+        }
+        return log;
+    }
+
+    // replay() applies records without logging them again
+    inline thread_local bool log_suppressed_ = false;
+    // the record Map::log_record() encoded for the next log_append()
+    inline thread_local std::string log_body_;
+    inline thread_local bool log_pending_ = false;
+
+    /*
+     calls fn(position, record) for the records of a change log file from position from on, up to the first torn
+     one (cut short by a crash); returns the position they end at
+    */
+    template<typename F>
+    inline uint64_t for_each_log_record(int fd, uint64_t from, F fn) {
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) <= from) {
+            return from;
+        }
+        const uint64_t size = st.st_size;
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            return from;
+        }
+        madvise(addr, size, MADV_SEQUENTIAL);
+        const char *data = static_cast<const char *>(addr);
+        uint64_t pos = from;
+        while (pos + LogRecord::HEADER <= size) {
+            uint64_t word;
+            memcpy(&word, data + pos, sizeof(word));
+            if (word == 0) {
+                // a gap: the log went on at later positions in a new file
+                pos += LogRecord::HEADER;
+                continue;
+            }
+            const uint32_t len = static_cast<uint32_t>(word);
+            LogRecord record;
+            if (!(word & LogRecord::COMMITTED) || len < LogRecord::HEADER || pos + len > size ||
+                !record.parse(std::string_view(data + pos + LogRecord::HEADER, len - LogRecord::HEADER))) {
+                break;
+            }
+            fn(pos, record);
+            pos += len;
+        }
+        munmap(addr, size);
+        return pos;
+    }
+
+    inline std::thread *log_writer_ = nullptr;
+    inline pid_t log_writer_pid_ = 0;
+    inline std::atomic<bool> log_writer_stop_{false};
+
+    /*
+     makes this process the change log's writer: a thread writes the logged records to path, fsyncing them at least
+     every flush_interval and right away when a Durability::Sync operation waits. replay() maps before: a file which
+     goes on past the segment's log (e.g. the segment was restored from a snapshot) is cut at its last complete
+     record and the log goes on from there. false if another live process writes the log or path can't be opened.
+    */
+    inline bool open_log(const std::string &path,
+                         std::chrono::milliseconds flush_interval = std::chrono::milliseconds(100)) {
+        ChangeLog *log = change_log();
+        uint64_t writer = log->writer.load();
+        if ((writer != 0 && process_alive(writer)) || !log->writer.compare_exchange_strong(writer, process_token())) {
+            std::cout << "shmaps: the change log is written by another process" << std::endl;
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            std::cout << "shmaps: can't open " << path << ": " << strerror(errno) << std::endl;
+            log->writer = 0;
+            return false;
+        }
+        log_writer_stop_ = false;
+        log_writer_pid_ = getpid();
+        log_writer_ = new std::thread([log, fd, flush_interval] {
+            std::string buf;
+            // what's left in the ring goes to the positions it had, then the log catches up with the file
+            log->drain_all(fd, buf);
+            uint64_t tail = log->tail.load();
+            uint64_t end = for_each_log_record(fd, tail, [](uint64_t, const LogRecord &) {});
+            if (end > tail && log->head.compare_exchange_strong(tail, end)) {
+                log->durable = log->tail = end;
+            }
+            if (ftruncate(fd, std::max(end, log->tail.load())) != 0) {
+                std::cout << "shmaps: change log truncate failed: " << strerror(errno) << std::endl;
+            }
+            auto synced_at = std::chrono::steady_clock::now();
+            while (!log_writer_stop_) {
+                const uint64_t durable = log->durable.load();
+                const uint64_t written = log->drain(fd, buf);
+                const auto now = std::chrono::steady_clock::now();
+                if (written > durable && (log->sync_waiters.load() != 0 || now - synced_at >= flush_interval)) {
+                    if (fdatasync(fd) == 0) {
+                        log->durable.store(written, std::memory_order_release);
+                    }
+                    synced_at = now;
+                } else if (written == log->head.load()) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+            log->drain_all(fd, buf);
+            if (fdatasync(fd) == 0) {
+                log->durable.store(log->tail.load(), std::memory_order_release);
+            }
+            close(fd);
+        });
+        return true;
+    }
+
+    // stops this process' log writer after it wrote and fsynced what's in the ring
+    inline void close_log() {
+        // a forked child inherits the thread object, but not the thread
+        if (log_writer_ != nullptr && log_writer_pid_ == getpid()) {
+            log_writer_stop_ = true;
+            log_writer_->join();
+            delete log_writer_;
+            change_log()->writer = 0;
+        }
+        log_writer_ = nullptr;
+    }
+
+    // position the change log is at, e.g. to replay() the changes made since a snapshot() after restore()
+    inline uint64_t log_position() {
+        return change_log()->head.load();
+    }
+
+    /*
+     a snapshot file is a header block followed by an image of the segment at the same offsets; only the ranges the
+     source has data in (SEEK_DATA\SEEK_HOLE) are copied, so the file is as sparse as the segment and vice versa
+    */
+    struct SnapshotHeader {
+        static constexpr uint64_t SIZE = 4096;
+        static constexpr char MAGIC[8] = {'s', 'h', 'm', 'a', 'p', 's', '0', '1'};
+
+        char magic[8];
+        uint64_t segment_size;
+        uint64_t segment_used;
+    };
+
+    // writes the data ranges of src_fd within [from, from + len) from src (its mapping) to dst_fd, shifted by shift
+    inline bool copy_data_ranges(int src_fd, const char *src, uint64_t from, uint64_t len, int dst_fd, int64_t shift) {
+        const uint64_t end = from + len;
+        off_t data = lseek(src_fd, from, SEEK_DATA);
+        while (data >= 0 && static_cast<uint64_t>(data) < end) {
+            off_t hole = lseek(src_fd, data, SEEK_HOLE);
+            if (hole < 0) {
+                return false;
+            }
+            uint64_t range_end = std::min<uint64_t>(hole, end);
+            for (uint64_t off = data; off < range_end;) {
+                ssize_t n = pwrite(dst_fd, src + off, std::min<uint64_t>(range_end - off, 1UL << 30), off + shift);
+                if (n <= 0) {
+                    return false;
+                }
+                off += n;
+            }
+            data = lseek(src_fd, range_end, SEEK_DATA);
+        }
+        // ENXIO: no data past the offset
+        return data >= 0 || errno == ENXIO;
+    }
+
+    // a new descriptor of the attached segment's backing (its file or shm object), -1 on failure
+    inline int segment_fd() {
+        if (file_segment_ != nullptr) {
+            return open(segment_file_.c_str(), O_RDONLY);
+        }
+        try {
+            bip::shared_memory_object shm(bip::open_only, SHMEM_SEG_NAME, bip::read_only);
+            return dup(shm.get_mapping_handle().handle);
+        }
+        catch (const bip::interprocess_exception &) {
+            return -1;
+        }
+    }
+
+    // creates the backing opts ask for (see SegmentOptions::file) with the given size; -1 if it exists or on failure
+    inline int create_segment_fd(const SegmentOptions &opts, uint64_t size) {
+        int fd = -1;
+        if (!opts.file.empty()) {
+            fd = open(opts.file.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd >= 0 && ftruncate(fd, size) != 0) {
+                close(fd);
+                unlink(opts.file.c_str());
+                fd = -1;
+            }
+        } else {
+            try {
+                bip::shared_memory_object shm(bip::create_only, SHMEM_SEG_NAME, bip::read_write);
+                shm.truncate(size);
+                fd = dup(shm.get_mapping_handle().handle);
+            }
+            catch (const bip::interprocess_exception &) {
+            }
+        }
+        if (fd < 0) {
+            std::cout << "shmaps: can't create the segment: " << strerror(errno) << std::endl;
+        }
+        return fd;
+    }
+
+    /*
+     writes a consistent copy of the segment to path (through path.tmp, renamed once complete). map operations of
+     all processes wait while the segment is copied, which takes about as long as writing the pages it has in use.
+     false if operations in flight didn't drain within SNAPSHOT_TIMEOUT (e.g. a thread holds a locked() table or
+     calls back into maps from with_value()), or on an I/O error.
+    */
+    inline bool snapshot(const std::string &path) {
+#ifdef SHMAPS_DISABLE_SNAPSHOT
+        std::cout << "shmaps: snapshots are disabled (SHMAPS_DISABLE_SNAPSHOT)" << std::endl;
+        return false;
+#else
+        assert(segment_);
+        const std::string tmp_path = path + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cout << "shmaps: can't create " << tmp_path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        int seg_fd = segment_fd();
+        SnapshotHeader header{};
+        memcpy(header.magic, SnapshotHeader::MAGIC, sizeof(header.magic));
+        header.segment_size = segment_size();
+        bool res = false;
+        if (seg_fd < 0) {
+            std::cout << "shmaps: can't open the segment's backing" << std::endl;
+        } else if (gate()->close(std::chrono::seconds(SNAPSHOT_TIMEOUT))) {
+            header.segment_used = segment_used();
+            res = copy_data_ranges(seg_fd, static_cast<const char *>(segment_->get_address()),
+                                   0, header.segment_size, fd, SnapshotHeader::SIZE);
+            gate()->reopen();
+            res = res && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                  ftruncate(fd, SnapshotHeader::SIZE + header.segment_size) == 0 && fsync(fd) == 0;
+        } else {
+            std::cout << "shmaps: snapshot timed out waiting for map operations to finish" << std::endl;
+        }
+        if (seg_fd >= 0) {
+            close(seg_fd);
+        }
+        close(fd);
+        if (!res || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            std::cout << "shmaps: snapshot to " << path << " failed: " << strerror(errno) << std::endl;
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    /*
+     recreates the segment from a snapshot() file (e.g. after a reboot) and attaches to it like init() does, with the
+     backing opts ask for (either backing restores a snapshot of either); false if path isn't a snapshot, or if the
+     segment exists already (reset() it first to replace it).
+    */
+    inline bool restore(const std::string &path, const SegmentOptions &opts = SegmentOptions()) {
+        if (segment_ != nullptr) {
+            std::cout << "shmaps: can't restore into an attached segment" << std::endl;
+            return false;
+        }
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cout << "shmaps: can't open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        SnapshotHeader header{};
+        struct stat st{};
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, SnapshotHeader::MAGIC, sizeof(header.magic)) != 0 || fstat(fd, &st) != 0 ||
+            static_cast<uint64_t>(st.st_size) != SnapshotHeader::SIZE + header.segment_size) {
+            std::cout << "shmaps: " << path << " is not a snapshot" << std::endl;
+            close(fd);
+            return false;
+        }
+        bool res = false;
+        void *src = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (src != MAP_FAILED) {
+            madvise(src, st.st_size, MADV_SEQUENTIAL);
+            int seg_fd = create_segment_fd(opts, header.segment_size);
+            if (seg_fd >= 0) {
+                res = copy_data_ranges(fd, static_cast<const char *>(src), SnapshotHeader::SIZE,
+                                       header.segment_size, seg_fd, -static_cast<int64_t>(SnapshotHeader::SIZE));
+                res = res && (opts.file.empty() || fsync(seg_fd) == 0);
+                close(seg_fd);
+                if (!res) {
+                    opts.file.empty() ? bip::shared_memory_object::remove(SHMEM_SEG_NAME)
+                                      : bip::file_mapping::remove(opts.file.c_str());
+                }
+            }
+            munmap(src, st.st_size);
+        }
+        close(fd);
+        if (!res) {
+            std::cout << "shmaps: restore from " << path << " failed" << std::endl;
+            return false;
+        }
+        init(header.segment_size, opts);
+        memory_algorithm(segment_)->restored(backing_path(SHMEM_SEG_NAME, opts.file));
+        // the image was taken with the gate closed, and maybe with a log writer which doesn't write this one
+        gate()->reset();
+        if (ChangeLog *log = segment_->find<ChangeLog>("shmaps_change_log").first) {
+            log->writer = 0;
+            log->sync_waiters = 0;
+        }
+        return true;
+    }
+
+    template<class PayloadType>  // PayloadType could be a simple int, a set or a complex struct (with strings)
+    class MappedValType {
+    public:
+        MappedValType() {}
+
+        MappedValType(Seconds &ttl, const VoidAllocator &void_alloc) :
+                payload_(void_alloc),
+                expires_at_(expires_at(ttl)) {}
+
+        MappedValType(const PayloadType &payload, Seconds &ttl) :
+                payload_(payload),
+                expires_at_(expires_at(ttl)) {}
+
+        ~MappedValType() = default;
+
+        bool expired() const {
+            const uint32_t at = expires_at_ & ~ACCESSED;
+            return at != PERMANENT && coarse_now() >= at;
+        }
+
+        /*
+         access bit for Eviction::Clock, set by reads and cleared by eviction sampling. readers hold the bucket lock,
+         so a const visitor may set it; it's only written when not set yet, a hot entry's line stays clean.
+        */
+        void touch() const {
+            if (!(expires_at_ & ACCESSED)) {
+                expires_at_ |= ACCESSED;
+            }
+        }
+
+        bool accessed() const {
+            return expires_at_ & ACCESSED;
+        }
+
+        void clear_access() {
+            expires_at_ &= ~ACCESSED;
+        }
+
+        void reset(const PayloadType &payload, Seconds &ttl) {
+            reset(payload);
+            reset(ttl);
+        }
+
+        void reset(Seconds &ttl) {
+            expires_at_ = expires_at(ttl);
+        }
+
+        void reset(const PayloadType &payload) {
+            payload_ = payload;
+        }
+
+        PayloadType &payload() {
+            return payload_;
+        }
+
+        // wall clock ms the entry expires at (see CoarseClock), 0 if it's permanent
+        int64_t expires_wall_ms() const {
+            const uint32_t at = expires_at_ & ~ACCESSED;
+            if (at == PERMANENT) {
+                return 0;
+            }
+            return active_clock()->wall_ms_at(at);
+        }
+
+        const PayloadType &cpayload() const {
+            return payload_;
+        }
+
+    private:
+        static const uint32_t PERMANENT = 0;
+        static const uint32_t ACCESSED = 1U << 31;
+
+        // +1: the current tick has partly passed already, an entry never expires early
+        static uint32_t expires_at(const Seconds &ttl) {
+            if (ttl == Seconds(0)) {
+                return PERMANENT;
+            }
+            return std::min<uint64_t>(coarse_now() + ttl.count() * COARSE_TICKS_PER_SEC + 1, ACCESSED - 1);
+        }
+
+        PayloadType payload_;
+        // in coarse ticks (see CoarseClock), the top bit is the access bit
+        mutable uint32_t expires_at_ = PERMANENT;
+    };
+
+    /*
+     how an insert into a full map (see Map::set_limits()) picks the entry to evict among EVICT_SAMPLES sampled ones;
+     expired entries go first either way.
+     Clock: second chance, a sampled entry read since it was last sampled loses its access bit instead (approximates
+     LRU without keeping any order)
+     Random: the first sampled entry, reads don't cost anything extra
+    */
+    enum class Eviction : uint32_t {
+        Clock,
+        Random
+    };
+
+    /*
+     per-map capacity limit, kept in the segment so every process enforces the same one. entries are only counted
+     while a limit is set (set() takes the table's size once), so unbounded maps don't share a counter; the count is
+     approximate while processes race on the limit. there's no byte limit: maps share the segment's allocator and
+     slab blocks are never given back, so a map's bytes can't be told apart (a Segment of its own bounds them).
+    */
+    struct Capacity {
+        std::atomic<uint64_t> max_entries{0};
+        std::atomic<Eviction> eviction{Eviction::Clock};
+        std::atomic<int64_t> entries{0};
+
+        void set(uint64_t max_entries_, Eviction eviction_, uint64_t size) {
+            eviction = eviction_;
+            entries = size;
+            max_entries = max_entries_;
+        }
+
+        bool limited() const {
+            return max_entries.load(std::memory_order_relaxed) != 0;
+        }
+
+        void count(int64_t n) {
+            if (n && limited()) {
+                entries.fetch_add(n, std::memory_order_relaxed);
+            }
+        }
+
+        bool full() const {
+            const uint64_t max_e = max_entries.load(std::memory_order_relaxed);
+            return max_e && entries.load(std::memory_order_relaxed) >= static_cast<int64_t>(max_e);
+        }
+    };
+
+    /*
+     per-map index of expiring keys for Map::sweep(): a wheel of per-second slots, a key is filed under the second
+     it expires in (a ttl longer than the wheel waits in its slot for a later turn). entries are only hints, a key
+     deleted or set again meanwhile is skipped. keys are only filed while a sweeper is active (see active()), so maps
+     nobody sweeps don't pay for it, and the wheel itself is only allocated by the first sweep(); the index may miss
+     keys inserted before, the random purge still finds those.
+    */
+    template<class KeyType>
+    class TtlIndex {
+    public:
+        struct Entry {
+            Entry(uint64_t expires_at, const KeyType &key) : expires_at(expires_at), key(key) {}
+
+            uint64_t expires_at;
+            KeyType key;
+        };
+
+        typedef Vector<Entry> Slot;
+
+        explicit TtlIndex(const VoidAllocator &alloc) :
+                slots_(alloc),
+                wheel_(false),
+                swept_until_(0),
+                heartbeat_(0) {}
+
+        // a sweeper ran within the last TTL_SWEEPER_TIMEOUT seconds; the wheel is there once one ran at all
+        bool active() const {
+            const uint64_t heartbeat = heartbeat_.load(std::memory_order_acquire);
+            return heartbeat != 0 && heartbeat + TTL_SWEEPER_TIMEOUT >= now_seconds();
+        }
+
+        void add(const KeyType &k, Seconds expires) {
+            if (expires == Seconds(0) || !active()) {
+                return;
+            }
+            // +1: expired() holds for sure once the whole second has passed
+            const uint64_t expires_at = now_seconds() + expires.count() + 1;
+            const std::size_t slot = expires_at % TTL_WHEEL;
+            StripeGuard guard(&locks_, slot);
+            slots_[slot].emplace_back(expires_at, k);
+        }
+
+        /*
+         walks the slots of the seconds passed since the last sweep, calling erase(key) for every due entry, up to
+         budget entries; returns the number of entries examined, reclaimed counts the successful erase() calls
+        */
+        template<typename Erase>
+        uint64_t sweep(uint64_t budget, Erase erase, uint64_t &reclaimed) {
+            allocate_wheel();
+            const uint64_t now_s = now_seconds();
+            heartbeat_.store(now_s, std::memory_order_release);
+            uint64_t sec = swept_until_.load(std::memory_order_relaxed);
+            if (sec + TTL_WHEEL < now_s) {
+                // first sweep, or nobody swept for a whole turn: every slot is due
+                sec = now_s - TTL_WHEEL;
+            }
+            uint64_t examined = 0;
+            for (; sec < now_s && examined < budget; ++sec) {
+                const std::size_t slot_idx = sec % TTL_WHEEL;
+                StripeGuard guard(&locks_, slot_idx);
+                Slot &slot = slots_[slot_idx];
+                for (std::size_t i = 0; i < slot.size();) {
+                    if (slot[i].expires_at >= now_s) {
+                        ++i;
+                        continue;
+                    }
+                    if (examined == budget) {
+                        return examined;
+                    }
+                    ++examined;
+                    reclaimed += erase(slot[i].key);
+                    if (i != slot.size() - 1) {
+                        slot[i] = std::move(slot.back());
+                    }
+                    slot.pop_back();
+                }
+                uint64_t swept = swept_until_.load(std::memory_order_relaxed);
+                while (swept < sec + 1 && !swept_until_.compare_exchange_weak(swept, sec + 1)) {}
+            }
+            return examined;
+        }
+
+    private:
+        // builds the slots once, under stripe 0; a bad_alloc leaves the ones built so far for the next sweep()
+        void allocate_wheel() {
+            if (wheel_.load(std::memory_order_acquire)) {
+                return;
+            }
+            StripeGuard guard(&locks_, 0);
+            if (!wheel_.load(std::memory_order_relaxed)) {
+                slots_.reserve(TTL_WHEEL);
+                while (slots_.size() < TTL_WHEEL) {
+                    slots_.emplace_back(slots_.get_allocator());
+                }
+                wheel_.store(true, std::memory_order_release);
+            }
+        }
+
+        Vector<Slot> slots_;
+        StripeLocks locks_{};
+        std::atomic<bool> wheel_;
+        std::atomic<uint64_t> swept_until_;
+        std::atomic<uint64_t> heartbeat_;
+    };
+
+    /*
+     the table of maps whose keys and payloads are trivially copyable (see Map::ShardImpl): entries sit inline in the
+     segment in groups of 16 slots, each with a control byte (0 if the slot is free, else 7 bits of the key's hash), so
+     a lookup matches the hash against a whole group's control bytes at once and compares the keys of matching slots
+     only, with no allocation per entry and no pointer to follow. a key goes to the less full of its two groups and the
+     table doubles when both are full. the groups are striped by index over FLAT_LOCKS spinlocks and a key's two groups
+     share a stripe, so an operation takes a single lock; a resize takes them all. a stripe records its holder, and a
+     process which died holding it is taken over from: it may have left an entry half-written in a free slot (the
+     control byte goes last) or a stripe's count off by one, and a resize of the whole shard is lost with it (see
+     ShardedTable::quarantine()).
+     takes the libcuckoo calls ShardedTable makes.
+    */
+    template<class Key, class T, class Hash, class KeyEqual, class Allocator>
+    class FlatTable {
+    public:
+        typedef Key key_type;
+        typedef T mapped_type;
+        typedef std::pair<const Key, T> value_type;
+        typedef std::size_t size_type;
+        typedef Hash hasher;
+        typedef KeyEqual key_equal;
+
+        static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<T>,
+                      "flat tables keep entries inline and never destroy them");
+        static_assert((FLAT_LOCKS & (FLAT_LOCKS - 1)) == 0, "FLAT_LOCKS must be a power of two");
+
+    private:
+        static constexpr uint SLOTS = 16;
+
+        struct Group {
+            uint8_t ctrl[SLOTS];
+            std::aligned_storage_t<sizeof(value_type), alignof(value_type)> slots[SLOTS];
+
+            value_type &at(uint i) {
+                return *std::launder(reinterpret_cast<value_type *>(&slots[i]));
+            }
+
+            const value_type &at(uint i) const {
+                return *std::launder(reinterpret_cast<const value_type *>(&slots[i]));
+            }
+
+            // a bit per slot whose control byte is tag (0: the free ones)
+            uint32_t match(uint8_t tag) const {
+#ifdef __SSE2__
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl));
+                return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(tag))));
+#else
+                uint32_t bits = 0;
+                for (uint i = 0; i < SLOTS; ++i) {
+                    bits |= uint32_t(ctrl[i] == tag) << i;
+                }
+                return bits;
+#endif
+            }
+        };
+
+        typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Group> GroupAllocator;
+        typedef typename std::allocator_traits<GroupAllocator>::pointer GroupPointer;
+
+        struct alignas(64) Stripe {
+            // process_token() of the holder, 0 if free
+            std::atomic<uint64_t> owner{0};
+            // odd while the lock is held, bumped on every unlock: lock-free reads are checked against it
+            std::atomic<uint64_t> version{0};
+            // entries in the stripe's groups, written under the lock
+            std::atomic<size_type> count{0};
+            // erase_random_fn()'s position among the stripe's groups, written under the lock
+            size_type hand = 0;
+
+            // as StripeLocks::lock(): a waiter takes the stripe over from a dead holder
+            void lock() {
+                const uint64_t me = process_token();
+                for (uint spins = 1;; ++spins) {
+                    uint64_t cur = owner.load(std::memory_order_relaxed);
+                    if (cur == 0) {
+                        if (owner.compare_exchange_weak(cur, me, std::memory_order_acquire)) {
+                            break;
+                        }
+                        continue;
+                    }
+                    if (spins % ROBUST_SPINS == 0) {
+                        if (!process_alive(cur) && owner.compare_exchange_strong(cur, me, std::memory_order_acquire)) {
+                            break;
+                        }
+                        sched_yield();
+                    }
+                }
+                // a dead holder's version is odd already
+                version.store(version.load(std::memory_order_relaxed) | 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+
+            void unlock() {
+                version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                owner.store(0, std::memory_order_release);
+            }
+
+            void add(int64_t n) {
+                count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+        };
+
+        // the stripe of both groups of a hash locked, for as long as it lives
+        class GroupsLock {
+        public:
+            GroupsLock(FlatTable &table, std::size_t hash) : table_(table) {
+                for (;;) {
+                    mask = table_.mask_.load(std::memory_order_acquire);
+                    first = hash & mask;
+                    second = alt_group(first, tag_of(hash), mask);
+                    stripe().lock();
+                    // no resize in between, the groups are the key's
+                    if (table_.mask_.load(std::memory_order_relaxed) == mask) {
+                        return;
+                    }
+                    stripe().unlock();
+                }
+            }
+
+            ~GroupsLock() {
+                stripe().unlock();
+            }
+
+            Stripe &stripe() {
+                return table_.stripes_[first % FLAT_LOCKS];
+            }
+
+            size_type mask;
+            size_type first;
+            size_type second;
+
+        private:
+            FlatTable &table_;
+        };
+
+        // every stripe locked, for as long as it lives (a resize's bad_alloc doesn't leave them locked)
+        class AllStripesLock {
+        public:
+            explicit AllStripesLock(FlatTable &table) : table_(table) {
+                table_.lock_all(true);
+            }
+
+            ~AllStripesLock() {
+                table_.lock_all(false);
+            }
+
+        private:
+            FlatTable &table_;
+        };
+
+    public:
+        FlatTable(size_type n, const hasher &hash, const key_equal &eq, const Allocator &alloc) :
+                hash_(hash), eq_(eq), alloc_(alloc) {
+            const size_type groups = groups_for(n);
+            groups_ = allocate(groups);
+            mask_.store(groups - 1, std::memory_order_release);
+        }
+
+        ~FlatTable() {
+            alloc_.deallocate(groups_, mask_.load(std::memory_order_relaxed) + 1);
+        }
+
+        FlatTable(const FlatTable &) = delete;
+
+        FlatTable &operator=(const FlatTable &) = delete;
+
+        hasher hash_function() const {
+            return hash_;
+        }
+
+        key_equal key_eq() const {
+            return eq_;
+        }
+
+        size_type bucket_count() const {
+            return mask_.load(std::memory_order_relaxed) + 1;
+        }
+
+        // the stripe a call for hash locks, see ShardedTable::quarantine()
+        size_type lock_index(std::size_t hash) const {
+            return (mix(hash) & mask_.load(std::memory_order_relaxed)) % FLAT_LOCKS;
+        }
+
+        /*
+         brings the control bytes of hash's two groups and their stripe into the cache ahead of a call for it. takes
+         no lock: a resize in between only makes it prefetch a stale line, which doesn't fault
+        */
+        void prefetch(std::size_t hash) const {
+            hash = mix(hash);
+            const size_type mask = mask_.load(std::memory_order_relaxed);
+            const Group *groups = bip::ipcdetail::to_raw_pointer(groups_);
+            const size_type first = hash & mask;
+            __builtin_prefetch(&stripes_[first % FLAT_LOCKS], 1);
+            __builtin_prefetch(groups + first);
+            __builtin_prefetch(groups + alt_group(first, tag_of(hash), mask));
+        }
+
+        size_type size() const {
+            size_type n = 0;
+            for (const Stripe &stripe: stripes_) {
+                n += stripe.count.load(std::memory_order_relaxed);
+            }
+            return n;
+        }
+
+        /*
+         seqlock-style read: k's payload is copied out between two loads of its stripe's version, and fn is called
+         on the copy once the version is seen unchanged, so readers don't take the lock or write its line. a copy fn
+         changed (MappedValType::touch() setting the access bit) is written back under the lock if the entry still
+         holds what was copied. a group array a resize freed meanwhile stays mapped in the segment, the version tells
+         the copy apart. reads under the lock after FLAT_READ_TRIES tries which met a writer.
+        */
+        template<typename K, typename F>
+        bool find_fn(const K &k, F fn) const {
+            const std::size_t hash = mix(hash_(k));
+            for (uint tries = 0; tries < FLAT_READ_TRIES; ++tries) {
+                const size_type mask = mask_.load(std::memory_order_acquire);
+                const size_type first = hash & mask;
+                const Stripe &stripe = stripes_[first % FLAT_LOCKS];
+                const uint64_t version = stripe.version.load(std::memory_order_acquire);
+                if ((version & 1) || mask_.load(std::memory_order_relaxed) != mask) {
+                    continue;
+                }
+                std::aligned_storage_t<sizeof(T), alignof(T)> seen;
+                bool found = false;
+                for (size_type g: {first, alt_group(first, tag_of(hash), mask)}) {
+                    const uint slot = find(g, hash, k);
+                    if (slot < SLOTS) {
+                        std::memcpy(&seen, &groups_[g].at(slot).second, sizeof(T));
+                        found = true;
+                        break;
+                    }
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (stripe.version.load(std::memory_order_relaxed) != version) {
+                    continue;
+                }
+                if (!found) {
+                    return false;
+                }
+                std::aligned_storage_t<sizeof(T), alignof(T)> copy = seen;
+                fn(*std::launder(reinterpret_cast<const T *>(&copy)));
+                if (std::memcmp(&copy, &seen, sizeof(T)) != 0) {
+                    const_cast<FlatTable *>(this)->locate(k, [&](Group &group, uint slot, size_type) {
+                        T &entry = group.at(slot).second;
+                        if (std::memcmp(&entry, &seen, sizeof(T)) == 0) {
+                            std::memcpy(static_cast<void *>(&entry), &copy, sizeof(T));
+                        }
+                    });
+                }
+                return true;
+            }
+            return const_cast<FlatTable *>(this)->locate(k, [&fn](Group &group, uint slot, size_type) {
+                fn(static_cast<const T &>(group.at(slot).second));
+            });
+        }
+
+        template<typename K, typename F>
+        bool update_fn(const K &k, F fn) {
+            return locate(k, [&fn](Group &group, uint slot, size_type) {
+                fn(group.at(slot).second);
+            });
+        }
+
+        template<typename K, typename F>
+        bool erase_fn(const K &k, F fn) {
+            return locate(k, [this, &fn](Group &group, uint slot, size_type g) {
+                if (fn(group.at(slot).second)) {
+                    group.ctrl[slot] = 0;
+                    stripes_[g % FLAT_LOCKS].add(-1);
+                }
+            });
+        }
+
+        template<typename K>
+        bool erase(const K &k) {
+            return erase_fn(k, [](T &) {
+                return true;
+            });
+        }
+
+        // false if k is there already; doubles the table when both of k's groups are full
+        template<typename K, typename... Args>
+        bool insert(K &&k, Args &&... args) {
+            const std::size_t hash = mix(hash_(k));
+            for (;;) {
+                size_type mask;
+                {
+                    const GroupsLock lock(*this, hash);
+                    if (find(lock.first, hash, k) < SLOTS || find(lock.second, hash, k) < SLOTS) {
+                        return false;
+                    }
+                    const uint32_t free_first = groups_[lock.first].match(0);
+                    const uint32_t free_second = groups_[lock.second].match(0);
+                    if (free_first | free_second) {
+                        const bool first = __builtin_popcount(free_first) >= __builtin_popcount(free_second);
+                        const size_type g = first ? lock.first : lock.second;
+                        const uint slot = __builtin_ctz(first ? free_first : free_second);
+                        new(&groups_[g].slots[slot]) value_type(std::piecewise_construct,
+                                                                std::forward_as_tuple(std::forward<K>(k)),
+                                                                std::forward_as_tuple(std::forward<Args>(args)...));
+                        groups_[g].ctrl[slot] = tag_of(hash);
+                        stripes_[g % FLAT_LOCKS].add(1);
+                        return true;
+                    }
+                    mask = lock.mask;
+                }
+                grow(mask);
+            }
+        }
+
+        void clear() {
+            const AllStripesLock lock(*this);
+            const size_type groups = mask_.load(std::memory_order_relaxed) + 1;
+            for (size_type g = 0; g < groups; ++g) {
+                std::memset(groups_[g].ctrl, 0, SLOTS);
+            }
+            for (Stripe &stripe: stripes_) {
+                stripe.count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        bool reserve(size_type n) {
+            const size_type groups = groups_for(n);
+            if (groups <= bucket_count()) {
+                return true;
+            }
+            GroupPointer fresh = allocate(groups);
+            const AllStripesLock lock(*this);
+            if (groups > mask_.load(std::memory_order_relaxed) + 1) {
+                rehash(fresh, groups);
+            } else {
+                alloc_.deallocate(fresh, groups);
+            }
+            return true;
+        }
+
+        /*
+         visits up to n entries in up to n of a random stripe's groups, going on from where the previous call in that
+         stripe stopped like a clock hand, and erases those fn returns true for. an entry isn't visited again before
+         the stripe's hand went round all its groups, so a sampler clearing access bits doesn't come back to evict a
+         hot entry right away, as starting from a random group on every call would now and then.
+        */
+        template<typename F>
+        size_type erase_random_fn(size_type n, F fn) {
+            static thread_local uint64_t rnd = reinterpret_cast<uint64_t>(&rnd);
+            rnd = rnd * 6364136223846793005UL + 1442695040888963407UL;
+            size_type visited = 0;
+            size_type erased = 0;
+            // the table only grows, a stripe picked among the groups there were still has its groups after locking
+            const size_type s = (rnd >> 33) % std::min<size_type>(bucket_count(), FLAT_LOCKS);
+            Stripe &stripe = stripes_[s];
+            stripe.lock();
+            const size_type per_stripe = std::max<size_type>(bucket_count() / FLAT_LOCKS, 1);
+            for (size_type i = 0; i < std::min(per_stripe, n) && visited < n; ++i) {
+                Group &group = groups_[s + stripe.hand++ % per_stripe * FLAT_LOCKS];
+                for (uint32_t used = ~group.match(0) & 0xFFFF; used && visited < n; used &= used - 1) {
+                    const uint slot = __builtin_ctz(used);
+                    ++visited;
+                    if (fn(group.at(slot).second)) {
+                        group.ctrl[slot] = 0;
+                        ++erased;
+                    }
+                }
+            }
+            stripe.add(-static_cast<int64_t>(erased));
+            stripe.unlock();
+            return erased;
+        }
+
+        /*
+         SCAN-like walk: calls fn(entry) for the entries of up to n groups from cursor on (0 starts over), locking one
+         group's stripe at a time, and returns the cursor to go on from, 0 once every group was visited. groups go in
+         the reverse binary order of their index (as Redis does it), and a key's groups keep their low index bits when
+         the table grows while rehash() keeps entries in the same one of their two groups: an entry which is there for
+         the whole walk is visited at least once across resizes, maybe more than once.
+        */
+        template<typename F>
+        size_type scan(size_type cursor, size_type n, F fn) {
+            for (size_type i = 0; i < n; ++i) {
+                size_type mask;
+                for (;;) {
+                    mask = mask_.load(std::memory_order_acquire);
+                    stripes_[(cursor & mask) % FLAT_LOCKS].lock();
+                    if (mask_.load(std::memory_order_relaxed) == mask) {
+                        break;
+                    }
+                    stripes_[(cursor & mask) % FLAT_LOCKS].unlock();
+                }
+                const Group &group = groups_[cursor & mask];
+                for (uint32_t used = ~group.match(0) & 0xFFFF; used; used &= used - 1) {
+                    fn(static_cast<const value_type &>(group.at(__builtin_ctz(used))));
+                }
+                stripes_[(cursor & mask) % FLAT_LOCKS].unlock();
+                // increments the reversed bits under mask
+                cursor = reverse_bits(reverse_bits(cursor | ~mask) + 1);
+                if (cursor == 0) {
+                    return 0;
+                }
+            }
+            return cursor;
+        }
+
+        // every stripe locked, iterators stay usable (not locked) after unlock() like libcuckoo's
+        class locked_table {
+        public:
+            template<bool IS_CONST>
+            class templated_iterator {
+                typedef std::conditional_t<IS_CONST, const Group, Group> GroupType;
+
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef typename FlatTable::value_type value_type;
+                typedef std::conditional_t<IS_CONST, const value_type &, value_type &> reference;
+                typedef std::conditional_t<IS_CONST, const value_type *, value_type *> pointer;
+                typedef std::ptrdiff_t difference_type;
+
+                templated_iterator() : groups_(nullptr), end_(0), pos_(0) {}
+
+                templated_iterator(GroupType *groups, size_type end, size_type pos) :
+                        groups_(groups), end_(end), pos_(pos) {
+                    skip();
+                }
+
+                reference operator*() const {
+                    return groups_[pos_ / SLOTS].at(pos_ % SLOTS);
+                }
+
+                pointer operator->() const {
+                    return &**this;
+                }
+
+                templated_iterator &operator++() {
+                    ++pos_;
+                    skip();
+                    return *this;
+                }
+
+                bool operator==(const templated_iterator &other) const {
+                    return pos_ == other.pos_;
+                }
+
+                bool operator!=(const templated_iterator &other) const {
+                    return !(*this == other);
+                }
+
+            private:
+                void skip() {
+                    while (pos_ < end_ && groups_[pos_ / SLOTS].ctrl[pos_ % SLOTS] == 0) {
+                        ++pos_;
+                    }
+                }
+
+                GroupType *groups_;
+                size_type end_;
+                size_type pos_;
+            };
+
+            typedef templated_iterator<false> iterator;
+            typedef templated_iterator<true> const_iterator;
+
+            locked_table(locked_table &&other) noexcept : table_(other.table_) {
+                other.table_ = nullptr;
+            }
+
+            ~locked_table() {
+                unlock();
+            }
+
+            void unlock() {
+                if (table_ != nullptr) {
+                    table_->lock_all(false);
+                    table_ = nullptr;
+                }
+            }
+
+            iterator begin() {
+                return iterator(&table_->groups_[0], end_pos(), 0);
+            }
+
+            iterator end() {
+                return iterator(&table_->groups_[0], end_pos(), end_pos());
+            }
+
+            const_iterator cbegin() const {
+                return const_iterator(&table_->groups_[0], end_pos(), 0);
+            }
+
+            const_iterator cend() const {
+                return const_iterator(&table_->groups_[0], end_pos(), end_pos());
+            }
+
+        private:
+            friend class FlatTable;
+
+            explicit locked_table(FlatTable &table) : table_(&table) {
+                table_->lock_all(true);
+            }
+
+            size_type end_pos() const {
+                return table_->bucket_count() * SLOTS;
+            }
+
+            FlatTable *table_;
+        };
+
+        locked_table lock_table() {
+            return locked_table(*this);
+        }
+
+    private:
+        /*
+         murmur3's finalizer, taken before the group, tag and stripe: boost::hash of an int is the int itself, keys
+         with a power-of-two stride would otherwise share their low bits, so a few groups and a single stripe
+        */
+        static std::size_t mix(std::size_t hash) {
+            hash ^= hash >> 33;
+            hash *= 0xFF51AFD7ED558CCDUL;
+            hash ^= hash >> 33;
+            hash *= 0xC4CEB9FE1A85EC53UL;
+            hash ^= hash >> 33;
+            return hash;
+        }
+
+        // like libcuckoo's partial key, 7 bits of the (mixed) hash; the group comes from its low bits, the tag from
+        // its high ones
+        static uint8_t tag_of(std::size_t hash) {
+            return 0x80 | (hash >> 57);
+        }
+
+        // the other group a key may go to: differs from the first above the stripe bits only (the same one while the
+        // table has FLAT_LOCKS groups or fewer)
+        static size_type alt_group(size_type first, uint8_t tag, size_type mask) {
+            return first ^ ((tag + 1) * 0xC6A4A7935BD1E995UL & mask & ~size_type(FLAT_LOCKS - 1));
+        }
+
+        static size_type reverse_bits(size_type v) {
+            v = ((v >> 1) & 0x5555555555555555UL) | ((v & 0x5555555555555555UL) << 1);
+            v = ((v >> 2) & 0x3333333333333333UL) | ((v & 0x3333333333333333UL) << 2);
+            v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FUL) | ((v & 0x0F0F0F0F0F0F0F0FUL) << 4);
+            return __builtin_bswap64(v);
+        }
+
+        // a power of two groups for n entries at up to 7/8 full
+        static size_type groups_for(size_type n) {
+            size_type groups = 1;
+            while (groups * SLOTS * 7 / 8 < n) {
+                groups *= 2;
+            }
+            return groups;
+        }
+
+        // k's slot in group g, SLOTS if it's not there
+        template<typename K>
+        uint find(size_type g, std::size_t hash, const K &k) const {
+            const Group &group = groups_[g];
+            for (uint32_t bits = group.match(tag_of(hash)); bits; bits &= bits - 1) {
+                const uint slot = __builtin_ctz(bits);
+                if (eq_(group.at(slot).first, k)) {
+                    return slot;
+                }
+            }
+            return SLOTS;
+        }
+
+        // calls fn(group, slot, group index) under the lock if k is in the table
+        template<typename K, typename F>
+        bool locate(const K &k, F fn) {
+            const std::size_t hash = mix(hash_(k));
+            const GroupsLock lock(*this, hash);
+            for (size_type g: {lock.first, lock.second}) {
+                const uint slot = find(g, hash, k);
+                if (slot < SLOTS) {
+                    fn(groups_[g], slot, g);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void lock_all(bool on) {
+            for (Stripe &stripe: stripes_) {
+                on ? stripe.lock() : stripe.unlock();
+            }
+        }
+
+        GroupPointer allocate(size_type groups) {
+            GroupPointer fresh = alloc_.allocate(groups);
+            for (size_type g = 0; g < groups; ++g) {
+                std::memset(fresh[g].ctrl, 0, SLOTS);
+            }
+            return fresh;
+        }
+
+        // doubles the table unless another thread did since mask was read; allocates before locking
+        void grow(size_type mask) {
+            const size_type groups = (mask + 1) * 2;
+            GroupPointer fresh = allocate(groups);
+            const AllStripesLock lock(*this);
+            if (mask_.load(std::memory_order_relaxed) == mask) {
+                rehash(fresh, groups);
+            } else {
+                alloc_.deallocate(fresh, groups);
+            }
+        }
+
+        /*
+         moves every entry to fresh, an allocate()d array of groups groups, all stripes locked. an entry goes to the
+         same one of its two groups it was in (see scan()): those are a split of its old ones, there's always room
+         (a bigger array is taken otherwise). the old array is freed once the new one is in place
+        */
+        void rehash(GroupPointer fresh, size_type groups) {
+            const size_type old_groups = mask_.load(std::memory_order_relaxed) + 1;
+            for (;; groups *= 2, fresh = allocate(groups)) {
+                std::vector<size_type> counts(FLAT_LOCKS);
+                bool placed = true;
+                for (size_type g = 0; g < old_groups && placed; ++g) {
+                    const Group &group = groups_[g];
+                    for (uint32_t used = ~group.match(0) & 0xFFFF; used && placed; used &= used - 1) {
+                        const value_type &entry = group.at(__builtin_ctz(used));
+                        const std::size_t hash = mix(hash_(entry.first));
+                        const size_type first = hash & (groups - 1);
+                        const size_type second = alt_group(first, tag_of(hash), groups - 1);
+                        const uint32_t free_first = fresh[first].match(0);
+                        const uint32_t free_second = fresh[second].match(0);
+                        if (!(free_first | free_second)) {
+                            placed = false;
+                            break;
+                        }
+                        const bool was_first = g == (hash & (old_groups - 1));
+                        const bool to_first = was_first ? free_first != 0 : free_second == 0;
+                        const size_type to = to_first ? first : second;
+                        const uint slot = __builtin_ctz(to_first ? free_first : free_second);
+                        new(&fresh[to].slots[slot]) value_type(entry);
+                        fresh[to].ctrl[slot] = tag_of(hash);
+                        ++counts[to % FLAT_LOCKS];
+                    }
+                }
+                if (!placed) {
+                    alloc_.deallocate(fresh, groups);
+                    continue;
+                }
+                const GroupPointer old = groups_;
+                groups_ = fresh;
+                for (size_type s = 0; s < FLAT_LOCKS; ++s) {
+                    stripes_[s].count.store(counts[s], std::memory_order_relaxed);
+                }
+                mask_.store(groups - 1, std::memory_order_release);
+                alloc_.deallocate(old, old_groups);
+                return;
+            }
+        }
+
+        hasher hash_;
+        key_equal eq_;
+        GroupAllocator alloc_;
+        // only read under a stripe lock: it changes with mask_, under all of them
+        GroupPointer groups_;
+        std::atomic<size_type> mask_;
+        mutable Stripe stripes_[FLAT_LOCKS];
+    };
+
+    template<typename T>
+    struct IsFlatTable : std::false_type {};
+
+    template<class... Args>
+    struct IsFlatTable<FlatTable<Args...>> : std::true_type {};
+
+    /*
+     a map's table split by key hash into TABLE_SHARDS tables which grow on their own: a libcuckoo (or FlatTable)
+     resize locks every bucket of its table while it rehashes, so a shard's resize only stalls operations on that shard,
+     for a TABLE_SHARDS-th of the time a whole-table rehash would take, and shards fill up (and grow) at different
+     moments.
+     takes the libcuckoo calls Map makes, keys may be PrehashedKeys; capacity is that of the whole map.
+    */
+    template<class Impl>
+    class ShardedTable {
+    public:
+        typedef typename Impl::hasher hasher;
+        typedef typename Impl::size_type size_type;
+
+        template<typename... Args>
+        explicit ShardedTable(size_type capacity, const Args &... args) {
+            for (Impl &shard: shards_) {
+                new(&shard) Impl(std::max<size_type>(capacity / TABLE_SHARDS, 1), args...);
+            }
+        }
+
+        ~ShardedTable() {
+            for (Impl &shard: shards_) {
+                shard.~Impl();
+            }
+        }
+
+        // the shard k is in; pass a PrehashedKey to pick it without hashing again
+        template<typename K>
+        Impl &shard(const K &k) {
+            return shards_[shard_of(hash_function()(k))];
+        }
+
+        template<typename K>
+        const Impl &shard(const K &k) const {
+            return shards_[shard_of(hash_function()(k))];
+        }
+
+        hasher hash_function() const {
+            return shards_[0].hash_function();
+        }
+
+        // buckets of a shard, they all have about as many
+        size_type bucket_count() const {
+            return shards_[0].bucket_count();
+        }
+
+        size_type size() const {
+            size_type n = 0;
+            for (const Impl &shard: shards_) {
+                n += shard.size();
+            }
+            return n;
+        }
+
+        // damaged shards (see quarantine()) are left as they are
+        void clear() {
+            for (uint s = 0; s < TABLE_SHARDS; ++s) {
+                if (!damaged(s)) {
+                    shards_[s].clear();
+                }
+            }
+        }
+
+        // room for n entries overall, grows every shard (but the damaged ones) now rather than on the way
+        void reserve(size_type n) {
+            for (uint s = 0; s < TABLE_SHARDS; ++s) {
+                if (!damaged(s)) {
+                    shards_[s].reserve(n / TABLE_SHARDS + 1);
+                }
+            }
+        }
+
+        template<typename K, typename F>
+        bool find_fn(const K &k, F fn) const {
+            return shard(k).find_fn(k, fn);
+        }
+
+        template<typename K, typename F>
+        bool update_fn(const K &k, F fn) {
+            return shard(k).update_fn(k, fn);
+        }
+
+        template<typename K, typename F>
+        bool erase_fn(const K &k, F fn) {
+            return shard(k).erase_fn(k, fn);
+        }
+
+        template<typename K>
+        bool erase(const K &k) {
+            return shard(k).erase(k);
+        }
+
+        // see FlatTable::prefetch(); a no-op for libcuckoo shards, which expose no bucket addresses
+        void prefetch(std::size_t hash) const {
+            if constexpr (IsFlatTable<Impl>::value) {
+                shards_[shard_of(hash)].prefetch(hash);
+            }
+        }
+
+        // the first lock a call for hash takes in its shard (see lock_indexes()), batches are ordered by it
+        std::size_t lock_index(std::size_t hash) const {
+            return lock_indexes(hash)[0];
+        }
+
+        // inserts k (pk is k prehashed) into its shard; false if it's there or if the shard is damaged: an insert
+        // may displace entries or resize, which takes bucket locks of the whole shard
+        template<typename PK, typename K, typename V>
+        bool insert(const PK &pk, K &&k, V &&val) {
+            const uint s = shard_of(hash_function()(pk));
+            return !damaged(s) && shards_[s].insert(std::forward<K>(k), std::forward<V>(val));
+        }
+
+        /*
+         samples n entries starting from the shard after the one the calling thread sampled last, moving on to
+         the next shards while a shard holds fewer. a shard is sampled by one thread at a time, its sampler word
+         holding the process: one which died sampling is noticed by the next samplers, which quarantine the whole
+         shard (the bucket locks it held aren't known). busy and damaged shards are skipped.
+        */
+        template<typename F>
+        size_type erase_random_fn(size_type n, F fn) {
+            static thread_local uint next = 0;
+            static thread_local uint busy = 0;
+            const uint64_t me = process_token();
+            size_type sampled = 0;
+            size_type erased = 0;
+            for (uint i = 0; i < TABLE_SHARDS && sampled < n; ++i) {
+                const uint s = next++ % TABLE_SHARDS;
+                uint64_t owner = 0;
+                if (damaged(s)) {
+                    continue;
+                }
+                if (!samplers_[s].compare_exchange_strong(owner, me, std::memory_order_acquire)) {
+                    if (++busy % ROBUST_SPINS == 0 && !process_alive(owner) &&
+                        samplers_[s].compare_exchange_strong(owner, 0)) {
+                        lose(s);
+                    }
+                    continue;
+                }
+                erased += shards_[s].erase_random_fn(n - sampled, [&](auto &val) {
+                    ++sampled;
+                    return fn(val);
+                });
+                samplers_[s].store(0, std::memory_order_release);
+            }
+            return erased;
+        }
+
+        /*
+         quarantines what a process which died in a table call for hash may have held (see StripeLocks): the locks
+         of the key's two buckets (libcuckoo's index_hash(), alt_index() and lock_ind(), a flat table's stripe), or
+         every lock of its shard for a call which may displace entries or resize. the shard is damaged then:
+         operations on quarantined keys fail, inserts into it and whole-table calls skip it until repair().
+        */
+        void quarantine(std::size_t hash, bool whole_shard) {
+            if (whole_shard) {
+                lose(shard_of(hash));
+                return;
+            }
+            for (std::size_t lock: lock_indexes(hash)) {
+                quarantined_locks_[lock / 64].fetch_or(1UL << (lock % 64));
+            }
+            damaged_.fetch_or(1U << shard_of(hash));
+        }
+
+        // a call for hash may need a quarantined lock; keys of another damaged shard sharing a lock index are too
+        bool quarantined(std::size_t hash) const {
+            const uint s = shard_of(hash);
+            if (!damaged(s)) {
+                return false;
+            }
+            if (lost_.load() & (1U << s)) {
+                return true;
+            }
+            for (std::size_t lock: lock_indexes(hash)) {
+                if (quarantined_locks_[lock / 64].load(std::memory_order_relaxed) & (1UL << (lock % 64))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // bytes of the table repair() couldn't free, see there
+        uint64_t leaked() const {
+            return leaked_.load(std::memory_order_relaxed);
+        }
+
+        /*
+         replaces the damaged shards with empty ones (args as for the constructor): their entries are dropped. the
+         caller keeps every other operation out. a flat shard is destroyed first: its entries are trivially copyable,
+         the group array is all it owns, and its destructor takes no lock. a libcuckoo shard can't be: destroying its
+         entries would free payload memory a dead process may have been in the middle of changing, so it's leaked and
+         its bucket array counted in leaked() (payload allocations of its entries aren't). returns the number of
+         entries dropped.
+        */
+        template<typename... Args>
+        size_type repair(const Args &... args) {
+            size_type dropped = 0;
+            for (uint s = 0; s < TABLE_SHARDS; ++s) {
+                if (damaged(s)) {
+                    const size_type n = shards_[s].size();
+                    dropped += n;
+                    if constexpr (IsFlatTable<Impl>::value) {
+                        shards_[s].~Impl();
+                    } else {
+                        leaked_ += shards_[s].capacity() * sizeof(typename Impl::value_type);
+                    }
+                    new(&shards_[s]) Impl(std::max<size_type>(n, 1), args...);
+                    samplers_[s] = 0;
+                }
+            }
+            for (std::atomic<uint64_t> &locks: quarantined_locks_) {
+                locks = 0;
+            }
+            lost_ = 0;
+            damaged_ = 0;
+            return dropped;
+        }
+
+        /*
+         SCAN-like walk of the shards of a partition (shard s is in partition s % partitions) one after the other:
+         up to n groups of a flat shard per call (see FlatTable::scan()), or a whole libcuckoo shard whatever n is:
+         it has no smaller unit, fn runs with every bucket of the shard locked. the cursor is the shard's own times
+         TABLE_SHARDS plus the shard, 0 starts the partition over and is returned once it's done.
+        */
+        template<typename F>
+        size_type scan(size_type cursor, size_type n, uint partition, uint partitions, F fn) {
+            size_type shard = cursor % TABLE_SHARDS;
+            size_type from = cursor / TABLE_SHARDS;
+            if (cursor == 0) {
+                shard = partition;
+            }
+            if (shard >= TABLE_SHARDS) {
+                return 0;
+            }
+            // a damaged shard has nothing to walk until repair()
+            if constexpr (IsFlatTable<Impl>::value) {
+                from = damaged(shard) ? 0 : shards_[shard].scan(from, n, fn);
+                if (from != 0) {
+                    return from * TABLE_SHARDS + shard;
+                }
+            } else if (!damaged(shard)) {
+                auto locked = shards_[shard].lock_table();
+                for (auto it = locked.cbegin(); it != locked.cend(); ++it) {
+                    fn(*it);
+                }
+            }
+            shard += partitions;
+            return shard < TABLE_SHARDS ? shard : 0;
+        }
+
+        // every shard locked, iterated one after the other; damaged shards are skipped (as if empty)
+        class LockedTable {
+            typedef std::array<std::pair<typename Impl::locked_table::iterator,
+                    typename Impl::locked_table::iterator>, TABLE_SHARDS> Ranges;
+
+        public:
+            /*
+             iterators share the shards' ranges rather than point into the LockedTable, like libcuckoo's they stay
+             usable (not locked) after the table is unlocked
+            */
+            template<bool IS_CONST>
+            class Iterator {
+                typedef typename Impl::locked_table::iterator ShardIterator;
+
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef typename std::iterator_traits<ShardIterator>::value_type value_type;
+                typedef std::conditional_t<IS_CONST, const value_type &, value_type &> reference;
+                typedef std::conditional_t<IS_CONST, const value_type *, value_type *> pointer;
+                typedef std::ptrdiff_t difference_type;
+
+                Iterator() : shard_(TABLE_SHARDS) {}
+
+                explicit Iterator(std::shared_ptr<const Ranges> ranges) : ranges_(std::move(ranges)), shard_(0),
+                                                                          it_((*ranges_)[0].first) {
+                    skip();
+                }
+
+                reference operator*() const {
+                    return *it_;
+                }
+
+                pointer operator->() const {
+                    return &*it_;
+                }
+
+                Iterator &operator++() {
+                    ++it_;
+                    skip();
+                    return *this;
+                }
+
+                bool operator==(const Iterator &other) const {
+                    return shard_ == other.shard_ && (shard_ == TABLE_SHARDS || it_ == other.it_);
+                }
+
+                bool operator!=(const Iterator &other) const {
+                    return !(*this == other);
+                }
+
+            private:
+                void skip() {
+                    while (shard_ < TABLE_SHARDS && it_ == (*ranges_)[shard_].second) {
+                        if (++shard_ < TABLE_SHARDS) {
+                            it_ = (*ranges_)[shard_].first;
+                        }
+                    }
+                }
+
+                std::shared_ptr<const Ranges> ranges_;
+                uint shard_;
+                ShardIterator it_;
+            };
+
+            typedef Iterator<false> iterator;
+            typedef Iterator<true> const_iterator;
+
+            explicit LockedTable(ShardedTable &table) {
+                auto ranges = std::make_shared<Ranges>();
+                shards_.reserve(TABLE_SHARDS);
+                for (uint i = 0; i < TABLE_SHARDS; ++i) {
+                    if (!table.damaged(i)) {
+                        shards_.push_back(table.shards_[i].lock_table());
+                        (*ranges)[i] = {shards_.back().begin(), shards_.back().end()};
+                    }
+                }
+                ranges_ = std::move(ranges);
+            }
+
+            iterator begin() {
+                return iterator(ranges_);
+            }
+
+            iterator end() {
+                return iterator();
+            }
+
+            const_iterator cbegin() const {
+                return const_iterator(ranges_);
+            }
+
+            const_iterator cend() const {
+                return const_iterator();
+            }
+
+            void unlock() {
+                shards_.clear();
+            }
+
+        private:
+            std::vector<typename Impl::locked_table> shards_;
+            std::shared_ptr<const Ranges> ranges_;
+        };
+
+        typedef LockedTable locked_table;
+
+        LockedTable lock_table() {
+            return LockedTable(*this);
+        }
+
+    private:
+        /*
+         fibonacci hashing of all but the low 12 bits: the shard doesn't depend on the low bits the buckets are picked
+         with, and runs of keys hashing close to each other (consecutive ints) stay in one shard's neighbouring buckets
+        */
+        static uint shard_of(std::size_t hash) {
+            return (((hash >> 12) * 0x9E3779B97F4A7C15UL) >> 32) % TABLE_SHARDS;
+        }
+
+        bool damaged(uint shard) const {
+            return damaged_.load() & (1U << shard);
+        }
+
+        // every lock of the shard may be gone
+        void lose(uint shard) {
+            lost_.fetch_or(1U << shard);
+            damaged_.fetch_or(1U << shard);
+        }
+
+        // the bucket locks a call for hash takes, see quarantine()
+        std::array<std::size_t, 2> lock_indexes(std::size_t hash) const {
+            const Impl &shard = shards_[shard_of(hash)];
+            if constexpr (IsFlatTable<Impl>::value) {
+                return {shard.lock_index(hash), shard.lock_index(hash)};
+            } else {
+                const std::size_t mask = (std::size_t(1) << shard.hashpower()) - 1;
+                const uint32_t h32 = static_cast<uint32_t>(hash) ^ static_cast<uint32_t>(hash >> 32);
+                const uint16_t h16 = static_cast<uint16_t>(h32) ^ static_cast<uint16_t>(h32 >> 16);
+                const std::size_t tag = static_cast<uint8_t>(h16) ^ static_cast<uint8_t>(h16 >> 8);
+                const std::size_t first = hash & mask;
+                const std::size_t second = (first ^ ((tag + 1) * 0xC6A4A7935BD1E995UL)) & mask;
+                return {first & (LOCK_STRIPES - 1), second & (LOCK_STRIPES - 1)};
+            }
+        }
+
+        union {
+            Impl shards_[TABLE_SHARDS];
+        };
+        // a bit per shard a process died in the table of, and per shard whose locks may all be gone (see quarantine())
+        std::atomic<uint32_t> damaged_{0};
+        std::atomic<uint32_t> lost_{0};
+        // a bit per bucket lock index, across the damaged shards
+        std::atomic<uint64_t> quarantined_locks_[LOCK_STRIPES / 64]{};
+        // process_token() of the thread sampling each shard, 0 if none (see erase_random_fn())
+        std::atomic<uint64_t> samplers_[TABLE_SHARDS]{};
+        // bytes of the libcuckoo shards repair() replaced
+        std::atomic<uint64_t> leaked_{0};
+    };
+
+    // see Map::scan()
+    struct ScanOptions {
+        uint64_t count = 16;        // flat table groups walked per call, a hint as in Redis; not libcuckoo buckets
+        bool expired = false;       // visit expired entries too
+        uint partition = 0;         // which of partitions parts of the map to walk
+        uint partitions = 1;        // up to TABLE_SHARDS, each part is a cursor of its own
+    };
+
+    template<class KeyType, class PayloadType,
+            class Hash = typename DefaultHash<KeyType>::type, class Pred = typename DefaultPred<KeyType>::type>
+    class Map {
+    public:
+        typedef std::pair<const KeyType, MappedValType<PayloadType> > ValueType;
+        typedef bip::allocator<ValueType, SegmentManager> ValueTypeAllocator;
+        /*
+         trivially copyable keys and payloads go to a FlatTable (unless SHMAPS_DISABLE_FLAT is defined), anything
+         holding segment pointers (strings, sets) to libcuckoo
+        */
+#ifdef SHMAPS_DISABLE_FLAT
+        static constexpr bool FLAT = false;
+#else
+        static constexpr bool FLAT = std::is_trivially_copyable_v<KeyType> &&
+                                     std::is_trivially_copyable_v<MappedValType<PayloadType>>;
+#endif
+        typedef std::conditional_t<FLAT,
+                FlatTable<KeyType, MappedValType<PayloadType>, PrehashedHash<Hash>, PrehashedPred<Pred>,
+                        ValueTypeAllocator>,
+                libcuckoo::cuckoohash_map<KeyType, MappedValType<PayloadType>,
+                        PrehashedHash<Hash>, PrehashedPred<Pred>, ValueTypeAllocator>> ShardImpl;
+        typedef ShardedTable<ShardImpl> MapImpl;
+
+        // all the map keeps in the segment, one named object (see MapDirectory)
+        struct Handle {
+            Handle(uint64_t capacity, const ValueTypeAllocator &table_alloc, const VoidAllocator &alloc) :
+                    table(capacity, PrehashedHash<Hash>(), PrehashedPred<Pred>(), table_alloc),
+                    // value-initialized: the block may be recycled segment memory, the atomics must start at zero
+                    stats(), locks(), ttl(alloc) {}
+
+            MapImpl table;
+            Stats stats;
+            StripeLocks locks;
+            TtlIndex<KeyType> ttl;
+            Capacity capacity;
+            std::atomic<Durability> durability{Durability::None};
+        };
+
+        Map() {};
+
+        /*
+         capacity: the number of entries the map is sized for when it's created, so loading that many doesn't go
+         through a series of resizes (see ShardedTable); ignored if the map exists already, see reserve()
+        */
+        explicit Map(const std::string &name, uint64_t capacity = INIT_MAP_SIZE) : map_name_(name) {
+            if (segment_ == nullptr) {
+                // static map: ctor called before main()
+                // normal map: created before init()
+                init(SHMAPS_SEG_SIZE);
+            }
+            assert(segment_ != nullptr);
+            attach(capacity);
+        }
+
+        // a map in a named segment instead of the default one, the segment must outlive it
+        Map(Segment &segment, const std::string &name, uint64_t capacity = INIT_MAP_SIZE) :
+                seg_(&segment), map_name_(name) {
+            attach(capacity);
+        }
+
+        ~Map() {
+            stop_sweeper();
+        }
+
+        // printed when a map is attached too if SHMAPS_PRINT_STATS is defined
+        void print_stats() {
+            const GatePass pass(seg_);
+            fprintf(stdout, "shared memory segment of size %luMB (%luMB free)\n"
+                            "    map %s (elements: %lu, %luKB leaked by repair())\n",
+                    active_segment()->get_size() / (1 * 1024 * 1024),
+                    active_segment()->get_free_memory() / (1 * 1024 * 1024),
+                    map_name_.c_str(),
+                    map_->size(),
+                    map_->leaked() / 1024);
+            stats->print();
+        }
+
+        void destroy() {
+            if ((seg_ != nullptr ? seg_->managed() : segment_) == nullptr) {
+                return;
+            }
+            const SegmentScope scope(seg_);
+            map_directory()->drop(map_name_);
+            active_segment()->destroy<Handle>(map_name_.c_str());
+            return;
+        }
+
+        void clear() {
+            const GatePass pass(seg_);
+            map_->clear();
+            capacity_->entries = 0;
+            log_wait(log_change(LogOp::Clear, static_cast<const KeyType *>(nullptr),
+                                static_cast<const PayloadType *>(nullptr), 0));
+            return;
+        }
+
+        /*
+         bounds the map: once it holds max_entries, inserting a new key first evicts one (see Eviction) instead of
+         growing; set_limits(0) lifts the limit. bytes can't be bounded per map (see Capacity).
+        */
+        void set_limits(uint64_t max_entries, Eviction eviction = Eviction::Clock) {
+            const GatePass pass(seg_);
+            capacity_->set(max_entries, eviction, map_->size());
+        }
+
+        // grows the table to hold n entries now, instead of resizing as they're inserted
+        void reserve(uint64_t n) {
+            const GatePass pass(seg_);
+            map_->reserve(n);
+        }
+
+        /*
+         true if operations on k fail because a process died in the table holding bucket locks k needs (see
+         StripeLocks), until repair(); looks for dead readers first
+        */
+        bool quarantined(const KeyType &k) {
+            const GatePass pass(seg_);
+            auto recovered = recover();
+            locks_->recover_readers(recovered);
+            return map_->quarantined(map_->hash_function()(k));
+        }
+
+        // segment bytes repair() couldn't free: the bucket arrays of the libcuckoo shards it dropped
+        uint64_t leaked() {
+            const GatePass pass(seg_);
+            return map_->leaked();
+        }
+
+        /*
+         drops the table shards a process died in while holding bucket locks, with all their entries, so that their
+         quarantined keys work again and inserts go there again. map operations of all processes wait meanwhile, as
+         for snapshot(). false if operations in flight didn't drain within SNAPSHOT_TIMEOUT, or if snapshots are
+         disabled (SHMAPS_DISABLE_SNAPSHOT): their gate is what keeps the operations out.
+        */
+        bool repair() {
+#ifdef SHMAPS_DISABLE_SNAPSHOT
+            std::cout << "shmaps: repair() needs snapshots enabled (SHMAPS_DISABLE_SNAPSHOT)" << std::endl;
+            return false;
+#else
+            const SegmentScope scope(seg_);
+            if (!gate()->close(std::chrono::seconds(SNAPSHOT_TIMEOUT))) {
+                std::cout << "shmaps: repair of map " << map_name_ << " timed out waiting for map operations"
+                          << std::endl;
+                return false;
+            }
+            auto recovered = recover();
+            locks_->recover_readers(recovered);
+            const uint64_t dropped = map_->repair(PrehashedHash<Hash>(), PrehashedPred<Pred>(),
+                                                  active_segment()->get_allocator<ValueType>());
+            capacity_->count(-static_cast<int64_t>(dropped));
+            gate()->reopen();
+            return true;
+#endif
+        }
+
+        /*
+         logs the map's changes (set, del, clear, MapSet::add; evictions and expirations aren't) to the change log at
+         the given durability, see open_log(); applies to every process using the map. the key and payload types
+         need a LogCodec. false if the map's name is too long to log (over 255 bytes). the log is the default
+         segment's, a map in a named Segment attaches it if needed.
+        */
+        bool set_durability(Durability durability) {
+            static_assert(loggable, "shmaps: the map's key and payload types need a LogCodec to be logged");
+            if (map_name_.size() > UINT8_MAX) {
+                std::cout << "shmaps: map name " << map_name_ << " is too long for the change log" << std::endl;
+                return false;
+            }
+            if (segment_ == nullptr) {
+                init(SHMAPS_SEG_SIZE);
+            }
+            durability_->store(durability);
+            return true;
+        }
+
+        /*
+         applies the map's records of the change log file at path, from position from on (e.g. log_position() taken
+         before a snapshot()), without logging them again; a set which has expired meanwhile is a del. returns the
+         number of records applied.
+        */
+        uint64_t replay(const std::string &path, uint64_t from = 0) {
+            return replay_impl(path, from, [](const LogRecord &) { return false; });
+        }
+
+        // the table is only locked while the iterator is made, use locked() or scan() to walk it
+        typename MapImpl::locked_table::const_iterator cbegin() {
+            return map_->lock_table().cbegin();
+        }
+
+        typename MapImpl::locked_table::const_iterator cend() {
+            return map_->lock_table().cend();
+        }
+
+        // a locked table holds off every writer and snapshot() until it's unlocked
+        typename MapImpl::locked_table locked() {
+            return map_->lock_table();
+        }
+
+        /*
+         SCAN-like resumable walk, for reporting or warm-up without stopping traffic as locked() does: call it with
+         cursor 0, then with the cursor it returned until that's 0 again. a call calls fn(key, payload) for the entries
+         of about options.count buckets under one lock stripe at a time (fn must not call the map), or for a whole
+         shard's if the map isn't flat (see ShardImpl): libcuckoo has no smaller unit, the shard's writers wait then.
+         an entry which is there for the whole walk is visited at least once whatever is inserted or resized meanwhile,
+         maybe more than once. reads by the walk don't count for eviction. options.partitions walks run in parallel
+         (by threads or processes) cover the map, each from a cursor of its own.
+        */
+        template<typename F>
+        uint64_t scan(uint64_t cursor, F fn, const ScanOptions &options = ScanOptions()) {
+            const GatePass pass(seg_);
+            const uint partitions = std::clamp<uint>(options.partitions, 1, TABLE_SHARDS);
+            return map_->scan(cursor, std::max<uint64_t>(options.count, 1), options.partition, partitions,
+                              [&](const auto &entry) {
+                                  if (options.expired || !entry.second.expired()) {
+                                      fn(entry.first, entry.second.cpayload());
+                                  }
+                              });
+        }
+
+        bool set(const KeyType &k, const PayloadType &pl, bool create_only = true, Seconds expires = Seconds(0)) {
+            Stats::Counters delta;
+            bool res = set_impl(k, k, pl, create_only, expires, delta);
+            stats->add(delta);
+            return res;
+        }
+
+        bool get(const KeyType &k, PayloadType *pl) {
+            Stats::Counters delta;
+            bool res = get_impl(k, [pl](const PayloadType &val) { *pl = val; }, delta);
+            stats->add(delta);
+            return res;
+        }
+
+        // heterogeneous lookup (e.g. std::string_view for String keys), available when Hash and Pred are transparent
+        template<typename K, typename H = Hash, typename = typename H::is_transparent>
+        bool get(const K &k, PayloadType *pl) {
+            Stats::Counters delta;
+            bool res = get_impl(k, [pl](const PayloadType &val) { *pl = val; }, delta);
+            stats->add(delta);
+            return res;
+        }
+
+        /*
+         zero-copy read: calls fn(const PayloadType &) while the bucket lock is held, nothing is copied or allocated;
+         use as_view() for String fields and don't keep references to the payload after fn returns
+        */
+        template<typename F>
+        bool with_value(const KeyType &k, F fn) {
+            return with_value_impl(k, fn);
+        }
+
+        template<typename K, typename F, typename H = Hash, typename = typename H::is_transparent>
+        bool with_value(const K &k, F fn) {
+            return with_value_impl(k, fn);
+        }
+
+        bool exists(const KeyType &k) {
+            return exists_impl(k);
+        }
+
+        template<typename K, typename H = Hash, typename = typename H::is_transparent>
+        bool exists(const K &k) {
+            return exists_impl(k);
+        }
+
+        bool del(const KeyType &k) {
+            Stats::Counters delta;
+            bool res = del_impl(k, delta);
+            stats->add(delta);
+            return res;
+        }
+
+        template<typename K, typename H = Hash, typename = typename H::is_transparent>
+        bool del(const K &k) {
+            Stats::Counters delta;
+            bool res = del_impl(k, delta);
+            stats->add(delta);
+            return res;
+        }
+
+        /*
+         in-place read-modify-write: calls fn(PayloadType &) on the live payload under the bucket lock, or on a fresh
+         payload which is then inserted with the given ttl (an expired entry is reset the same way, like set() does);
+         returns whatever fn returns. fn is called exactly once, under the key's stripe lock, so it must not call back
+         into the map.
+         throws std::runtime_error if the key is quarantined (see quarantined()), fn may have run on a fresh payload.
+        */
+        template<typename F>
+        auto exec(const KeyType &k, F fn, Seconds expires = Seconds(0)) -> decltype(fn(std::declval<PayloadType &>())) {
+            typedef decltype(fn(std::declval<PayloadType &>())) Result;
+            if constexpr (std::is_void_v<Result>) {
+                exec_impl(k, fn, expires);
+            } else {
+                std::optional<Result> res;
+                exec_impl(k, [&](PayloadType &pl) { res.emplace(fn(pl)); }, expires);
+                return std::move(*res);
+            }
+        }
+
+        /*
+         batched operations: the whole batch is hashed up front and processed in lock stripe order (see prehash()),
+         the groups of the key BATCH_PREFETCH places ahead are prefetched while a key is processed (flat tables only),
+         stats are updated once per batch. keys may be of any type get() accepts.
+        */
+
+        /*
+         (*pls)[i] holds the payload of keys[i], or nothing if it wasn't found; payloads are copy-constructed, so this
+         works for allocator-backed payloads as get() does. returns the number of keys found.
+        */
+        template<typename K>
+        uint mget(const std::vector<K> &keys, std::vector<std::optional<PayloadType>> *pls) {
+            pls->assign(keys.size(), std::nullopt);
+            Stats::Counters delta;
+            const auto batch = prehash(keys.size(), [&](std::size_t i) -> const K & { return keys[i]; });
+            for (std::size_t j = 0; j < batch.size(); ++j) {
+                prefetch(batch, j);
+                const auto &[hash, i] = batch[j];
+                std::optional<PayloadType> &pl = (*pls)[i];
+                get_impl(PrehashedKey<K>{keys[i], hash}, [&pl](const PayloadType &val) { pl.emplace(val); }, delta);
+            }
+            stats->add(delta);
+            return delta.read_hit;
+        }
+
+        // returns the number of items set (see set() for create_only semantics)
+        uint mset(const std::vector<std::pair<KeyType, PayloadType>> &items,
+                  bool create_only = true,
+                  Seconds expires = Seconds(0)) {
+            uint res = 0;
+            Stats::Counters delta;
+            const auto batch = prehash(items.size(), [&](std::size_t i) -> const KeyType & {
+                return items[i].first;
+            });
+            for (std::size_t j = 0; j < batch.size(); ++j) {
+                prefetch(batch, j);
+                const auto &[hash, i] = batch[j];
+                const KeyType &k = items[i].first;
+                res += set_impl(PrehashedKey<KeyType>{k, hash}, k, items[i].second, create_only, expires, delta);
+            }
+            stats->add(delta);
+            return res;
+        }
+
+        // returns the number of keys erased
+        template<typename K>
+        uint mdel(const std::vector<K> &keys) {
+            uint res = 0;
+            Stats::Counters delta;
+            const auto batch = prehash(keys.size(), [&](std::size_t i) -> const K & { return keys[i]; });
+            for (std::size_t j = 0; j < batch.size(); ++j) {
+                prefetch(batch, j);
+                const auto &[hash, i] = batch[j];
+                res += del_impl(PrehashedKey<K>{keys[i], hash}, delta);
+            }
+            stats->add(delta);
+            return res;
+        }
+
+        uint size() const {
+            const GatePass pass(seg_);
+            return map_->size();
+        }
+
+        /*
+         deletes up to budget expired keys filed in the map's ttl index, oldest first; returns the number deleted.
+         while some process sweeps a map (at least every TTL_SWEEPER_TIMEOUT seconds), inserts file expiring keys in
+         the index, so they're reclaimed once due rather than when the random purge happens to sample them.
+        */
+        uint64_t sweep(uint64_t budget = TTL_SWEEP_BUDGET) {
+            const GatePass pass(seg_);
+            uint64_t reclaimed = 0;
+            Stats::Counters delta;
+            delta.sweep_total = ttl_->sweep(budget, [&](const KeyType &k) {
+                bool erased = false;
+                with_stripe(k, [&](const auto &pk, StripeGuard &guard) {
+                    return guard.in_table([&] {
+                        return map_->erase_fn(pk, [&](MappedValType<PayloadType> &val) {
+                            return erased = val.expired();
+                        });
+                    });
+                });
+                return erased;
+            }, reclaimed);
+            delta.sweep_hit = reclaimed;
+            capacity_->count(-static_cast<int64_t>(reclaimed));
+            stats->add(delta);
+            return reclaimed;
+        }
+
+        // runs sweep(budget) every interval in a background thread of this process, until stop_sweeper()
+        void start_sweeper(uint64_t budget = TTL_SWEEP_BUDGET,
+                           std::chrono::milliseconds interval = std::chrono::milliseconds(100)) {
+            stop_sweeper();
+            // let writers know right away that keys are to be filed
+            sweep(0);
+            sweeper_stop_ = false;
+            sweeper_pid_ = getpid();
+            sweeper_ = new std::thread([this, budget, interval] {
+                while (!sweeper_stop_) {
+                    // a full budget means there's a backlog, keep going
+                    if (sweep(budget) < budget) {
+                        std::this_thread::sleep_for(interval);
+                    }
+                }
+            });
+        }
+
+        void stop_sweeper() {
+            // a forked child inherits the thread object, but not the thread
+            if (sweeper_ != nullptr && sweeper_pid_ == getpid()) {
+                sweeper_stop_ = true;
+                sweeper_->join();
+                delete sweeper_;
+            }
+            sweeper_ = nullptr;
+        }
+
+        Stats *stats;
+
+    protected:
+        Segment *seg_ = nullptr;    // null - the default segment
+        MapImpl *map_;
+        StripeLocks *locks_;
+        TtlIndex<KeyType> *ttl_;
+        Capacity *capacity_;
+        std::atomic<Durability> *durability_;
+        std::string map_name_;
+        std::thread *sweeper_ = nullptr;
+        std::atomic<bool> sweeper_stop_{false};
+        pid_t sweeper_pid_ = 0;
+
+        static constexpr bool loggable = LogCodec<KeyType>::supported && LogCodec<PayloadType>::supported;
+
+        // finds the map's handle in its segment's directory, or creates it
+        void attach(uint64_t capacity) {
+            {
+                const GatePass pass(seg_);
+                MapDirectory *directory = map_directory();
+                Handle *handle = static_cast<Handle *>(directory->find(map_name_));
+                if (handle == nullptr) {
+                    ManagedSegment *segment = active_segment();
+                    handle = segment->find_or_construct<Handle>(map_name_.data())(
+                            capacity, segment->get_allocator<ValueType>(), active_alloc());
+                    assert(handle != nullptr);
+                    directory->publish(map_name_, handle);
+                }
+                map_ = &handle->table;
+                stats = &handle->stats;
+                locks_ = &handle->locks;
+                ttl_ = &handle->ttl;
+                capacity_ = &handle->capacity;
+                durability_ = &handle->durability;
+            }
+#ifdef SHMAPS_PRINT_STATS
+            print_stats();
+#endif
+        }
+
+        template<typename K>
+        static const K &key_of(const K &k) {
+            return k;
+        }
+
+        template<typename K>
+        static const K &key_of(const PrehashedKey<K> &k) {
+            return k.key;
+        }
 
-        Map() {};
+        /*
+         appends a change of the map to the change log if it's logged; called with the key's stripe locked (clear()
+         aside), so a key's records are in the order of its changes. returns the record's end position for log_wait(),
+         0 if nothing was logged.
+        */
+        template<typename K, typename V>
+        uint64_t log_change(LogOp op, const K *k, const V *v, int64_t expires_ms) {
+            log_record(op, k, v, expires_ms);
+            return log_append();
+        }
 
-        explicit Map(const std::string &name) : map_name_(name) {
-            if (segment_ == nullptr) {
-                // static map: ctor called before main()
-                // normal map: created before init()
-                init(SHMAPS_SEG_SIZE);
+        /*
+         encodes the record of a change made inside the table, log_append() appends it once the table is left: the
+         ring may have to be waited on, which mustn't hold the table's locks
+        */
+        template<typename K, typename V>
+        void log_record(LogOp op, const K *k, const V *v, int64_t expires_ms) {
+            if constexpr (loggable) {
+                if (log_suppressed_ || durability_->load(std::memory_order_relaxed) == Durability::None) {
+                    return;
+                }
+                std::string &body = log_body_;
+                body.assign(sizeof(LogRecord::Fixed), '\0');
+                body.append(map_name_);
+                const std::size_t key_at = body.size();
+                if (k != nullptr) {
+                    LogCodec<KeyType>::encode(key_of(*k), body);
+                }
+                const std::size_t val_at = body.size();
+                if (v != nullptr) {
+                    LogCodec<V>::encode(*v, body);
+                }
+                const LogRecord::Fixed fixed{op, static_cast<uint8_t>(map_name_.size()), 0,
+                                             static_cast<uint32_t>(val_at - key_at),
+                                             static_cast<uint32_t>(body.size() - val_at), 0, expires_ms};
+                memcpy(body.data(), &fixed, sizeof(fixed));
+                log_pending_ = true;
             }
-            assert(segment_ != nullptr);
-            map_ = segment_->find_or_construct<MapImpl>(map_name_.data())(
-                    INIT_MAP_SIZE,
-                    Hash(),
-                    Pred(),
-                    segment_->get_allocator<MappedValType<PayloadType>>());
-            assert(map_ != nullptr);
-            stats = segment_->find_or_construct<Stats>(std::string(name + "stats").data())();
-            assert(stats != nullptr);
-            print_stats();
         }
 
-        ~Map() {
+        // appends the record log_record() encoded, if any; returns its end position (see ChangeLog::append())
+        uint64_t log_append() {
+            if (!log_pending_) {
+                return 0;
+            }
+            log_pending_ = false;
+            return change_log()->append(log_body_);
         }
 
-        void print_stats() {
-            fprintf(stdout, "shared memory segment of size %luMB (%luMB free)\n"
-                            "    map %s (elements: %lu)\n",
-                    segment_size() / (1 * 1024 * 1024),
-                    segment_->get_free_memory() / (1 * 1024 * 1024),
-                    map_name_.c_str(),
-                    map_->size());
-            stats->print();
+        // a Durability::Sync map's operation returns once its record is fsynced
+        void log_wait(uint64_t pos) {
+            if (pos != 0 && durability_->load(std::memory_order_relaxed) == Durability::Sync) {
+                change_log()->wait_durable(pos);
+            }
         }
 
-        void destroy() {
-            if (segment_ == nullptr) {
-                return;
+        // replay() with apply_other(record) for the records only a derived map knows (returns whether it applied it)
+        template<typename F>
+        uint64_t replay_impl(const std::string &path, uint64_t from, F apply_other) {
+            const SegmentScope scope(seg_);
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cout << "shmaps: can't open " << path << ": " << strerror(errno) << std::endl;
+                return 0;
             }
-            segment_->destroy<MapImpl>(map_name_.c_str());
-            return;
+            uint64_t applied = 0;
+            log_suppressed_ = true;
+            if constexpr (loggable) {
+                const int64_t now_ms = CoarseClock::wall_ms();
+                KeyType k = make_value<KeyType>();
+                PayloadType pl = make_value<PayloadType>();
+                for_each_log_record(fd, from, [&](uint64_t, const LogRecord &record) {
+                    std::string_view key = record.key;
+                    std::string_view val = record.val;
+                    if (record.name != map_name_) {
+                        return;
+                    }
+                    if (record.op == LogOp::Clear) {
+                        clear();
+                        ++applied;
+                        return;
+                    }
+                    if (!LogCodec<KeyType>::decode(key, k)) {
+                        return;
+                    }
+                    if (record.op == LogOp::Set && LogCodec<PayloadType>::decode(val, pl)) {
+                        if (record.expires_ms == 0) {
+                            set(k, pl, false);
+                        } else if (record.expires_ms > now_ms) {
+                            // rounded up, an entry never expires early
+                            set(k, pl, false, Seconds((record.expires_ms - now_ms + 999) / 1000));
+                        } else {
+                            del(k);
+                        }
+                        ++applied;
+                    } else if (record.op == LogOp::Del) {
+                        del(k);
+                        ++applied;
+                    } else {
+                        applied += apply_other(record);
+                    }
+                });
+            }
+            log_suppressed_ = false;
+            close(fd);
+            return applied;
         }
 
-        void clear() {
-            map_->clear();
-            return;
+        template<typename K>
+        PrehashedKey<K> prehashed(const K &k) const {
+            return PrehashedKey<K>{k, map_->hash_function()(k)};
         }
 
-        typename MapImpl::locked_table::const_iterator cbegin() {
-            return map_->lock_table().cbegin();
+        template<typename K>
+        PrehashedKey<K> prehashed(const PrehashedKey<K> &k) const {
+            return k;
         }
 
-        typename MapImpl::locked_table::const_iterator cend() {
-            return map_->lock_table().cend();
+        // quarantines what a process which died in the table may have held there, see StripeLocks
+        auto recover() {
+            return [this](std::size_t hash, bool whole_shard) {
+                map_->quarantine(hash, whole_shard);
+            };
         }
 
-        typename MapImpl::locked_table locked() {
-            return map_->lock_table();
+        /*
+         calls f(pk, guard) with the key hashed once and its stripe locked, f does its table calls through
+         guard.in_table(); false if the key is quarantined (a process died in the table holding locks it needs)
+        */
+        template<typename K, typename F>
+        bool with_stripe(const K &k, F f) {
+            const auto pk = prehashed(k);
+            StripeGuard guard(locks_, pk.hash, recover());
+            if (map_->quarantined(pk.hash)) {
+                return false;
+            }
+            return f(pk, guard);
         }
 
-        bool set(const KeyType &k, const PayloadType &pl, bool create_only = true, Seconds expires = Seconds(0)) {
-            bool existing = false;
-            if (!map_->update_fn(k, [&](MappedValType<PayloadType> &val) {
-                if (val.expired()) {
-                    val.reset(pl, expires);
-                    ++stats->write.insert.total;
-                    if (expires != Seconds(0)) {
-                        ++stats->write.insert.expiring;
-                    } else {
-                        ++stats->write.insert.permanent;
-                    }
-                } else {
-                    existing = true;
-                    if (!create_only) {
-                        val.reset(pl);
-                        ++stats->write.update;
-                    }
-                }
-            })) {
-                if (!map_->insert(k, MappedValType<PayloadType>(pl, expires))) {
-                    ++stats->write.insert.error;
+        /*
+         calls f(pk) for a read, which locks no stripe: readers only wait while a writer is in the table on the key's
+         stripe (see StripeLocks::pass()), so one which died there is noticed, and are recorded while they're in the
+         table themselves (see StripeLocks::read()); false if the key is quarantined
+        */
+        template<typename K, typename F>
+        bool with_read(const K &k, F f) {
+            const auto pk = prehashed(k);
+            locks_->pass(pk.hash, recover());
+            if (map_->quarantined(pk.hash)) {
+                return false;
+            }
+            return locks_->read(pk.hash, recover(), [&] {
+                return f(pk);
+            });
+        }
+
+        /*
+         with_stripe() for several keys: f() runs with the stripes of all of them locked, each once and in ascending
+         order so operations on overlapping keys can't deadlock, and does its table calls through
+         locks_->in_table() with the key's hash; false if one of the keys is quarantined
+        */
+        template<typename F>
+        bool with_stripes(const std::vector<std::size_t> &hashes, F f) {
+            std::vector<std::size_t> stripes = hashes;
+            const auto stripe_less = [](std::size_t a, std::size_t b) {
+                return a % ROBUST_STRIPES < b % ROBUST_STRIPES;
+            };
+            std::sort(stripes.begin(), stripes.end(), stripe_less);
+            stripes.erase(std::unique(stripes.begin(), stripes.end(), [](std::size_t a, std::size_t b) {
+                return a % ROBUST_STRIPES == b % ROBUST_STRIPES;
+            }), stripes.end());
+            std::deque<StripeGuard> guards;
+            for (std::size_t hash: stripes) {
+                guards.emplace_back(locks_, hash, recover());
+            }
+            for (std::size_t hash: hashes) {
+                if (map_->quarantined(hash)) {
                     return false;
                 }
-                purge();
+            }
+            return f();
+        }
 
-                ++stats->write.insert.total;
-                if (expires != Seconds(0)) {
-                    ++stats->write.insert.expiring;
-                } else {
-                    ++stats->write.insert.permanent;
+        // lk is what the table is probed with (the key itself or its PrehashedKey), k is what gets inserted
+        template<typename LK>
+        bool set_impl(const LK &lk, const KeyType &k, const PayloadType &pl, bool create_only, Seconds expires,
+                      Stats::Counters &delta) {
+            const GatePass pass(seg_);
+            bool existing = false;
+            uint64_t logged = 0;
+            const uint64_t inserted = delta.insert_total;
+            if (!with_stripe(lk, [&](const auto &pk, StripeGuard &guard) {
+                if (guard.in_table([&] {
+                    return map_->update_fn(pk, [&](MappedValType<PayloadType> &val) {
+                        if (val.expired()) {
+                            val.reset(pl, expires);
+                            delta.inserted(expires);
+                        } else {
+                            existing = true;
+                            val.touch();
+                            if (create_only) {
+                                return;
+                            }
+                            val.reset(pl);
+                            ++delta.update;
+                        }
+                        log_record(LogOp::Set, &k, &pl, val.expires_wall_ms());
+                    });
+                })) {
+                    logged = log_append();
+                    return true;
+                }
+                MappedValType<PayloadType> val(pl, expires);
+                const int64_t expires_ms = val.expires_wall_ms();
+                evict(delta);
+                if (!guard.in_table([&] {
+                    return map_->insert(pk, k, std::move(val));
+                }, true)) {
+                    return false;
                 }
+                capacity_->count(1);
+                purge(delta);
+                delta.inserted(expires);
+                logged = log_change(LogOp::Set, &k, &pl, expires_ms);
                 return true;
+            })) {
+                ++delta.insert_error;
+                return false;
             }
+            if (delta.insert_total != inserted) {
+                ttl_->add(k, expires);
+            }
+            log_wait(logged);
             return !(create_only && existing);
         }
 
-        bool get(const KeyType &k, PayloadType *pl) {
+        // store(const PayloadType &) copies out the payload found, under the bucket lock
+        template<typename K, typename F>
+        bool get_impl(const K &k, F store, Stats::Counters &delta) {
+            const GatePass pass(seg_);
             bool found = false;
-            map_->update_fn(k, [&](MappedValType<PayloadType> &val) {
-                found = !val.expired();
-                if (found) {
-                    *pl = val.payload();
-                }
+            with_read(k, [&](const auto &pk) {
+                return map_->find_fn(pk, [&](const MappedValType<PayloadType> &val) {
+                    found = !val.expired();
+                    if (found) {
+                        val.touch();
+                        store(val.cpayload());
+                    }
+                });
             });
-            ++stats->read.total;
-            found ? ++stats->read.hit : ++stats->read.miss;
+            delta.read(found);
             return found;
         }
 
-        bool exists(const KeyType &k) {
+        template<typename K, typename F>
+        bool with_value_impl(const K &k, F &fn) {
+            const GatePass pass(seg_);
             bool found = false;
-            map_->find_fn(k, [&](const MappedValType<PayloadType> &val) {
-                found = !val.expired();
+            with_read(k, [&](const auto &pk) {
+                return map_->find_fn(pk, [&](const MappedValType<PayloadType> &val) {
+                    found = !val.expired();
+                    if (found) {
+                        val.touch();
+                        fn(val.cpayload());
+                    }
+                });
             });
-            ++stats->read.total;
-            found ? ++stats->read.hit : ++stats->read.miss;
+            Stats::Counters delta;
+            delta.read(found);
+            stats->add(delta);
             return found;
         }
 
-        bool del(const KeyType &k) {
-            return map_->erase(k);
-        }
-
-        template<typename K, typename F>
-        auto exec(const K &key, F fn, PayloadType *foo = nullptr) -> decltype(fn(foo)) {
-            /*
-            // TODO!!!!!!!!
-            decltype(fn(foo)) a;
-            return a;*/
-            bool found = false;
-            auto res = map_->exec_fn(
-                    key,
-                    [&](MappedValType<PayloadType> *val, PayloadType *foo = nullptr) -> decltype(fn(foo)) {
-                        found = val && !val->expired();
-                        if (found) {
-                            return fn(&val->payload());
+        template<typename F>
+        void exec_impl(const KeyType &k, F fn, Seconds expires) {
+            const GatePass pass(seg_);
+            Stats::Counters delta;
+            uint64_t logged = 0;
+            if (!with_stripe(k, [&](const auto &pk, StripeGuard &guard) {
+                if (guard.in_table([&] {
+                    return map_->update_fn(pk, [&](MappedValType<PayloadType> &val) {
+                        if (val.expired()) {
+                            val.reset(make_value<PayloadType>(), expires);
+                            delta.inserted(expires);
                         } else {
-                            return fn(nullptr);
+                            val.touch();
+                            ++delta.update;
                         }
+                        fn(val.payload());
+                        log_record(LogOp::Set, &k, &val.cpayload(), val.expires_wall_ms());
                     });
-            return res;
+                })) {
+                    logged = log_append();
+                    return true;
+                }
+                // a new key's payload is made outside the table; the stripe lock keeps other writers of k out, so
+                // the insert can only fail in a damaged shard
+                MappedValType<PayloadType> val(make_value<PayloadType>(), expires);
+                fn(val.payload());
+                logged = log_change(LogOp::Set, &k, &val.cpayload(), val.expires_wall_ms());
+                evict(delta);
+                if (!guard.in_table([&] {
+                    return map_->insert(pk, k, std::move(val));
+                }, true)) {
+                    // k wasn't there, the del cancels the record
+                    logged = log_change(LogOp::Del, &k, static_cast<const PayloadType *>(nullptr), 0);
+                    return false;
+                }
+                capacity_->count(1);
+                purge(delta);
+                delta.inserted(expires);
+                return true;
+            })) {
+                ++delta.insert_error;
+                stats->add(delta);
+                throw std::runtime_error("shmaps: map " + map_name_ + " is quarantined for this key, see repair()");
+            }
+            if (delta.insert_total) {
+                ttl_->add(k, expires);
+            }
+            stats->add(delta);
+            log_wait(logged);
         }
 
-        uint size() const {
-            return map_->size();
+        template<typename K>
+        bool exists_impl(const K &k) {
+            const GatePass pass(seg_);
+            bool found = false;
+            with_read(k, [&](const auto &pk) {
+                return map_->find_fn(pk, [&](const MappedValType<PayloadType> &val) {
+                    found = !val.expired();
+                    if (found) {
+                        val.touch();
+                    }
+                });
+            });
+            Stats::Counters delta;
+            delta.read(found);
+            stats->add(delta);
+            return found;
         }
 
-        Stats *stats;
+        template<typename K>
+        bool del_impl(const K &k, Stats::Counters &delta) {
+            const GatePass pass(seg_);
+            uint64_t logged = 0;
+            if (!with_stripe(k, [&](const auto &pk, StripeGuard &guard) {
+                if (!guard.in_table([&] {
+                    return map_->erase(pk);
+                })) {
+                    return false;
+                }
+                logged = log_change(LogOp::Del, &key_of(k), static_cast<const PayloadType *>(nullptr), 0);
+                return true;
+            })) {
+                return false;
+            }
+            capacity_->count(-1);
+            ++delta.del;
+            log_wait(logged);
+            return true;
+        }
 
-    protected:
-        MapImpl *map_;
-        std::string map_name_;
+        /*
+         hashes a batch of n keys (key_at(i) returns the i-th one) and orders it by table shard and lock stripe, so
+         consecutive operations of the batch reuse the lock and bucket lines just touched; returns (hash, index) pairs
+        */
+        template<typename KeyAt>
+        std::vector<std::pair<std::size_t, std::size_t>> prehash(std::size_t n, KeyAt key_at) const {
+            const auto hash = map_->hash_function();
+            std::vector<std::pair<std::size_t, std::size_t>> batch(n);
+            for (std::size_t i = 0; i < n; ++i) {
+                batch[i] = {hash(key_at(i)), i};
+            }
+            const auto order = [this](std::size_t h) {
+                return std::make_pair(&map_->shard(PrehashedKey<int>{0, h}), map_->lock_index(h));
+            };
+            std::sort(batch.begin(), batch.end(), [&order](const auto &a, const auto &b) {
+                return order(a.first) < order(b.first);
+            });
+            return batch;
+        }
+
+        // prefetches the table lines of the batch's key BATCH_PREFETCH places after the j-th (see prehash())
+        void prefetch(const std::vector<std::pair<std::size_t, std::size_t>> &batch, std::size_t j) const {
+            if (j + BATCH_PREFETCH < batch.size()) {
+                map_->prefetch(batch[j + BATCH_PREFETCH].first);
+            }
+        }
 
-        void purge() {
+        void purge(Stats::Counters &delta) {
             /*
             const uint purge_every = 1;
             if (stats->write.insert.total % purge_every != 0)
                 return;
             */
+            // even while a sweeper is active: keys inserted before it started aren't in the ttl index
             const uint purge_elements = 4;
             uint purged_elements = map_->erase_random_fn(purge_elements, [&](MappedValType<PayloadType> &val) {
-                ++stats->write.purge.total;
+                ++delta.purge_total;
                 return val.expired();
             });
-            stats->write.purge.hit += purged_elements;
+            delta.purge_hit += purged_elements;
+            capacity_->count(-static_cast<int64_t>(purged_elements));
             return;
         }
+
+        /*
+         makes room for a new key in a bounded map (see set_limits()); gives up after EVICT_ROUNDS samples which found
+         entries but nothing to evict. a small map in a large table samples empty slots too, those are retried up to
+         EVICT_SAMPLES times as often.
+        */
+        void evict(Stats::Counters &delta) {
+            if (!capacity_->limited()) {
+                return;
+            }
+            const bool clock = capacity_->eviction.load(std::memory_order_relaxed) == Eviction::Clock;
+            uint rounds = 0;
+            for (uint tries = 0; rounds < EVICT_ROUNDS && tries < EVICT_ROUNDS * EVICT_SAMPLES; ++tries) {
+                if (!capacity_->full()) {
+                    return;
+                }
+                bool sampled = false;
+                bool evicted = false;
+                uint n = map_->erase_random_fn(EVICT_SAMPLES, [&](MappedValType<PayloadType> &val) {
+                    sampled = true;
+                    if (evicted) {
+                        return false;
+                    }
+                    if (clock && val.accessed() && !val.expired()) {
+                        val.clear_access();
+                        return false;
+                    }
+                    return evicted = true;
+                });
+                delta.evict += n;
+                capacity_->count(-static_cast<int64_t>(n));
+                rounds += sampled;
+            }
+        }
     };
 
-    template<class KeyType, class SetValType, class Hash = boost::hash<KeyType>, class Pred = std::equal_to<KeyType>>
+    template<class KeyType, class SetValType,
+            class Hash = typename DefaultHash<KeyType>::type, class Pred = typename DefaultPred<KeyType>::type>
     class MapSet
-            : public Map<KeyType, bip::set<SetValType, std::less<SetValType>, bip::allocator<SetValType, SegmentManager>>, Hash, Pred> {
-        typedef bip::set<SetValType, std::less<SetValType>, bip::allocator<SetValType, SegmentManager>> PayloadType;
+            : public Map<KeyType, CompactSet<SetValType>, Hash, Pred> {
+        typedef CompactSet<SetValType> PayloadType;
         using Map<KeyType, PayloadType, Hash, Pred>::map_;
         using Map<KeyType, PayloadType, Hash, Pred>::stats;
         using Map<KeyType, PayloadType, Hash, Pred>::purge;
+        using Map<KeyType, PayloadType, Hash, Pred>::prehash;
+        using Map<KeyType, PayloadType, Hash, Pred>::prefetch;
+        using Map<KeyType, PayloadType, Hash, Pred>::with_stripe;
+        using Map<KeyType, PayloadType, Hash, Pred>::with_stripes;
+        using Map<KeyType, PayloadType, Hash, Pred>::with_read;
+        using Map<KeyType, PayloadType, Hash, Pred>::locks_;
+        using Map<KeyType, PayloadType, Hash, Pred>::ttl_;
+        using Map<KeyType, PayloadType, Hash, Pred>::capacity_;
+        using Map<KeyType, PayloadType, Hash, Pred>::evict;
+        using Map<KeyType, PayloadType, Hash, Pred>::log_change;
+        using Map<KeyType, PayloadType, Hash, Pred>::log_record;
+        using Map<KeyType, PayloadType, Hash, Pred>::log_append;
+        using Map<KeyType, PayloadType, Hash, Pred>::log_wait;
+        using Map<KeyType, PayloadType, Hash, Pred>::replay_impl;
+        using Map<KeyType, PayloadType, Hash, Pred>::seg_;
         using ValueType = typename Map<KeyType, PayloadType, Hash, Pred>::ValueType;
 
     public:
 
         MapSet() : Map<KeyType, PayloadType, Hash, Pred>() {};
 
-        explicit MapSet(const std::string &name) : Map<KeyType, PayloadType, Hash, Pred>(name) {};
+        explicit MapSet(const std::string &name, uint64_t capacity = INIT_MAP_SIZE) :
+                Map<KeyType, PayloadType, Hash, Pred>(name, capacity) {};
+
+        MapSet(Segment &segment, const std::string &name, uint64_t capacity = INIT_MAP_SIZE) :
+                Map<KeyType, PayloadType, Hash, Pred>(segment, name, capacity) {};
 
         ~MapSet() {};
 
         bool add(const KeyType &k, const SetValType &pl_elem, Seconds expires = Seconds(0)) {
             // add one or more members into a set
-            if (!map_->update_fn(k, [&](MappedValType<PayloadType> &val) {
-                if (val.expired()) {
-                    val.payload().clear();
-                    val.payload().insert(pl_elem);
-                    val.reset(expires);
-                    ++stats->write.insert.total;
-                    if (expires != Seconds(0)) {
-                        ++stats->write.insert.expiring;
-                    } else {
-                        ++stats->write.insert.permanent;
+            Stats::Counters delta;
+            bool res = add_impl(k, k, pl_elem, expires, delta);
+            stats->add(delta);
+            return res;
+        }
+
+        // batched add() of (key, member) pairs, see Map::mget(); returns the number of members added
+        uint madd(const std::vector<std::pair<KeyType, SetValType>> &items, Seconds expires = Seconds(0)) {
+            uint res = 0;
+            Stats::Counters delta;
+            const auto batch = prehash(items.size(), [&](std::size_t i) -> const KeyType & {
+                return items[i].first;
+            });
+            for (std::size_t j = 0; j < batch.size(); ++j) {
+                prefetch(batch, j);
+                const auto &[hash, i] = batch[j];
+                const KeyType &k = items[i].first;
+                res += add_impl(PrehashedKey<KeyType>{k, hash}, k, items[i].second, expires, delta);
+            }
+            stats->add(delta);
+            return res;
+        }
+
+        // Map::replay(), add records included
+        uint64_t replay(const std::string &path, uint64_t from = 0) {
+            const SegmentScope scope(seg_);
+            KeyType k = make_value<KeyType>();
+            SetValType member = make_value<SetValType>();
+            return replay_impl(path, from, [&](const LogRecord &record) {
+                std::string_view key = record.key;
+                std::string_view val = record.val;
+                if ((record.op != LogOp::Add && record.op != LogOp::Remove) || !LogCodec<KeyType>::decode(key, k) ||
+                    !LogCodec<SetValType>::decode(val, member)) {
+                    return false;
+                }
+                if (record.op == LogOp::Remove) {
+                    remove(k, member);
+                    return true;
+                }
+                const int64_t now_ms = CoarseClock::wall_ms();
+                if (record.expires_ms == 0) {
+                    add(k, member);
+                } else if (record.expires_ms > now_ms) {
+                    add(k, member, Seconds((record.expires_ms - now_ms + 999) / 1000));
+                }
+                return true;
+            });
+        }
+
+        bool members(const KeyType &k, std::set<SetValType> *pl) {
+            return members_impl(k, pl);
+        }
+
+        template<typename K, typename H = Hash, typename = typename H::is_transparent>
+        bool members(const K &k, std::set<SetValType> *pl) {
+            return members_impl(k, pl);
+        }
+
+        bool is_member(const KeyType &k, const SetValType pl_val) {
+            return is_member_impl(k, pl_val);
+        }
+
+        template<typename K, typename H = Hash, typename = typename H::is_transparent>
+        bool is_member(const K &k, const SetValType pl_val) {
+            return is_member_impl(k, pl_val);
+        }
+
+        // the number of members, 0 if there's no set
+        uint64_t card(const KeyType &k) {
+            const GatePass pass(seg_);
+            uint64_t res = 0;
+            with_read(k, [&](const auto &pk) {
+                return map_->find_fn(pk, [&](const MappedValType<PayloadType> &val) {
+                    if (!val.expired()) {
+                        val.touch();
+                        res = val.cpayload().size();
                     }
-                } else {
-                    val.payload().insert(pl_elem);
-                    ++stats->write.update;
+                });
+            });
+            Stats::Counters delta;
+            delta.read(res != 0);
+            stats->add(delta);
+            return res;
+        }
+
+        // false if it's not a member; the key goes with its last member
+        bool remove(const KeyType &k, const SetValType &pl_elem) {
+            return remove_impl(k, [&](PayloadType &set) {
+                return set.erase(pl_elem) ? &pl_elem : nullptr;
+            });
+        }
+
+        // removes a random member into *pl_elem, false if there's no set (see CompactSet::sample())
+        bool pop_random(const KeyType &k, SetValType *pl_elem) {
+            static thread_local uint64_t rnd = reinterpret_cast<uint64_t>(&rnd);
+            rnd = rnd * 6364136223846793005UL + 1442695040888963407UL;
+            return remove_impl(k, [&](PayloadType &set) -> const SetValType * {
+                const auto it = set.sample(rnd >> 17);
+                if (it == set.end()) {
+                    return nullptr;
                 }
-            })) {
-                MappedValType<PayloadType> val(expires, VoidAllocator(segment_->get_segment_manager()));
-                val.payload().insert(pl_elem);
-                if (!map_->insert(k, val)) {
-                    ++stats->write.insert.error;
-                    return false;
+                *pl_elem = *it;
+                set.erase(*pl_elem);
+                return pl_elem;
+            });
+        }
+
+        /*
+         set algebra on the sets in the segment, without copying them out: a key without a set is an empty one.
+         the results replace *res, or replace dst's set (an empty one removes dst) with the given expiration; false
+         only if one of the keys is quarantined (see Map::quarantined()).
+        */
+        bool intersect(const KeyType &a, const KeyType &b, std::set<SetValType> *res) {
+            res->clear();
+            return with_sets(a, b, nullptr, Seconds(0), [&](const PayloadType &set_a, const PayloadType &set_b,
+                                                            PayloadType *) {
+                intersect_sets(set_a, set_b, [&](const SetValType &member) {
+                    res->insert(member);
+                });
+            });
+        }
+
+        bool intersect(const KeyType &a, const KeyType &b, const KeyType &dst, Seconds expires = Seconds(0)) {
+            return with_sets(a, b, &dst, expires, [&](const PayloadType &set_a, const PayloadType &set_b,
+                                                      PayloadType *out) {
+                intersect_sets(set_a, set_b, [&](const SetValType &member) {
+                    out->insert(member);
+                });
+            });
+        }
+
+        // members of a which aren't members of b
+        bool diff(const KeyType &a, const KeyType &b, std::set<SetValType> *res) {
+            res->clear();
+            return with_sets(a, b, nullptr, Seconds(0), [&](const PayloadType &set_a, const PayloadType &set_b,
+                                                            PayloadType *) {
+                diff_sets(set_a, set_b, [&](const SetValType &member) {
+                    res->insert(member);
+                });
+            });
+        }
+
+        bool diff(const KeyType &a, const KeyType &b, const KeyType &dst, Seconds expires = Seconds(0)) {
+            return with_sets(a, b, &dst, expires, [&](const PayloadType &set_a, const PayloadType &set_b,
+                                                      PayloadType *out) {
+                diff_sets(set_a, set_b, [&](const SetValType &member) {
+                    out->insert(member);
+                });
+            });
+        }
+
+        // adds src's members to dst's set, which keeps its expiration; expires is a new set's
+        bool union_into(const KeyType &dst, const KeyType &src, Seconds expires = Seconds(0)) {
+            return with_sets(dst, src, &dst, expires, [&](const PayloadType &, const PayloadType &set_src,
+                                                          PayloadType *out) {
+                *out = set_src;
+            }, true);
+        }
+
+    private:
+        // calls add(member) for the members of both sets, looking the smaller one's up in the larger one
+        template<typename Add>
+        static void intersect_sets(const PayloadType &set_a, const PayloadType &set_b, Add add) {
+            const bool a_smaller = set_a.size() <= set_b.size();
+            const PayloadType &smaller = a_smaller ? set_a : set_b;
+            const PayloadType &larger = a_smaller ? set_b : set_a;
+            for (const SetValType &member: smaller) {
+                if (larger.contains(member)) {
+                    add(member);
+                }
+            }
+        }
+
+        // calls add(member) for the members of set_a which aren't members of set_b
+        template<typename Add>
+        static void diff_sets(const PayloadType &set_a, const PayloadType &set_b, Add add) {
+            for (const SetValType &member: set_a) {
+                if (!set_b.contains(member)) {
+                    add(member);
                 }
-                purge();
+            }
+        }
 
-                ++stats->write.insert.total;
-                if (expires != Seconds(0)) {
-                    ++stats->write.insert.expiring;
-                } else {
-                    ++stats->write.insert.permanent;
+        template<typename LK>
+        bool add_impl(const LK &lk, const KeyType &k, const SetValType &pl_elem, Seconds expires,
+                      Stats::Counters &delta) {
+            const GatePass pass(seg_);
+            uint64_t logged = 0;
+            const uint64_t inserted = delta.insert_total;
+            if (!with_stripe(lk, [&](const auto &pk, StripeGuard &guard) {
+                if (guard.in_table([&] {
+                    return map_->update_fn(pk, [&](MappedValType<PayloadType> &val) {
+                        if (val.expired()) {
+                            val.payload().clear();
+                            val.payload().insert(pl_elem);
+                            val.reset(expires);
+                            delta.inserted(expires);
+                        } else {
+                            val.touch();
+                            val.payload().insert(pl_elem);
+                            ++delta.update;
+                        }
+                        log_record(LogOp::Add, &k, &pl_elem, val.expires_wall_ms());
+                    });
+                })) {
+                    logged = log_append();
+                    return true;
+                }
+                MappedValType<PayloadType> val(expires, active_alloc());
+                val.payload().insert(pl_elem);
+                const int64_t expires_ms = val.expires_wall_ms();
+                evict(delta);
+                if (!guard.in_table([&] {
+                    return map_->insert(pk, k, val);
+                }, true)) {
+                    return false;
                 }
+                capacity_->count(1);
+                purge(delta);
+                delta.inserted(expires);
+                logged = log_change(LogOp::Add, &k, &pl_elem, expires_ms);
+                return true;
+            })) {
+                ++delta.insert_error;
+                return false;
             }
+            if (delta.insert_total != inserted) {
+                ttl_->add(k, expires);
+            }
+            log_wait(logged);
             return true;
         }
 
-        bool members(const KeyType &k, std::set<SetValType> *pl) {
+        template<typename K>
+        bool members_impl(const K &k, std::set<SetValType> *pl) {
+            const GatePass pass(seg_);
             bool found = false;
-            map_->update_fn(k, [&](MappedValType<PayloadType> &val) {
-                if (!val.expired()) {
-                    found = true;
-                    for (auto it = val.payload().begin(); it != val.payload().end(); ++it) {
-                        pl->insert((*it));
+            with_read(k, [&](const auto &pk) {
+                return map_->find_fn(pk, [&](const MappedValType<PayloadType> &val) {
+                    if (!val.expired()) {
+                        found = true;
+                        val.touch();
+                        for (auto it = val.cpayload().begin(); it != val.cpayload().end(); ++it) {
+                            pl->insert((*it));
+                        }
                     }
-                }
+                });
             });
-            ++stats->read.total;
-            found ? ++stats->read.hit : ++stats->read.miss;
+            Stats::Counters delta;
+            delta.read(found);
+            stats->add(delta);
             return found;
         }
 
-        bool is_member(const KeyType &k, const SetValType pl_val) {
+        // remove(set) removes a member from k's live set and returns it (for the log), nullptr if it removed none
+        template<typename F>
+        bool remove_impl(const KeyType &k, F remove) {
+            const GatePass pass(seg_);
+            bool res = false;
+            bool emptied = false;
+            uint64_t logged = 0;
+            with_stripe(k, [&](const auto &pk, StripeGuard &guard) {
+                guard.in_table([&] {
+                    return map_->erase_fn(pk, [&](MappedValType<PayloadType> &val) {
+                        const SetValType *removed = val.expired() ? nullptr : remove(val.payload());
+                        if (removed == nullptr) {
+                            return false;
+                        }
+                        res = true;
+                        log_record(LogOp::Remove, &k, removed, val.expires_wall_ms());
+                        return emptied = val.cpayload().empty();
+                    });
+                });
+                logged = log_append();
+                return res;
+            });
+            if (emptied) {
+                capacity_->count(-1);
+            }
+            Stats::Counters delta;
+            delta.update += res;
+            stats->add(delta);
+            log_wait(logged);
+            return res;
+        }
+
+        /*
+         runs f(a's set, b's set, out) on the live sets of a and b (empty ones for keys without), out being an empty
+         set if there's a dst. the sets stay in the table: the smaller one is copied into a temporary in the segment
+         and f runs in a lookup of the other, with the stripes of all the keys held so no write changes them in
+         between. out is stored in dst afterwards (see store()), with the given expiration if dst had no set.
+        */
+        template<typename F>
+        bool with_sets(const KeyType &a, const KeyType &b, const KeyType *dst, Seconds expires, F f,
+                       bool merge = false) {
+            const GatePass pass(seg_);
+            const auto hash = map_->hash_function();
+            const PrehashedKey<KeyType> pks[2] = {{a, hash(a)}, {b, hash(b)}};
+            const bool same = Pred()(a, b);
+            std::vector<std::size_t> hashes = {pks[0].hash, pks[1].hash};
+            const std::size_t dst_hash = dst != nullptr ? hash(*dst) : 0;
+            if (dst != nullptr) {
+                hashes.push_back(dst_hash);
+            }
+            Stats::Counters delta;
+            uint64_t logged = 0;
+            const uint64_t inserted = delta.insert_total;
+            const bool res = with_stripes(hashes, [&] {
+                // reads one of the sets in the table, fn(set) runs unless there's none
+                const auto read = [&](uint i, const auto &fn) {
+                    bool live = false;
+                    locks_->in_table(pks[i].hash, [&] {
+                        return map_->find_fn(pks[i], [&](const MappedValType<PayloadType> &val) {
+                            if (!val.expired()) {
+                                val.touch();
+                                live = true;
+                                fn(val.cpayload());
+                            }
+                        });
+                    });
+                    return live;
+                };
+                uint64_t sizes[2] = {0, 0};
+                for (uint i = 0; i < (same ? 1 : 2); ++i) {
+                    read(i, [&](const PayloadType &set) {
+                        sizes[i] = set.size();
+                    });
+                }
+                const uint copied = !same && sizes[0] < sizes[1] ? 0 : 1;
+                PayloadType copy(active_alloc());
+                PayloadType out(active_alloc());
+                delta.read(read(copied, [&](const PayloadType &set) {
+                    copy = set;
+                }));
+                const auto run = [&](const PayloadType &other) {
+                    f(copied == 0 ? copy : other, copied == 1 ? copy : other, dst != nullptr ? &out : nullptr);
+                };
+                if (same) {
+                    run(copy);
+                } else {
+                    const bool live = read(1 - copied, run);
+                    if (!live) {
+                        run(PayloadType(active_alloc()));
+                    }
+                    delta.read(live);
+                }
+                return dst == nullptr || store(*dst, dst_hash, out, expires, merge, delta, logged);
+            });
+            if (!res) {
+                ++delta.insert_error;
+            } else if (delta.insert_total != inserted) {
+                ttl_->add(*dst, expires);
+            }
+            stats->add(delta);
+            log_wait(logged);
+            return res;
+        }
+
+        /*
+         with_sets()' store of out into dst's set: out replaces it (an empty out removes dst), or with merge its
+         members are added to it, which keeps its expiration
+        */
+        bool store(const KeyType &dst, std::size_t hash, PayloadType &out, Seconds expires, bool merge,
+                   Stats::Counters &delta, uint64_t &logged) {
+            const PrehashedKey<KeyType> pk{dst, hash};
+            if (out.empty()) {
+                if (!merge && locks_->in_table(hash, [&] {
+                    return map_->erase(pk);
+                })) {
+                    capacity_->count(-1);
+                    logged = log_change(LogOp::Del, &dst, static_cast<const PayloadType *>(nullptr), 0);
+                }
+                return true;
+            }
+            if (locks_->in_table(hash, [&] {
+                return map_->update_fn(pk, [&](MappedValType<PayloadType> &val) {
+                    if (val.expired()) {
+                        val.reset(expires);
+                        delta.inserted(expires);
+                        val.payload() = std::move(out);
+                    } else if (merge) {
+                        for (const SetValType &member: out) {
+                            val.payload().insert(member);
+                        }
+                        ++delta.update;
+                    } else {
+                        val.reset(expires);
+                        val.payload() = std::move(out);
+                        ++delta.update;
+                    }
+                    log_record(LogOp::Set, &dst, &val.cpayload(), val.expires_wall_ms());
+                });
+            })) {
+                logged = log_append();
+                return true;
+            }
+            MappedValType<PayloadType> val(expires, active_alloc());
+            val.payload() = std::move(out);
+            const int64_t expires_ms = val.expires_wall_ms();
+            evict(delta);
+            // logged before val is moved into the table, the key can't be there with its stripe held
+            logged = log_change(LogOp::Set, &dst, &val.cpayload(), expires_ms);
+            if (!locks_->in_table(hash, [&] {
+                return map_->insert(pk, dst, std::move(val));
+            }, true)) {
+                // refused by a damaged shard, the del cancels the record
+                logged = log_change(LogOp::Del, &dst, static_cast<const PayloadType *>(nullptr), 0);
+                return false;
+            }
+            capacity_->count(1);
+            purge(delta);
+            delta.inserted(expires);
+            return true;
+        }
+
+        template<typename K>
+        bool is_member_impl(const K &k, const SetValType &pl_val) {
+            const GatePass pass(seg_);
             bool found = false;
-            map_->update_fn(k, [&](MappedValType<PayloadType> &val) {
-                found = !val.expired() && (val.payload().find(pl_val) != val.payload().end());
+            with_read(k, [&](const auto &pk) {
+                return map_->find_fn(pk, [&](const MappedValType<PayloadType> &val) {
+                    found = !val.expired() && val.cpayload().contains(pl_val);
+                    if (found) {
+                        val.touch();
+                    }
+                });
             });
-            ++stats->read.total;
-            found ? ++stats->read.hit : ++stats->read.miss;
+            Stats::Counters delta;
+            delta.read(found);
+            stats->add(delta);
             return found;
         }
     };
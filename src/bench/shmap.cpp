@@ -3,10 +3,50 @@
 
 #include <benchmark/benchmark.h>
 
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <random>
+#include <set>
+#include <thread>
+
 const std::string long_str = std::string(100, 'a');
 
 namespace bip = boost::interprocess;
 
+// runs fn(worker) in num_wrk forked processes and waits for all of them
+static void run_workers(int num_wrk, const std::function<void(int)> &fn) {
+    for (int wrk = 0; wrk < num_wrk; ++wrk) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            fn(wrk);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0);
+}
+
+// runs fn in a forked process, returns the time in seconds fn measured there (for manual time benchmarks)
+static double run_timed_worker(const std::function<double()> &fn) {
+    int fds[2];
+    int res = pipe(fds);
+    assert(res == 0);
+    double seconds = 0;
+    run_workers(1, [&](int) {
+        double t = fn();
+        res = write(fds[1], &t, sizeof(t));
+    });
+    res = read(fds[0], &seconds, sizeof(seconds));
+    close(fds[0]);
+    close(fds[1]);
+    return seconds;
+}
+
 class ShMapFixture : public ::benchmark::Fixture {
 public:
     ShMapFixture() {
@@ -16,6 +56,7 @@ public:
         shmap_int_foostats = new shmaps::Map<int, FooStats>("ShMapIntFooStats");
         shmap_string_foostats_ext = new shmaps::Map<shmaps::String, FooStatsExtShared>("ShMapStringFooStatsExt");
         shmap_string_int = new shmaps::Map<shmaps::String, int>("ShMapStringInt");
+        shmap_fixedstring_int = new shmaps::Map<shmaps::FixedString<128>, int>("ShMapFixedStringInt");
 
         shmap_string_set_int = new shmaps::MapSet<shmaps::String, int>("ShMapStringSetInt");
         shmap_string_set_string = new shmaps::MapSet<shmaps::String, shmaps::String>("ShMapStringSetString");
@@ -54,6 +95,7 @@ public:
     shmaps::Map<int, FooStats> *shmap_int_foostats;
     shmaps::Map<shmaps::String, FooStatsExtShared> *shmap_string_foostats_ext;
     shmaps::Map<shmaps::String, int> *shmap_string_int;
+    shmaps::Map<shmaps::FixedString<128>, int> *shmap_fixedstring_int;
 
     shmaps::MapSet<shmaps::String, int> *shmap_string_set_int;
     shmaps::MapSet<shmaps::String, shmaps::String> *shmap_string_set_string;
@@ -70,6 +112,100 @@ BENCHMARK_F(ShMapFixture, BM_ShMap_Set_IntInt)(benchmark::State &state) {
     }
 }
 
+// startup: num_wrk freshly forked workers each attach to the same num_maps existing maps
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_Attach)(benchmark::State &state) {
+    const int num_maps = state.range(0);
+    const int num_wrk = state.range(1);
+    for (int m = 0; m < num_maps; ++m) {
+        delete new shmaps::Map<int, int>("ShMapAttach" + std::to_string(m));
+    }
+    for (auto _: state) {
+        run_workers(num_wrk, [&](int) {
+            for (int m = 0; m < num_maps; ++m) {
+                delete new shmaps::Map<int, int>("ShMapAttach" + std::to_string(m));
+            }
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * num_wrk * num_maps);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_Attach)
+        ->ArgsProduct({{16, 256}, {1, 8}})->ArgNames({"maps", "workers"})->UseRealTime();
+
+// expiring writes with expired entries reclaimed by the random purge on insert (0) or by a background sweeper (1)
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_SetExpiring_IntInt)(benchmark::State &state) {
+    const bool sweeper = state.range(0);
+    auto *shmap = new shmaps::Map<int, int>("ShMapSetExpiringIntInt" + std::to_string(sweeper));
+    if (sweeper) {
+        shmap->start_sweeper();
+    }
+    int k = 0;
+    for (auto _: state) {
+        for (int i = 0; i < el_num; ++i) {
+            shmap->set(k++, i, false, std::chrono::seconds(1));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+    shmap->stop_sweeper();
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_SetExpiring_IntInt)->Arg(0)->Arg(1);
+
+// overhead of the change log on writes: not logged (0), group-committed every 100ms (1), fsynced per set (2)
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_LoggedSet_IntInt)(benchmark::State &state) {
+    const std::string path = "/tmp/shmaps_bench.log";
+    const auto durability = static_cast<shmaps::Durability>(state.range(0));
+    auto *shmap = new shmaps::Map<int, int>("ShMapLoggedIntInt" + std::to_string(state.range(0)));
+    bool res = shmaps::open_log(path);
+    assert(res);
+    shmap->set_durability(durability);
+    int k = 0;
+    for (auto _: state) {
+        shmap->set(k, k, false);
+        k = (k + 1) % el_num;
+    }
+    state.SetItemsProcessed(state.iterations());
+    shmap->set_durability(shmaps::Durability::None);
+    shmaps::close_log();
+    unlink(path.c_str());
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_LoggedSet_IntInt)->DenseRange(0, 2)->ArgName("durability");
+
+// sets into a new map growing from the default size (0) or created with room for all the keys (1), tail latencies
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_GrowingSet_IntInt)(benchmark::State &state) {
+    const bool presized = state.range(0);
+    std::vector<uint64_t> latencies;
+    latencies.reserve(el_num);
+    for (auto _: state) {
+        state.PauseTiming();
+        auto *shmap = presized ? new shmaps::Map<int, int>("ShMapGrowing", el_num)
+                               : new shmaps::Map<int, int>("ShMapGrowing");
+        state.ResumeTiming();
+        for (int i = 0; i < el_num; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            shmap->set(i, i, false);
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+        }
+        state.PauseTiming();
+        shmap->destroy();
+        delete shmap;
+        state.ResumeTiming();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return static_cast<double>(latencies[static_cast<size_t>(p * (latencies.size() - 1))]);
+    };
+    state.SetItemsProcessed(state.iterations() * el_num);
+    state.counters["p50_ns"] = percentile(0.5);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["p999_ns"] = percentile(0.999);
+    state.counters["max_ns"] = percentile(1);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_GrowingSet_IntInt)->Arg(0)->Arg(1)->ArgName("presized")->Iterations(3);
+
 BENCHMARK_F(ShMapFixture, BM_ShMap_SetGet_IntInt)(benchmark::State &state) {
     bool res;
     int val;
@@ -109,6 +245,31 @@ BENCHMARK_F(ShMapFixture, BM_ShMap_SetGet_IntFooStats)(benchmark::State &state)
     }
 }
 
+BENCHMARK_F(ShMapFixture, BM_ShMap_GetSet_IntFooStats)(benchmark::State &state) {
+    bool res;
+    FooStats fs;
+    for (auto _: state) {
+        shmap_int_foostats->clear();
+        for (int i = 0; i < el_num; ++i) {
+            if (!shmap_int_foostats->get(i % 1024, &fs)) {
+                fs = FooStats(i, 2, 0.0);
+            }
+            fs.rev += 1.0;
+            res = shmap_int_foostats->set(i % 1024, fs, false, std::chrono::seconds(el_expires));
+            assert(res);
+        }
+    }
+}
+
+BENCHMARK_F(ShMapFixture, BM_ShMap_Exec_IntFooStats)(benchmark::State &state) {
+    for (auto _: state) {
+        shmap_int_foostats->clear();
+        for (int i = 0; i < el_num; ++i) {
+            shmap_int_foostats->exec(i % 1024, [](FooStats &v) { v.rev += 1.0; }, std::chrono::seconds(el_expires));
+        }
+    }
+}
+
 BENCHMARK_F(ShMapFixture, BM_ShMap_Set_StringInt)(benchmark::State &state) {
     bool res;
     for (auto _: state) {
@@ -144,6 +305,59 @@ BENCHMARK_F(ShMapFixture, BM_ShMap_SetGet_StringInt)(benchmark::State &state) {
     }
 }
 
+BENCHMARK_F(ShMapFixture, BM_ShMap_SetGetView_StringInt)(benchmark::State &state) {
+    bool res;
+    int val;
+    for (auto _: state) {
+        shmap_string_int->clear();
+        for (int i = 0; i < el_num; ++i) {
+            std::string k(std::to_string(i).append(long_str));
+            shmaps::String s(k.c_str(), *shmaps::seg_alloc);
+            res = shmap_string_int->set(s,
+                                        i,
+                                        false,
+                                        std::chrono::seconds(el_expires));
+            assert(res);
+            res = shmap_string_int->get(std::string_view(k), &val);
+            assert(res && val == i);
+        }
+    }
+}
+
+// same keys as BM_ShMap_Set_StringInt\BM_ShMap_SetGet_StringInt, stored inline
+BENCHMARK_F(ShMapFixture, BM_ShMap_Set_FixedStringInt)(benchmark::State &state) {
+    bool res;
+    for (auto _: state) {
+        shmap_fixedstring_int->clear();
+        for (int i = 0; i < el_num; ++i) {
+            shmaps::FixedString<128> s(std::to_string(i).append(long_str));
+            res = shmap_fixedstring_int->set(s,
+                                             i,
+                                             false,
+                                             std::chrono::seconds(el_expires));
+            assert(res);
+        }
+    }
+}
+
+BENCHMARK_F(ShMapFixture, BM_ShMap_SetGet_FixedStringInt)(benchmark::State &state) {
+    bool res;
+    int val;
+    for (auto _: state) {
+        shmap_fixedstring_int->clear();
+        for (int i = 0; i < el_num; ++i) {
+            shmaps::FixedString<128> s(std::to_string(i).append(long_str));
+            res = shmap_fixedstring_int->set(s,
+                                             i,
+                                             false,
+                                             std::chrono::seconds(el_expires));
+            assert(res);
+            res = shmap_fixedstring_int->get(s, &val);
+            assert(res && val == i);
+        }
+    }
+}
+
 BENCHMARK_F(ShMapFixture, BM_ShMap_Set_StringFooStatsExt)(benchmark::State &state) {
     bool res;
     for (auto _: state) {
@@ -179,6 +393,496 @@ BENCHMARK_F(ShMapFixture, BM_ShMap_SetGet_StringFooStatsExt)(benchmark::State &s
     }
 }
 
+BENCHMARK_F(ShMapFixture, BM_ShMap_SetWithValue_StringFooStatsExt)(benchmark::State &state) {
+    bool res;
+    for (auto _: state) {
+        shmap_string_foostats_ext->clear();
+        for (int i = 0; i < el_num; ++i) {
+            std::string k(std::to_string(i).append(long_str));
+            shmaps::String s(k.c_str(), *shmaps::seg_alloc);
+            res = shmap_string_foostats_ext->set(s,
+                                                 FooStatsExtShared(i, s.c_str(), s.c_str()),
+                                                 false,
+                                                 std::chrono::seconds(el_expires));
+            assert(res);
+            res = shmap_string_foostats_ext->with_value(std::string_view(k), [&](const FooStatsExtShared &fse) {
+                assert((fse.i1 == i) && (shmaps::as_view(fse.s1) == k) && (shmaps::as_view(fse.s2) == k));
+            });
+            assert(res);
+        }
+    }
+}
+
+// per-key throughput of batched get/set at batch sizes 1..1024 (single-key get/set is BM_ShMap_SetGet_IntInt)
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_MSet_IntInt)(benchmark::State &state) {
+    const int batch_size = state.range(0);
+    std::vector<std::pair<int, int>> batch(batch_size);
+    for (auto _: state) {
+        shmap_int_int->clear();
+        for (int i = 0; i < el_num; i += batch_size) {
+            for (int j = 0; j < batch_size; ++j) {
+                batch[j] = {i + j, i + j};
+            }
+            shmap_int_int->mset(batch, false, std::chrono::seconds(el_expires));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_MSet_IntInt)->RangeMultiplier(4)->Range(1, 1024);
+
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_MGet_IntInt)(benchmark::State &state) {
+    const int batch_size = state.range(0);
+    std::vector<int> keys(batch_size);
+    std::vector<std::optional<int>> vals;
+    shmap_int_int->clear();
+    for (int i = 0; i < el_num; ++i) {
+        shmap_int_int->set(i, i, false);
+    }
+    for (auto _: state) {
+        for (int i = 0; i < el_num; i += batch_size) {
+            for (int j = 0; j < batch_size; ++j) {
+                keys[j] = i + j;
+            }
+            shmap_int_int->mget(keys, &vals);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_MGet_IntInt)->RangeMultiplier(4)->Range(1, 1024);
+
+// read scaling: every process reads the same 1024 hot keys, so readers meet on the same buckets
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_MultiProcessGet_IntFooStats)(benchmark::State &state) {
+    const int num_wrk = state.range(0);
+    const int hot_keys = 1024;
+    shmap_int_foostats->clear();
+    for (int i = 0; i < hot_keys; ++i) {
+        shmap_int_foostats->set(i, FooStats(i, 2, 3.0), false);
+    }
+    for (auto _: state) {
+        run_workers(num_wrk, [&](int wrk) {
+            FooStats fs;
+            for (int i = 0; i < el_num; ++i) {
+                shmap_int_foostats->get(i % hot_keys, &fs);
+            }
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * num_wrk * el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_MultiProcessGet_IntFooStats)
+        ->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+// stats contention: workers use disjoint keys, so the per-map stats are the only shared cache lines they write
+// (compare against a build with -DSHMAPS_DISABLE_STATS=ON)
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_MultiProcessSetGet_IntInt)(benchmark::State &state) {
+    const int num_wrk = state.range(0);
+    for (auto _: state) {
+        shmap_int_int->clear();
+        run_workers(num_wrk, [&](int wrk) {
+            int val;
+            for (int i = wrk * el_num; i < (wrk + 1) * el_num; ++i) {
+                shmap_int_int->set(i, i, false, std::chrono::seconds(el_expires));
+                shmap_int_int->get(i, &val);
+            }
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * num_wrk * el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_MultiProcessSetGet_IntInt)->Arg(1)->Arg(4)->Arg(16)->UseRealTime();
+
+// allocation scaling: every set allocates a key and two payload strings, workers use disjoint keys
+// (compare against a build with -DSHMAPS_DISABLE_SLAB=ON)
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_MultiProcessSet_StringFooStatsExt)(benchmark::State &state) {
+    const int num_wrk = state.range(0);
+    const int wrk_el_num = el_num / 16;
+    for (auto _: state) {
+        shmap_string_foostats_ext->clear();
+        run_workers(num_wrk, [&](int wrk) {
+            for (int i = wrk * wrk_el_num; i < (wrk + 1) * wrk_el_num; ++i) {
+                shmaps::String s(std::to_string(i).append(long_str).c_str(), *shmaps::seg_alloc);
+                shmap_string_foostats_ext->set(s, FooStatsExtShared(i, s.c_str(), s.c_str()), false);
+            }
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * num_wrk * wrk_el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_MultiProcessSet_StringFooStatsExt)
+        ->Arg(1)->Arg(4)->Arg(16)->UseRealTime();
+
+/*
+ segment isolation: half of the workers insert into one map, half into another, both allocating a key and payload
+ strings per set; the maps share the default segment (0) or each has a named segment of its own (1)
+*/
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_MultiProcessSet_TwoMaps)(benchmark::State &state) {
+    const bool own_segments = state.range(0);
+    const int num_wrk = 8;
+    const int wrk_el_num = el_num / 16;
+    std::vector<shmaps::Segment *> segments;
+    std::vector<shmaps::Map<shmaps::String, FooStatsExtShared> *> shmaps_two;
+    for (int m = 0; m < 2; ++m) {
+        const std::string name = "ShMapTwoMaps" + std::to_string(own_segments) + "_" + std::to_string(m);
+        if (own_segments) {
+            segments.push_back(new shmaps::Segment("SharedMemorySegmentBench" + std::to_string(m), 1UL << 30));
+            shmaps_two.push_back(new shmaps::Map<shmaps::String, FooStatsExtShared>(*segments.back(), name));
+        } else {
+            shmaps_two.push_back(new shmaps::Map<shmaps::String, FooStatsExtShared>(name));
+        }
+    }
+    for (auto _: state) {
+        shmaps_two[0]->clear();
+        shmaps_two[1]->clear();
+        run_workers(num_wrk, [&](int wrk) {
+            auto *shmap = shmaps_two[wrk % 2];
+            shmaps::VoidAllocator &alloc = own_segments ? segments[wrk % 2]->alloc() : *shmaps::seg_alloc;
+            for (int i = wrk * wrk_el_num; i < (wrk + 1) * wrk_el_num; ++i) {
+                shmaps::String s(std::to_string(i).append(long_str).c_str(), alloc);
+                shmap->set(s, FooStatsExtShared(i, s.c_str(), s.c_str(), alloc), false);
+            }
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * num_wrk * wrk_el_num);
+    for (auto *shmap: shmaps_two) {
+        delete shmap;
+    }
+    for (auto *segment: segments) {
+        segment->remove();
+        delete segment;
+    }
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_MultiProcessSet_TwoMaps)->Arg(0)->Arg(1)->ArgName("segments")->UseRealTime();
+
+/*
+ random lookups over a map far beyond the TLB reach, per segment backing: 0 - default, 1 - populated,
+ 2 - numa interleaved, 3 - transparent huge pages, 4 - huge pages populated. every config gets its own map, so its
+ pages are faulted after the config is applied; huge page configs go last since madvise() can't be undone.
+*/
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_RandomGet_IntInt)(benchmark::State &state) {
+    const int config = state.range(0);
+    shmaps::SegmentOptions opts;
+    opts.populate = (config == 1 || config == 4);
+    opts.numa = (config == 2) ? shmaps::SegmentOptions::Numa::Interleave : shmaps::SegmentOptions::Numa::Unchanged;
+    opts.huge_pages = (config >= 3);
+    // populate what's used so far and the room the new map is about to take
+    shmaps::advise(opts, shmaps::segment_used() + 128UL * el_num);
+
+    auto *shmap = new shmaps::Map<uint64_t, uint64_t>("ShMapRandomGet" + std::to_string(config));
+    for (uint64_t i = 0; i < el_num; ++i) {
+        shmap->set(i, i, false);
+    }
+    std::mt19937_64 rnd_gen(config);
+    std::uniform_int_distribution<uint64_t> dist_keys(0, el_num - 1);
+    uint64_t val;
+    for (auto _: state) {
+        for (int i = 0; i < el_num; ++i) {
+            shmap->get(dist_keys(rnd_gen), &val);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+
+    if (config == 2) {
+        opts = shmaps::SegmentOptions();
+        opts.numa = shmaps::SegmentOptions::Numa::Local;
+        shmaps::advise(opts, 0);
+    }
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_RandomGet_IntInt)->DenseRange(0, 4)->ArgName("backing");
+
+// random lookups from a table's find_fn() by state.range(1) threads at once: every thread reads the whole key range
+template<class Table>
+static void table_get(benchmark::State &state) {
+    typedef typename Table::value_type Value;
+    Table table(el_num, boost::hash<uint64_t>(), std::equal_to<uint64_t>(),
+                shmaps::TAllocator<Value>(*shmaps::seg_alloc));
+    shmaps::Seconds permanent(0);
+    for (uint64_t i = 0; i < el_num; ++i) {
+        table.insert(i, i, permanent);
+    }
+    const int num_threads = state.range(1);
+    for (auto _: state) {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&table, t] {
+                std::mt19937_64 rnd_gen(t);
+                std::uniform_int_distribution<uint64_t> dist_keys(0, el_num - 1);
+                uint64_t val = 0;
+                for (int i = 0; i < el_num; ++i) {
+                    table.find_fn(dist_keys(rnd_gen), [&val](const shmaps::MappedValType<uint64_t> &v) {
+                        val += v.cpayload();
+                    });
+                }
+                benchmark::DoNotOptimize(val);
+            });
+        }
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num * num_threads);
+}
+
+/*
+ the flat table (0, lock-free reads) against libcuckoo (1, which locks the key's buckets for a read) in one build, the
+ tables used directly with the segment's allocator: what a map's shard does on a get, without the map around it
+*/
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_TableGet_IntInt)(benchmark::State &state) {
+    typedef std::pair<const uint64_t, shmaps::MappedValType<uint64_t>> Value;
+    if (state.range(0) == 0) {
+        table_get<shmaps::FlatTable<uint64_t, shmaps::MappedValType<uint64_t>, boost::hash<uint64_t>,
+                std::equal_to<uint64_t>, shmaps::TAllocator<Value>>>(state);
+    } else {
+        table_get<libcuckoo::cuckoohash_map<uint64_t, shmaps::MappedValType<uint64_t>, boost::hash<uint64_t>,
+                std::equal_to<uint64_t>, shmaps::TAllocator<Value>>>(state);
+    }
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_TableGet_IntInt)
+        ->Args({0, 1})->Args({1, 1})->Args({0, 4})->Args({1, 4})->ArgNames({"libcuckoo", "threads"})->UseRealTime();
+
+// cache workload on a map bounded to a quarter of the keys: 80% of the reads go to 20% of them, a miss sets the key
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_BoundedGetSet_IntInt)(benchmark::State &state) {
+    const auto eviction = static_cast<shmaps::Eviction>(state.range(0));
+    auto *shmap = new shmaps::Map<uint64_t, uint64_t>("ShMapBounded" + std::to_string(state.range(0)));
+    shmap->set_limits(el_num / 4, eviction);
+    std::mt19937_64 rnd_gen(0);
+    std::uniform_int_distribution<uint64_t> dist_hot(0, el_num / 5 - 1);
+    std::uniform_int_distribution<uint64_t> dist_keys(0, el_num - 1);
+    std::uniform_int_distribution<int> dist_pct(0, 99);
+    uint64_t val;
+    uint64_t hits = 0;
+    for (auto _: state) {
+        for (int i = 0; i < el_num; ++i) {
+            uint64_t k = dist_pct(rnd_gen) < 80 ? dist_hot(rnd_gen) : dist_keys(rnd_gen);
+            if (shmap->get(k, &val)) {
+                ++hits;
+            } else {
+                shmap->set(k, k, false);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+    state.counters["hit_ratio"] = static_cast<double>(hits) / (state.iterations() * el_num);
+    state.counters["evictions"] = shmap->stats->snapshot().evict;
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_BoundedGetSet_IntInt)
+        ->Arg(static_cast<int>(shmaps::Eviction::Clock))
+        ->Arg(static_cast<int>(shmaps::Eviction::Random))
+        ->ArgName("eviction");
+
+// random lookups in a shm (0) or a file backed (1) segment, each in a process of its own
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_BackendGet_IntInt)(benchmark::State &state) {
+    const bool file = state.range(0);
+    for (auto _: state) {
+        state.SetIterationTime(run_timed_worker([&] {
+            if (file) {
+                shmaps::SegmentOptions opts;
+                opts.file = "/tmp/shmaps_bench.segment";
+                shmaps::detach();
+                shmaps::init(SHMAPS_SEG_SIZE, opts);
+            }
+            auto *shmap = new shmaps::Map<uint64_t, uint64_t>("ShMapBackendGet");
+            for (uint64_t i = 0; i < el_num; ++i) {
+                shmap->set(i, i, false);
+            }
+            std::mt19937_64 rnd_gen(0);
+            std::uniform_int_distribution<uint64_t> dist_keys(0, el_num - 1);
+            uint64_t val;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < el_num; ++i) {
+                shmap->get(dist_keys(rnd_gen), &val);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            if (file) {
+                shmaps::reset();
+            }
+            return elapsed.count();
+        }));
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_BackendGet_IntInt)->Arg(0)->Arg(1)->ArgName("file")->UseManualTime();
+
+// set latencies while a thread keeps walking a map of el_num keys with locked() (0) or scan() (1)
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_WalkedSet_IntInt)(benchmark::State &state) {
+    const bool scan = state.range(0);
+    auto *shmap = new shmaps::Map<uint64_t, uint64_t>("ShMapWalked" + std::to_string(scan));
+    for (int i = 0; i < el_num; ++i) {
+        shmap->set(i, i, false);
+    }
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> walks{0};
+    std::thread walker([&] {
+        while (!stop) {
+            uint64_t sum = 0;
+            if (scan) {
+                uint64_t cursor = 0;
+                do {
+                    cursor = shmap->scan(cursor, [&sum](uint64_t, uint64_t v) { sum += v; });
+                } while (cursor != 0 && !stop);
+            } else {
+                auto locked = shmap->locked();
+                for (auto it = locked.cbegin(); it != locked.cend(); ++it) {
+                    sum += it->second.cpayload();
+                }
+            }
+            benchmark::DoNotOptimize(sum);
+            ++walks;
+        }
+    });
+    const int wrk_el_num = el_num / 16;
+    std::vector<uint64_t> latencies;
+    latencies.reserve(wrk_el_num * 3);
+    for (auto _: state) {
+        for (int i = 0; i < wrk_el_num; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            shmap->set(i, i + 1, false);
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    stop = true;
+    walker.join();
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return static_cast<double>(latencies[static_cast<size_t>(p * (latencies.size() - 1))]);
+    };
+    state.SetItemsProcessed(state.iterations() * wrk_el_num);
+    state.counters["p99_ns"] = percentile(0.99);
+    state.counters["p999_ns"] = percentile(0.999);
+    state.counters["max_ns"] = percentile(1);
+    state.counters["walks"] = walks.load();
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_WalkedSet_IntInt)->Arg(0)->Arg(1)->ArgName("scan")->Iterations(3);
+
+/*
+ segment memory a set takes per member, by set size (inline, sorted and hashed sets), key included. each iteration
+ fills enough fresh sets for blocks freed and reused while they grow not to skew the free memory delta.
+*/
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_SetMemory_IntInt)(benchmark::State &state) {
+    const int members = state.range(0);
+    const int sets = std::max(1, 65536 / members);
+    auto *shmap = new shmaps::MapSet<int, int>("ShMapSetMemory" + std::to_string(members));
+    int key = 0;
+    uint64_t used = 0;
+    for (auto _: state) {
+        const uint64_t used_before = shmaps::segment_used();
+        for (int set = 0; set < sets; ++set, ++key) {
+            for (int i = 0; i < members; ++i) {
+                bool res = shmap->add(key, i);
+                assert(res);
+            }
+        }
+        used += shmaps::segment_used() - used_before;
+    }
+    state.SetItemsProcessed(state.iterations() * sets * members);
+    state.counters["bytes_per_member"] = static_cast<double>(used) / (state.iterations() * sets * members);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_SetMemory_IntInt)
+        ->Arg(4)->Arg(64)->Arg(4096)->Arg(100000)->ArgName("members")->Iterations(3);
+
+// is_member() on a set of the given size, half of the lookups are members
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_IsMember_IntInt)(benchmark::State &state) {
+    const int members = state.range(0);
+    auto *shmap = new shmaps::MapSet<int, int>("ShMapIsMember" + std::to_string(members));
+    for (int i = 0; i < members; ++i) {
+        bool res = shmap->add(0, i * 2);
+        assert(res);
+    }
+    std::mt19937 rnd_gen(0);
+    std::uniform_int_distribution<int> dist(0, members * 2 - 1);
+    uint64_t hits = 0;
+    for (auto _: state) {
+        for (int i = 0; i < el_num; ++i) {
+            hits += shmap->is_member(0, dist(rnd_gen));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * el_num);
+    state.counters["hit_ratio"] = static_cast<double>(hits) / (state.iterations() * el_num);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_IsMember_IntInt)
+        ->Arg(4)->Arg(64)->Arg(4096)->Arg(100000)->ArgName("members");
+
+/*
+ intersection of two 4096 member sets sharing half of them: copied out with members() and intersected in process
+ memory (0), intersect() into a std::set (1), intersect() into a third key (2)
+*/
+BENCHMARK_DEFINE_F(ShMapFixture, BM_ShMap_SetIntersect_IntInt)(benchmark::State &state) {
+    const int mode = state.range(0);
+    const int members = 4096;
+    auto *shmap = new shmaps::MapSet<int, int>("ShMapSetIntersect" + std::to_string(mode));
+    for (int i = 0; i < members; ++i) {
+        shmap->add(0, i);
+        shmap->add(1, i + members / 2);
+    }
+    uint64_t card = 0;
+    for (auto _: state) {
+        if (mode == 0) {
+            std::set<int> a, b;
+            std::vector<int> res;
+            shmap->members(0, &a);
+            shmap->members(1, &b);
+            std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(res));
+            card = res.size();
+        } else if (mode == 1) {
+            std::set<int> res;
+            shmap->intersect(0, 1, &res);
+            card = res.size();
+        } else {
+            shmap->intersect(0, 1, 2);
+            card = shmap->card(2);
+        }
+        benchmark::DoNotOptimize(card);
+    }
+    assert(card == members / 2);
+    state.SetItemsProcessed(state.iterations() * members * 2);
+}
+
+BENCHMARK_REGISTER_F(ShMapFixture, BM_ShMap_SetIntersect_IntInt)->DenseRange(0, 2)->ArgName("mode");
+
+// snapshot of the whole segment (everything the benchmarks before this one left in it) to a file
+BENCHMARK_F(ShMapFixture, BM_ShMap_Snapshot)(benchmark::State &state) {
+    const std::string path = "/tmp/shmaps_bench.snapshot";
+    const uint64_t used = shmaps::segment_used();
+    for (auto _: state) {
+        bool res = shmaps::snapshot(path);
+        assert(res);
+    }
+    state.SetBytesProcessed(state.iterations() * used);
+}
+
+/*
+ warm restart: a fresh process restores the segment from the snapshot and reads a key. restore needs the segment to be
+ gone, so the child removes it; this process keeps working on its (now unnamed) copy, the restored one takes the name.
+*/
+BENCHMARK_F(ShMapFixture, BM_ShMap_RestoreFirstHit)(benchmark::State &state) {
+    const std::string path = "/tmp/shmaps_bench.snapshot";
+    shmap_int_int->set(0, 0, false);
+    bool res = shmaps::snapshot(path);
+    assert(res);
+    for (auto _: state) {
+        run_workers(1, [&](int) {
+            shmaps::reset();
+            bool res = shmaps::restore(path);
+            assert(res);
+            auto *shmap = new shmaps::Map<int, int>("ShMapIntInt");
+            int val;
+            res = shmap->get(0, &val);
+            assert(res);
+        });
+    }
+    unlink(path.c_str());
+}
+
 /*
 BENCHMARK_F(ShMapFixture, BM_ShMap_Add_String_SetString)(benchmark::State &state) {
     bool res;
@@ -15,17 +15,13 @@ public:
 
     }
 
-    FooStats(const FooStats &fs) : k(fs.k), b(fs.b), rev(fs.rev) {
+    // defaulted copies keep it trivially copyable, so maps of it get the flat table
+    FooStats(const FooStats &fs) = default;
 
-    }
-
-    FooStats(FooStats &fs) : k(fs.k), b(fs.b), rev(fs.rev) {
-
-    }
+    FooStats &operator=(const FooStats &fs) = default;
 
-    ~FooStats() {
+    ~FooStats() = default;
 
-    };
     int k;
     int b;
     float rev;
@@ -34,8 +30,9 @@ public:
 class FooStatsExtShared {
 public:
     FooStatsExtShared() : s1(*shmaps::seg_alloc), s2(*shmaps::seg_alloc) {}
-    FooStatsExtShared(const int i1, const char *c1, const char *c2) :
-            i1(i1), s1(c1, *shmaps::seg_alloc), s2(c2, *shmaps::seg_alloc) {}
+    FooStatsExtShared(const int i1, const char *c1, const char *c2,
+                      const shmaps::VoidAllocator &alloc = *shmaps::seg_alloc) :
+            i1(i1), s1(c1, alloc), s2(c2, alloc) {}
     ~FooStatsExtShared() {}
 
     int i1;
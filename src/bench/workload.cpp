@@ -0,0 +1,637 @@
+/*
+ workload driver: forks --procs processes x --threads threads running a get/set/del mix against one map for --seconds,
+ keys drawn uniformly, from a (scrambled) zipfian or from a hot set; reports throughput and per op latencies as text or
+ JSON (--json). the same run against libcuckoo (one process, the map is process private) or a local redis gives the
+ baselines to compare with.
+
+    ./workload --procs=4 --threads=2 --keys=1048576 --dist=zipf --theta=0.99 --get=95 --set=5 --ttl=2 --json
+*/
+#include "../../include/shmaps/shmaps.hh"
+#include "./conf.h"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <hiredis/hiredis.h>
+#include <libcuckoo/cuckoohash_map.hh>
+
+// latency histogram sub-buckets per power of two, bounds the percentile error to 1/32
+#define HIST_SUB_BITS 5
+// latency histogram buckets, enough for any uint64_t nanoseconds
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+// ops between two checks of the stop flag
+#define STOP_CHECK_OPS 64
+// seconds the workers have to get ready (connect, attach the map) before the run is given up
+#define SETUP_TIMEOUT_S 30
+
+enum Op {
+    Get, Set, Del, OpNum
+};
+
+static const char *op_names[OpNum] = {"get", "set", "del"};
+
+struct Options {
+    std::string backend = "shmap";
+    int procs = 1;
+    int threads = 1;
+    uint64_t keys = el_num;
+    std::string dist = "uniform";
+    // zipfian skew, in (0, 1)
+    double theta = 0.99;
+    // fraction of the keys that is hot and fraction of the ops going to them
+    double hot_keys = 0.2;
+    double hot_ops = 0.8;
+    // op mix weights
+    uint mix[OpNum] = {95, 5, 0};
+    // expiration of the keys set during the run, 0 for none
+    int ttl = 0;
+    double seconds = 10;
+    uint64_t seed = 0;
+    bool json = false;
+};
+
+// log-linear histogram of nanoseconds: exact below 2^HIST_SUB_BITS, then 2^HIST_SUB_BITS buckets per power of two
+struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+
+    static size_t bucket(uint64_t v) {
+        if (v < (1UL << HIST_SUB_BITS)) {
+            return v;
+        }
+        const int exp = 63 - __builtin_clzl(v);
+        return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (exp - HIST_SUB_BITS)) & ((1UL << HIST_SUB_BITS) - 1));
+    }
+
+    // lowest value of a bucket
+    static uint64_t value(size_t b) {
+        if (b < (1UL << HIST_SUB_BITS)) {
+            return b;
+        }
+        const int exp = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+        return ((1UL << HIST_SUB_BITS) + (b & ((1UL << HIST_SUB_BITS) - 1))) << (exp - HIST_SUB_BITS);
+    }
+
+    void add(uint64_t v) {
+        ++counts[bucket(v)];
+    }
+
+    void merge(const Histogram &h) {
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+            counts[b] += h.counts[b];
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+            n += counts[b];
+        }
+        return n;
+    }
+
+    uint64_t percentile(double p) const {
+        const uint64_t n = count();
+        if (n == 0) {
+            return 0;
+        }
+        const uint64_t rank = std::min(n - 1, static_cast<uint64_t>(p * n));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+            seen += counts[b];
+            if (seen > rank) {
+                return value(b);
+            }
+        }
+        return 0;
+    }
+};
+
+// what a thread reports back, lives in memory shared with the parent
+struct ThreadResult {
+    Histogram latencies[OpNum];
+    uint64_t get_hits;
+};
+
+// run control, shared with the forked workers
+struct Control {
+    std::atomic<int> ready;
+    std::atomic<bool> start;
+    std::atomic<bool> stop;
+};
+
+/*
+ key generator. zipfian ranks follow Gray et al., "Quickly Generating Billion-Record Synthetic Databases" (as in YCSB),
+ and are scrambled so the popular keys are spread over the table instead of being the smallest ones.
+*/
+class KeyGen {
+public:
+    explicit KeyGen(const Options &options) : options_(options) {
+        if (options.dist == "zipf") {
+            zetan_ = zeta(options.keys, options.theta);
+            alpha_ = 1.0 / (1.0 - options.theta);
+            eta_ = (1 - std::pow(2.0 / options.keys, 1 - options.theta)) / (1 - zeta(2, options.theta) / zetan_);
+        }
+    }
+
+    template<typename R>
+    uint64_t next(R &rnd) {
+        if (options_.dist == "zipf") {
+            const double u = std::uniform_real_distribution<double>(0, 1)(rnd);
+            const double uz = u * zetan_;
+            uint64_t rank;
+            if (uz < 1) {
+                rank = 0;
+            } else if (uz < 1 + std::pow(0.5, options_.theta)) {
+                rank = 1;
+            } else {
+                rank = static_cast<uint64_t>(options_.keys * std::pow(eta_ * u - eta_ + 1, alpha_));
+            }
+            return scramble(std::min(rank, options_.keys - 1)) % options_.keys;
+        }
+        if (options_.dist == "hot") {
+            const uint64_t hot = std::max<uint64_t>(1, options_.keys * options_.hot_keys);
+            if (hot < options_.keys && std::uniform_real_distribution<double>(0, 1)(rnd) >= options_.hot_ops) {
+                return std::uniform_int_distribution<uint64_t>(hot, options_.keys - 1)(rnd);
+            }
+            return std::uniform_int_distribution<uint64_t>(0, hot - 1)(rnd);
+        }
+        return std::uniform_int_distribution<uint64_t>(0, options_.keys - 1)(rnd);
+    }
+
+private:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(i, theta);
+        }
+        return sum;
+    }
+
+    // splitmix64 finalizer
+    static uint64_t scramble(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+        return x ^ (x >> 31);
+    }
+
+    const Options &options_;
+    double zetan_ = 0;
+    double alpha_ = 0;
+    double eta_ = 0;
+};
+
+// one thread's view of the map under test
+class Client {
+public:
+    virtual ~Client() = default;
+
+    virtual bool get(uint64_t k) = 0;
+
+    virtual void set(uint64_t k, uint64_t v, int ttl) = 0;
+
+    virtual void del(uint64_t k) = 0;
+};
+
+// the map under test, made once before the workers fork
+class Backend {
+public:
+    virtual ~Backend() = default;
+
+    virtual void clear() = 0;
+
+    virtual std::unique_ptr<Client> client() = 0;
+};
+
+class ShMapBackend : public Backend {
+    class ShMapClient : public Client {
+    public:
+        explicit ShMapClient(shmaps::Map<uint64_t, uint64_t> *shmap) : shmap_(shmap) {}
+
+        bool get(uint64_t k) override {
+            uint64_t v;
+            return shmap_->get(k, &v);
+        }
+
+        void set(uint64_t k, uint64_t v, int ttl) override {
+            shmap_->set(k, v, false, std::chrono::seconds(ttl));
+        }
+
+        void del(uint64_t k) override {
+            shmap_->del(k);
+        }
+
+    private:
+        shmaps::Map<uint64_t, uint64_t> *shmap_;
+    };
+
+public:
+    explicit ShMapBackend(uint64_t keys) : shmap_(new shmaps::Map<uint64_t, uint64_t>("ShMapWorkload", keys)) {}
+
+    void clear() override {
+        shmap_->clear();
+    }
+
+    std::unique_ptr<Client> client() override {
+        return std::make_unique<ShMapClient>(shmap_);
+    }
+
+private:
+    shmaps::Map<uint64_t, uint64_t> *shmap_;
+};
+
+// process private, runs with --procs=1 only; libcuckoo has no expiration, the ttl is ignored
+class LibCuckooBackend : public Backend {
+    typedef libcuckoo::cuckoohash_map<uint64_t, uint64_t> LibCuckooMap;
+
+    class LibCuckooClient : public Client {
+    public:
+        explicit LibCuckooClient(LibCuckooMap *map) : map_(map) {}
+
+        bool get(uint64_t k) override {
+            uint64_t v;
+            return map_->find(k, v);
+        }
+
+        void set(uint64_t k, uint64_t v, int) override {
+            map_->insert_or_assign(k, v);
+        }
+
+        void del(uint64_t k) override {
+            map_->erase(k);
+        }
+
+    private:
+        LibCuckooMap *map_;
+    };
+
+public:
+    explicit LibCuckooBackend(uint64_t keys) : map_(keys) {}
+
+    void clear() override {
+        map_.clear();
+    }
+
+    std::unique_ptr<Client> client() override {
+        return std::make_unique<LibCuckooClient>(&map_);
+    }
+
+private:
+    LibCuckooMap map_;
+};
+
+// a redis on 127.0.0.1:6379, one connection per thread
+class RedisBackend : public Backend {
+    class RedisClient : public Client {
+    public:
+        RedisClient() : c_(connect()) {}
+
+        ~RedisClient() override {
+            redisFree(c_);
+        }
+
+        bool get(uint64_t k) override {
+            return command("GET %lu", k) == REDIS_REPLY_STRING;
+        }
+
+        void set(uint64_t k, uint64_t v, int ttl) override {
+            if (ttl > 0) {
+                command("SET %lu %lu EX %d", k, v, ttl);
+            } else {
+                command("SET %lu %lu", k, v);
+            }
+        }
+
+        void del(uint64_t k) override {
+            command("DEL %lu", k);
+        }
+
+        template<typename... Args>
+        int command(const char *format, Args... args) {
+            redisReply *reply = static_cast<redisReply *>(redisCommand(c_, format, args...));
+            if (reply == NULL) {
+                std::cout << "workload: redis error " << c_->errstr << std::endl;
+                _exit(1);
+            }
+            const int type = reply->type;
+            freeReplyObject(reply);
+            return type;
+        }
+
+    private:
+        static redisContext *connect() {
+            redisContext *c = redisConnectWithTimeout("127.0.0.1", 6379, {5, 0});
+            if (c == NULL || c->err) {
+                std::cout << "workload: error initializing redis connection" << std::endl;
+                _exit(1);
+            }
+            return c;
+        }
+
+        redisContext *c_;
+    };
+
+public:
+    void clear() override {
+        RedisClient().command("FLUSHDB");
+    }
+
+    std::unique_ptr<Client> client() override {
+        return std::make_unique<RedisClient>();
+    }
+};
+
+static void usage() {
+    std::cout << "usage: workload [--backend=shmap|libcuckoo|redis] [--procs=N] [--threads=N] [--keys=N]" << std::endl
+              << "                [--dist=uniform|zipf|hot] [--theta=F] [--hot-keys=F] [--hot-ops=F]" << std::endl
+              << "                [--get=W] [--set=W] [--del=W] [--ttl=S] [--seconds=S] [--seed=N] [--json]" << std::endl;
+}
+
+static bool parse(int argc, char *argv[], Options *options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--json") {
+            options->json = true;
+            continue;
+        }
+        const size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            std::cout << "workload: bad argument " << arg << std::endl;
+            return false;
+        }
+        const std::string name = arg.substr(2, eq - 2);
+        const std::string value = arg.substr(eq + 1);
+        try {
+            if (name == "backend") {
+                options->backend = value;
+            } else if (name == "procs") {
+                options->procs = std::stoi(value);
+            } else if (name == "threads") {
+                options->threads = std::stoi(value);
+            } else if (name == "keys") {
+                options->keys = std::stoull(value);
+            } else if (name == "dist") {
+                options->dist = value;
+            } else if (name == "theta") {
+                options->theta = std::stod(value);
+            } else if (name == "hot-keys") {
+                options->hot_keys = std::stod(value);
+            } else if (name == "hot-ops") {
+                options->hot_ops = std::stod(value);
+            } else if (name == "get") {
+                options->mix[Get] = std::stoul(value);
+            } else if (name == "set") {
+                options->mix[Set] = std::stoul(value);
+            } else if (name == "del") {
+                options->mix[Del] = std::stoul(value);
+            } else if (name == "ttl") {
+                options->ttl = std::stoi(value);
+            } else if (name == "seconds") {
+                options->seconds = std::stod(value);
+            } else if (name == "seed") {
+                options->seed = std::stoull(value);
+            } else {
+                std::cout << "workload: unknown option " << name << std::endl;
+                return false;
+            }
+        } catch (const std::exception &) {
+            std::cout << "workload: bad value for " << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+    if (options->backend != "shmap" && options->backend != "libcuckoo" && options->backend != "redis") {
+        std::cout << "workload: unknown backend " << options->backend << std::endl;
+        return false;
+    }
+    if (options->dist != "uniform" && options->dist != "zipf" && options->dist != "hot") {
+        std::cout << "workload: unknown distribution " << options->dist << std::endl;
+        return false;
+    }
+    if (options->dist == "zipf" && (options->theta <= 0 || options->theta >= 1)) {
+        std::cout << "workload: theta must be in (0, 1)" << std::endl;
+        return false;
+    }
+    // written so a NaN fails too
+    if (!(options->hot_keys >= 0 && options->hot_keys <= 1 && options->hot_ops >= 0 && options->hot_ops <= 1)) {
+        std::cout << "workload: hot-keys and hot-ops must be in [0, 1]" << std::endl;
+        return false;
+    }
+    if (options->procs < 1 || options->threads < 1 || options->keys < 2 || options->seconds <= 0 ||
+        options->mix[Get] + options->mix[Set] + options->mix[Del] == 0) {
+        std::cout << "workload: procs, threads, seconds, an op weight and at least 2 keys are needed" << std::endl;
+        return false;
+    }
+    if (options->backend == "libcuckoo" && options->procs > 1) {
+        std::cout << "workload: libcuckoo maps are process private, running 1 process" << std::endl;
+        options->procs = 1;
+    }
+    return true;
+}
+
+static void run_thread(const Options &options, KeyGen keygen, Backend *backend, Control *control, int id,
+                       ThreadResult *result) {
+    std::mt19937_64 rnd(options.seed * 1000003 + id);
+    std::uniform_int_distribution<uint> op_dist(0, options.mix[Get] + options.mix[Set] + options.mix[Del] - 1);
+    auto client = backend->client();
+    ++control->ready;
+    while (!control->start) {
+        std::this_thread::yield();
+    }
+    for (uint64_t n = 0;; ++n) {
+        if (n % STOP_CHECK_OPS == 0 && control->stop) {
+            break;
+        }
+        const uint pick = op_dist(rnd);
+        const Op op = pick < options.mix[Get] ? Get : pick < options.mix[Get] + options.mix[Set] ? Set : Del;
+        const uint64_t k = keygen.next(rnd);
+        const auto start = std::chrono::steady_clock::now();
+        switch (op) {
+            case Get:
+                result->get_hits += client->get(k);
+                break;
+            case Set:
+                client->set(k, n, options.ttl);
+                break;
+            default:
+                client->del(k);
+        }
+        result->latencies[op].add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+static void report(const Options &options, const ThreadResult &total, double seconds) {
+    uint64_t ops = 0;
+    for (int op = 0; op < OpNum; ++op) {
+        ops += total.latencies[op].count();
+    }
+    const uint64_t gets = total.latencies[Get].count();
+    const double hit_ratio = gets ? static_cast<double>(total.get_hits) / gets : 0;
+    std::ostringstream out;
+    if (options.json) {
+        out << "{\"backend\": \"" << options.backend << "\", \"procs\": " << options.procs
+            << ", \"threads\": " << options.threads << ", \"keys\": " << options.keys
+            << ", \"dist\": \"" << options.dist << "\", \"theta\": " << options.theta
+            << ", \"hot_keys\": " << options.hot_keys << ", \"hot_ops\": " << options.hot_ops
+            << ", \"mix\": {\"get\": " << options.mix[Get] << ", \"set\": " << options.mix[Set]
+            << ", \"del\": " << options.mix[Del] << "}, \"ttl\": " << options.ttl
+            << ", \"seconds\": " << seconds << ", \"ops\": " << ops << ", \"ops_per_sec\": " << ops / seconds
+            << ", \"get_hit_ratio\": " << hit_ratio << ", \"latency_ns\": {";
+        for (int op = 0; op < OpNum; ++op) {
+            const Histogram &h = total.latencies[op];
+            out << (op ? ", " : "") << "\"" << op_names[op] << "\": {\"count\": " << h.count()
+                << ", \"p50\": " << h.percentile(0.5) << ", \"p99\": " << h.percentile(0.99)
+                << ", \"p999\": " << h.percentile(0.999) << ", \"max\": " << h.percentile(1) << "}";
+        }
+        out << "}}";
+    } else {
+        out << options.backend << ": " << options.procs << " procs x " << options.threads << " threads, "
+            << options.keys << " keys (" << options.dist << "), get/set/del " << options.mix[Get] << "/"
+            << options.mix[Set] << "/" << options.mix[Del] << ", ttl " << options.ttl << " s" << std::endl
+            << ops << " ops in " << seconds << " s, " << ops / seconds << " ops/s, get hit ratio " << hit_ratio;
+        for (int op = 0; op < OpNum; ++op) {
+            const Histogram &h = total.latencies[op];
+            out << std::endl << op_names[op] << ": " << h.count() << " ops, p50 " << h.percentile(0.5) << " ns, p99 "
+                << h.percentile(0.99) << " ns, p999 " << h.percentile(0.999) << " ns, max " << h.percentile(1)
+                << " ns";
+        }
+    }
+    std::cout << out.str() << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parse(argc, argv, &options)) {
+        usage();
+        return 1;
+    }
+    std::unique_ptr<Backend> backend;
+    if (options.backend == "shmap") {
+        backend = std::make_unique<ShMapBackend>(options.keys);
+    } else if (options.backend == "libcuckoo") {
+        backend = std::make_unique<LibCuckooBackend>(options.keys);
+    } else {
+        backend = std::make_unique<RedisBackend>();
+    }
+
+    // every key starts present, so the hit ratio shows what deletes and expiration took away
+    backend->clear();
+    {
+        auto client = backend->client();
+        for (uint64_t k = 0; k < options.keys; ++k) {
+            client->set(k, k, options.ttl);
+        }
+    }
+    const KeyGen keygen(options);
+
+    const int num_thr = options.procs * options.threads;
+    const size_t shared_size = sizeof(Control) + num_thr * sizeof(ThreadResult);
+    void *shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        std::cout << "workload: mmap failed: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    memset(shared, 0, shared_size);
+    Control *control = new(shared) Control();
+    ThreadResult *results = reinterpret_cast<ThreadResult *>(static_cast<char *>(shared) + sizeof(Control));
+
+    auto run_proc = [&](int proc) {
+        std::vector<std::thread> threads;
+        for (int thr = 0; thr < options.threads; ++thr) {
+            const int id = proc * options.threads + thr;
+            threads.emplace_back(run_thread, std::cref(options), keygen, backend.get(), control, id, &results[id]);
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    };
+    // libcuckoo's map lives in this process, its workers are threads of it
+    const bool fork_procs = options.backend != "libcuckoo";
+    std::thread local;
+    std::vector<pid_t> pids;
+    for (int proc = 0; proc < options.procs; ++proc) {
+        if (!fork_procs) {
+            local = std::thread(run_proc, proc);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cout << "workload: fork failed: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        if (pid == 0) {
+            run_proc(proc);
+            _exit(0);
+        }
+        pids.push_back(pid);
+    }
+
+    // a worker process exits during setup only if it failed (e.g. no redis to connect to), the run is given up then
+    const auto setup_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SETUP_TIMEOUT_S);
+    bool setup_failed = false;
+    bool timed_out = false;
+    while (control->ready < num_thr && !setup_failed) {
+        for (pid_t &pid: pids) {
+            int status;
+            if (pid != 0 && waitpid(pid, &status, WNOHANG) == pid) {
+                std::cout << "workload: worker process " << pid << " exited during setup" << std::endl;
+                pid = 0;
+                setup_failed = true;
+            }
+        }
+        if (!setup_failed && std::chrono::steady_clock::now() > setup_deadline) {
+            std::cout << "workload: workers not ready after " << SETUP_TIMEOUT_S << " s" << std::endl;
+            setup_failed = timed_out = true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (setup_failed) {
+        // the workers go through start and stop right away once ready, those stuck in setup are killed
+        control->stop = true;
+        control->start = true;
+        for (pid_t pid: pids) {
+            if (pid != 0 && timed_out) {
+                kill(pid, SIGKILL);
+            }
+        }
+        if (local.joinable()) {
+            local.join();
+        }
+        while (wait(NULL) > 0);
+        munmap(shared, shared_size);
+        return 1;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    control->start = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+    control->stop = true;
+    if (local.joinable()) {
+        local.join();
+    }
+    while (wait(NULL) > 0);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    ThreadResult *total = new ThreadResult();
+    for (int id = 0; id < num_thr; ++id) {
+        for (int op = 0; op < OpNum; ++op) {
+            total->latencies[op].merge(results[id].latencies[op]);
+        }
+        total->get_hits += results[id].get_hits;
+    }
+    report(options, *total, seconds);
+    delete total;
+    munmap(shared, shared_size);
+    return 0;
+}
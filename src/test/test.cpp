@@ -2,6 +2,8 @@
 
 #include <sys/wait.h>
 
+#include <array>
+#include <atomic>
 #include <random>
 #include <string>
 #include <thread>
@@ -41,6 +43,19 @@ public:
     shmaps::String s2;
 };
 
+// ints equal up to their sign, which operator< doesn't know about
+struct AbsHash {
+    std::size_t operator()(int v) const {
+        return std::abs(v);
+    }
+};
+
+struct AbsPred {
+    bool operator()(int a, int b) const {
+        return std::abs(a) == std::abs(b);
+    }
+};
+
 static shmaps::Map<shmaps::String, int> *shmap_string_int_static =
         new shmaps::Map<shmaps::String, int>("ShMap_Static_String_Int");
 
@@ -58,6 +73,11 @@ int main(int argc, char *argv[]) {
 
     const int el_expires = 2;
     bool res = false;
+
+    // a larger size than the static map's one fits in the reserved segment, so no restart is needed
+    res = shmaps::init(2UL * SHMAPS_SEG_SIZE) >= 2UL * SHMAPS_SEG_SIZE;
+    assert(res);
+
     int k = 100;
     int val;
     FooStatsExt fse;
@@ -75,6 +95,34 @@ int main(int argc, char *argv[]) {
     assert(res);
     res = shmap_string_int->get(sk, &val);
     assert(res && val == k);
+    // heterogeneous lookups, no segment allocation for the key
+    const std::string plain_sk(sk.c_str());
+    res = shmap_string_int->get(std::string_view(plain_sk), &val);
+    assert(res && val == k);
+    res = shmap_string_int->exists(plain_sk.c_str());
+    assert(res);
+    res = shmap_string_int->exists("no such key");
+    assert(!res);
+
+    // inline keys: no allocator needed, probed with plain strings too
+    shmaps::Map<shmaps::FixedString<32>, int> *shmap_fixedstring_int =
+            new shmaps::Map<shmaps::FixedString<32>, int>("ShMap_FixedString_Int");
+    const shmaps::FixedString<32> fsk(std::to_string(k));
+    res = shmap_fixedstring_int->set(fsk, k, false, std::chrono::seconds(el_expires));
+    assert(res);
+    res = shmap_fixedstring_int->get(fsk, &val);
+    assert(res && val == k);
+    res = shmap_fixedstring_int->get(std::string_view(std::to_string(k)), &val);
+    assert(res && val == k);
+    res = shmap_fixedstring_int->exists("no such key");
+    assert(!res);
+    res = false;
+    try {
+        shmaps::FixedString<32> too_long(long_str);
+    } catch (const std::length_error &) {
+        res = true;
+    }
+    assert(res);
 
     shmaps::Map<int, FooStats> *shmap_int_foostats = new shmaps::Map<int, FooStats>("ShMap_Int_FooStats");
     res = shmap_int_foostats->set(k, FooStats(k, 2, 3.0), false, std::chrono::seconds(el_expires));
@@ -82,6 +130,13 @@ int main(int argc, char *argv[]) {
     FooStats fs;
     res = shmap_int_foostats->get(k, &fs);
     assert(res && fs.k == k);
+    float rev = shmap_int_foostats->exec(k, [](FooStats &v) { return v.rev += 1.0; });
+    assert(rev >= 4.0);
+    rev = shmap_int_foostats->exec(-k, [](FooStats &v) { v.k = -100; return v.rev = 1.0; },
+                                   std::chrono::seconds(el_expires));
+    assert(rev == 1.0);
+    res = shmap_int_foostats->get(-k, &fs);
+    assert(res && fs.k == -100);
 
     shmaps::Map<shmaps::String, FooStatsExt> *shmap_string_foostats_ext =
             new shmaps::Map<shmaps::String, FooStatsExt>("ShMap_String_FooStatsExt");
@@ -92,6 +147,14 @@ int main(int argc, char *argv[]) {
     assert(res);
     res = shmap_string_foostats_ext->get(sk, &fse);
     assert(res && (fse.i1 == k) && (fse.s1 == sk) && (fse.s2 == sk));
+    res = shmap_string_foostats_ext->with_value(plain_sk, [&](const FooStatsExt &v) {
+        assert(v.i1 == k && shmaps::as_view(v.s1) == plain_sk && shmaps::as_view(v.s2) == plain_sk);
+    });
+    assert(res);
+    res = shmap_string_foostats_ext->with_value("no such key", [&](const FooStatsExt &v) {
+        assert(false);
+    });
+    assert(!res);
 
     shmaps::MapSet<shmaps::String, int> *shmap_string_set_int =
             new shmaps::MapSet<shmaps::String, int>("ShMap_String_SetInt");
@@ -103,6 +166,11 @@ int main(int argc, char *argv[]) {
     std::set<int> si;
     res = shmap_string_set_int->members(sk, &si);
     assert(res && si == res_check1);
+    res = shmap_string_set_int->is_member(std::string_view(plain_sk), k);
+    assert(res);
+    si.clear();
+    res = shmap_string_set_int->members(plain_sk, &si);
+    assert(res && si == res_check1);
 
     shmaps::MapSet<shmaps::String, shmaps::String> *shmap_string_set_string =
             new shmaps::MapSet<shmaps::String, shmaps::String>("ShMap_String_SetString");
@@ -114,15 +182,632 @@ int main(int argc, char *argv[]) {
     res = shmap_string_set_string->members(sk, &ss);
     assert(res && ss == res_check2);
 
+    // sets go from inline to sorted to hashed members as they grow, and back as members are erased
+    shmaps::MapSet<int, int> *shmap_set_sizes = new shmaps::MapSet<int, int>("ShMap_SetSizes");
+    for (int i = 0; i < 1000; ++i) {
+        res = shmap_set_sizes->add(num_wrk, i * 7);
+        assert(res);
+        res = shmap_set_sizes->is_member(num_wrk, i * 7) && !shmap_set_sizes->is_member(num_wrk, i * 7 + 1);
+        assert(res);
+    }
+    si.clear();
+    res = shmap_set_sizes->members(num_wrk, &si);
+    assert(res && si.size() == 1000 && *si.rbegin() == 999 * 7);
+    shmaps::CompactSet<shmaps::String> compact(*shmaps::seg_alloc);
+    for (int i = 0; i < 1000; ++i) {
+        res = compact.insert(shmaps::String(std::to_string(i).append(long_str).c_str(), *shmaps::seg_alloc));
+        assert(res);
+    }
+    for (int i = 999; i >= 0; --i) {
+        const shmaps::String member(std::to_string(i).append(long_str).c_str(), *shmaps::seg_alloc);
+        res = compact.erase(member) && !compact.contains(member) && compact.size() == uint(i);
+        assert(res);
+        res = i == 0 || compact.contains(shmaps::String(std::to_string(i / 2).append(long_str).c_str(),
+                                                        *shmaps::seg_alloc));
+        assert(res);
+    }
+    // every representation goes by Hash and Pred
+    shmaps::CompactSet<int, AbsHash, AbsPred> compact_abs(*shmaps::seg_alloc);
+    for (int i = 1; i <= 1000; ++i) {
+        res = compact_abs.insert(i % 2 ? i : -i) && !compact_abs.insert(i % 2 ? -i : i);
+        assert(res);
+        res = compact_abs.contains(i / 2 + 1) && compact_abs.contains(-(i / 2 + 1)) && !compact_abs.contains(i + 1);
+        assert(res);
+    }
+
+    // set algebra on the sets in the segment: a = {0..299}, b = {200..599} (hashed and sorted sets), per worker keys
+    shmaps::MapSet<int, int> *shmap_set_ops = new shmaps::MapSet<int, int>("ShMap_SetOps");
+    const int set_a = num_wrk * 10, set_b = set_a + 1, set_dst = set_a + 2, set_none = set_a + 3;
+    for (int i = 0; i < 300; ++i) {
+        shmap_set_ops->add(set_a, i);
+    }
+    for (int i = 200; i < 600; ++i) {
+        shmap_set_ops->add(set_b, i);
+    }
+    si.clear();
+    res = shmap_set_ops->intersect(set_a, set_b, &si);
+    assert(res && si.size() == 100 && *si.begin() == 200 && *si.rbegin() == 299);
+    // the results replace what *res held
+    res = shmap_set_ops->diff(set_a, set_b, &si);
+    assert(res && si.size() == 200 && *si.rbegin() == 199);
+    res = shmap_set_ops->intersect(set_b, set_b, &si);
+    assert(res && si.size() == 400 && *si.begin() == 200);
+    res = shmap_set_ops->intersect(set_a, set_b, set_dst) && shmap_set_ops->card(set_dst) == 100;
+    assert(res);
+    res = shmap_set_ops->union_into(set_dst, set_a) && shmap_set_ops->card(set_dst) == 300;
+    assert(res);
+    res = shmap_set_ops->diff(set_dst, set_b, set_dst) && shmap_set_ops->card(set_dst) == 200;
+    assert(res);
+    res = shmap_set_ops->card(set_a) == 300 && shmap_set_ops->card(set_b) == 400;
+    assert(res);
+    // an empty result removes the destination, a missing key is an empty set
+    res = shmap_set_ops->intersect(set_a, set_none, set_dst) && shmap_set_ops->card(set_dst) == 0;
+    assert(res);
+    res = shmap_set_ops->members(set_dst, &si);
+    assert(!res);
+    res = shmap_set_ops->union_into(set_dst, set_b) && shmap_set_ops->card(set_dst) == 400;
+    assert(res);
+    res = shmap_set_ops->remove(set_dst, 200) && !shmap_set_ops->remove(set_dst, 200) &&
+          !shmap_set_ops->is_member(set_dst, 200) && shmap_set_ops->card(set_dst) == 399;
+    assert(res);
+    std::set<int> popped;
+    for (val = 0; shmap_set_ops->pop_random(set_dst, &val);) {
+        res = popped.insert(val).second && val > 200 && val < 600;
+        assert(res);
+    }
+    assert(popped.size() == 399 && shmap_set_ops->card(set_dst) == 0);
+
+    // batch operations
+    shmaps::Map<shmaps::String, int> *shmap_batch = new shmaps::Map<shmaps::String, int>("ShMap_Batch");
+    std::vector<std::pair<shmaps::String, int>> batch_items;
+    std::vector<std::string> batch_keys;
+    for (int i = 0; i < 100; ++i) {
+        // per-worker keys, so workers don't delete each other's
+        batch_keys.push_back(std::to_string(num_wrk).append("_").append(std::to_string(i)).append(long_str));
+        batch_items.emplace_back(shmaps::String(batch_keys.back().c_str(), *shmaps::seg_alloc), i);
+    }
+    res = shmap_batch->mset(batch_items, false, std::chrono::seconds(el_expires)) == batch_items.size();
+    assert(res);
+    batch_keys.push_back("no such key");
+    std::vector<std::optional<int>> batch_vals;
+    res = shmap_batch->mget(batch_keys, &batch_vals) == batch_items.size();
+    assert(res);
+    for (std::size_t i = 0; i < batch_items.size(); ++i) {
+        assert(batch_vals[i] && *batch_vals[i] == batch_items[i].second);
+    }
+    assert(!batch_vals.back());
+    const uint64_t dels_before = shmap_batch->stats->snapshot().del;
+    res = shmap_batch->mdel(std::vector<std::string_view>(batch_keys.begin(), batch_keys.begin() + 50)) == 50;
+    assert(res && shmap_batch->stats->snapshot().del - dels_before >= 50);
+    res = shmap_batch->exists(batch_keys[0]);
+    assert(!res);
+    res = shmap_batch->exists(batch_keys[50]);
+    assert(res);
+    // a flat map's batches prefetch the keys ahead
+    shmaps::Map<int, int> *shmap_batch_flat = new shmaps::Map<int, int>("ShMap_BatchFlat");
+    std::vector<std::pair<int, int>> flat_items;
+    std::vector<int> flat_keys;
+    for (int i = 0; i < 100; ++i) {
+        flat_items.emplace_back(int(num_wrk) * 1000 + i, i);
+        flat_keys.push_back(flat_items.back().first);
+    }
+    res = shmap_batch_flat->mset(flat_items, false) == flat_items.size();
+    assert(res);
+    std::vector<std::optional<int>> flat_vals;
+    res = shmap_batch_flat->mget(flat_keys, &flat_vals) == flat_items.size();
+    assert(res && *flat_vals[0] == 0 && *flat_vals[99] == 99);
+    res = shmap_batch_flat->mdel(flat_keys) == flat_items.size() && !shmap_batch_flat->exists(flat_keys[50]);
+    assert(res);
+    // flat table reads go without the lock: they never see a payload half rewritten
+    if (num_wrk == 0) {
+        typedef std::array<uint64_t, 2> Pair;
+        shmaps::Map<int, Pair> *shmap_torn = new shmaps::Map<int, Pair>("ShMap_Torn");
+        shmap_torn->set(0, {0, ~uint64_t(0)}, false);
+        std::atomic<bool> torn_stop{false};
+        std::thread torn_writer([&] {
+            for (uint64_t i = 1; !torn_stop; ++i) {
+                shmap_torn->set(0, {i, ~i}, false);
+            }
+        });
+        Pair torn_val{};
+        for (int i = 0; i < 50000; ++i) {
+            res = shmap_torn->get(0, &torn_val) && torn_val[1] == ~torn_val[0];
+            assert(res);
+        }
+        torn_stop = true;
+        torn_writer.join();
+    }
+    // payloads with an allocator have no default constructor
+    shmaps::Map<int, shmaps::String> *shmap_batch_str = new shmaps::Map<int, shmaps::String>("ShMap_BatchStr");
+    shmap_batch_str->set(num_wrk, shmaps::String(long_str.c_str(), *shmaps::seg_alloc), false);
+    std::vector<std::optional<shmaps::String>> batch_strs;
+    res = shmap_batch_str->mget(std::vector<int>{static_cast<int>(num_wrk), -1}, &batch_strs) == 1;
+    assert(res && batch_strs[0] && batch_strs[0]->c_str() == long_str && !batch_strs[1]);
+    std::vector<std::pair<shmaps::String, int>> batch_members;
+    for (int i = 0; i < 10; ++i) {
+        batch_members.emplace_back(batch_items[i % 2].first, i);
+    }
+    res = shmap_string_set_int->madd(batch_members) == batch_members.size();
+    assert(res);
+    res = shmap_string_set_int->is_member(batch_items[1].first, 9);
+    assert(res);
+
+    // crash recovery: a process killed inside exec() must not leave keys locked forever
+    if (num_wrk == 0) {
+        shmaps::Map<shmaps::String, int> *shmap_crash = new shmaps::Map<shmaps::String, int>("ShMap_Crash");
+        // keys are per run, the shard a process died in stays damaged until repair()
+        const std::string crash_k = "crash_" + std::to_string(getpid());
+        const std::string fresh_k = "fresh_" + std::to_string(getpid());
+        std::vector<std::string> alive_ks;
+        for (int i = 0; i < 16; ++i) {
+            alive_ks.push_back("alive_" + std::to_string(getpid()) + "_" + std::to_string(i));
+            res = shmap_crash->set(shmaps::String(alive_ks.back().c_str(), *shmaps::seg_alloc), i, false);
+            assert(res);
+        }
+        res = shmap_crash->set(shmaps::String(crash_k.c_str(), *shmaps::seg_alloc), 1, false);
+        assert(res);
+        // killed in fn on a new key's payload (outside the table) and on a live one (inside), in turn
+        for (const std::string &k: {fresh_k, crash_k}) {
+            int crash_pipe[2];
+            res = pipe(crash_pipe) == 0;
+            assert(res);
+            pid_t crash_pid = fork();
+            if (crash_pid == 0) {
+                shmap_crash->exec(shmaps::String(k.c_str(), *shmaps::seg_alloc), [&](int &v) {
+                    v = 1;
+                    res = write(crash_pipe[1], "x", 1) == 1;
+                    pause();
+                });
+                _exit(1);
+            }
+            char c;
+            res = read(crash_pipe[0], &c, 1) == 1;
+            assert(res);
+            kill(crash_pid, SIGKILL);
+            waitpid(crash_pid, nullptr, 0);
+            close(crash_pipe[0]);
+            close(crash_pipe[1]);
+        }
+        // the dead process' stripe is taken over, its new key wasn't in the table yet
+        res = !shmap_crash->quarantined(shmaps::String(fresh_k.c_str(), *shmaps::seg_alloc));
+        assert(res);
+        // a reader notices the dead writer in the table instead of waiting for its bucket locks
+        res = shmap_crash->get(crash_k, &val);
+        assert(!res);
+        res = shmap_crash->quarantined(shmaps::String(crash_k.c_str(), *shmaps::seg_alloc));
+        assert(res);
+        res = shmap_crash->set(shmaps::String(crash_k.c_str(), *shmaps::seg_alloc), 2, false);
+        assert(!res);
+        uint alive = 0;
+        for (const std::string &k: alive_ks) {
+            if (!shmap_crash->quarantined(shmaps::String(k.c_str(), *shmaps::seg_alloc))) {
+                res = shmap_crash->set(shmaps::String(k.c_str(), *shmaps::seg_alloc), 3, false);
+                assert(res);
+                res = shmap_crash->get(k, &val);
+                assert(res && val == 3);
+                ++alive;
+            }
+        }
+        assert(alive > 0);
+        // a reader killed in its callback is quarantined too, until repair()
+        // the damaged shard takes no new keys, the reader's key goes to another one
+        std::string read_k;
+        res = false;
+        for (int i = 0; i < 64 && !res; ++i) {
+            read_k = "read_" + std::to_string(getpid()) + "_" + std::to_string(i);
+            res = shmap_crash->set(shmaps::String(read_k.c_str(), *shmaps::seg_alloc), 5, false);
+        }
+        assert(res);
+        int read_pipe[2];
+        res = pipe(read_pipe) == 0;
+        assert(res);
+        pid_t read_pid = fork();
+        if (read_pid == 0) {
+            shmap_crash->with_value(shmaps::String(read_k.c_str(), *shmaps::seg_alloc), [&](const int &) {
+                res = write(read_pipe[1], "x", 1) == 1;
+                pause();
+            });
+            _exit(1);
+        }
+        char read_c;
+        res = read(read_pipe[0], &read_c, 1) == 1;
+        assert(res);
+        kill(read_pid, SIGKILL);
+        waitpid(read_pid, nullptr, 0);
+        close(read_pipe[0]);
+        close(read_pipe[1]);
+        res = shmap_crash->quarantined(shmaps::String(read_k.c_str(), *shmaps::seg_alloc));
+        assert(res);
+        res = shmap_crash->repair();
+        assert(res);
+        // libcuckoo shards can't be freed, their bucket arrays are counted
+        res = shmap_crash->leaked() > 0;
+        assert(res);
+        res = !shmap_crash->quarantined(shmaps::String(read_k.c_str(), *shmaps::seg_alloc));
+        assert(res);
+        res = !shmap_crash->quarantined(shmaps::String(crash_k.c_str(), *shmaps::seg_alloc));
+        assert(res);
+        res = shmap_crash->set(shmaps::String(crash_k.c_str(), *shmaps::seg_alloc), 4, false);
+        assert(res);
+        res = shmap_crash->get(crash_k, &val);
+        assert(res && val == 4);
+    }
+
+    // snapshot while the workers keep going, then a warm restart from it in a process which lost the segment
+    if (num_wrk == 0) {
+        shmaps::Map<int, int> *shmap_snap = new shmaps::Map<int, int>("ShMap_Snapshot");
+        for (int i = 0; i < 1000; ++i) {
+            res = shmap_snap->set(i, i, false);
+            assert(res);
+        }
+        const std::string snap_path = "/tmp/shmaps_test_" + std::to_string(getpid()) + ".snapshot";
+        res = shmaps::snapshot(snap_path);
+        assert(res);
+        // restored into a file of its own, the other workers go on with the default segment
+        shmaps::SegmentOptions restore_opts;
+        restore_opts.file = "/tmp/shmaps_test_" + std::to_string(getpid()) + ".restored";
+        pid_t snap_pid = fork();
+        if (snap_pid == 0) {
+            shmaps::detach();
+            res = shmaps::restore(snap_path, restore_opts);
+            assert(res);
+            shmap_snap = new shmaps::Map<int, int>("ShMap_Snapshot");
+            assert(shmap_snap->size() == 1000);
+            res = shmap_snap->get(999, &val);
+            assert(res && val == 999);
+            // the segment exists now
+            shmaps::detach();
+            res = !shmaps::restore(snap_path, restore_opts);
+            assert(res);
+            _exit(0);
+        }
+        int snap_status;
+        waitpid(snap_pid, &snap_status, 0);
+        assert(WIFEXITED(snap_status) && WEXITSTATUS(snap_status) == 0);
+        unlink(snap_path.c_str());
+        unlink(restore_opts.file.c_str());
+
+        // file backed segment: what's synced is there for the next process attaching to the file
+        shmaps::SegmentOptions file_opts;
+        file_opts.file = "/tmp/shmaps_test_" + std::to_string(getpid()) + ".segment";
+        pid_t file_pid = fork();
+        if (file_pid == 0) {
+            shmaps::detach();
+            assert(!shmaps::ticker_running_);
+            shmaps::init(SHMAPS_SEG_SIZE, file_opts);
+            shmaps::Map<int, int> *shmap_file = new shmaps::Map<int, int>("ShMap_File");
+            for (int i = 0; i < 1000; ++i) {
+                res = shmap_file->set(i, i, false);
+                assert(res);
+            }
+            res = shmap_file->set(1000, 1000, false, std::chrono::seconds(60));
+            assert(res);
+            // as if the file is attached after a reboot: the clock is rebased, the entry doesn't expire
+            shmaps::stop_ticker();
+            shmaps::coarse_clock_.load()->boot = 1;
+            res = shmaps::sync();
+            assert(res);
+            _exit(0);
+        }
+        waitpid(file_pid, &snap_status, 0);
+        assert(WIFEXITED(snap_status) && WEXITSTATUS(snap_status) == 0);
+        file_pid = fork();
+        if (file_pid == 0) {
+            shmaps::detach();
+            shmaps::init(SHMAPS_SEG_SIZE, file_opts);
+            shmaps::Map<int, int> *shmap_file = new shmaps::Map<int, int>("ShMap_File");
+            assert(shmap_file->size() == 1001);
+            res = shmap_file->get(999, &val);
+            assert(res && val == 999);
+            assert(shmaps::coarse_clock_.load()->boot == shmaps::CoarseClock::boot_id());
+            res = shmap_file->get(1000, &val);
+            assert(res && val == 1000);
+            // removes the file
+            shmaps::reset();
+            res = access(file_opts.file.c_str(), F_OK) != 0;
+            assert(res);
+            _exit(0);
+        }
+        waitpid(file_pid, &snap_status, 0);
+        assert(WIFEXITED(snap_status) && WEXITSTATUS(snap_status) == 0);
+
+        // change log: what logged maps did is replayed into a segment which never saw it
+        const std::string log_path = "/tmp/shmaps_test_" + std::to_string(getpid()) + ".log";
+        res = shmaps::open_log(log_path);
+        assert(res);
+        shmaps::Map<shmaps::String, int> *shmap_log = new shmaps::Map<shmaps::String, int>("ShMap_Log");
+        shmaps::MapSet<int, int> *shmap_log_set = new shmaps::MapSet<int, int>("ShMap_LogSet");
+        res = shmap_log->set_durability(shmaps::Durability::Sync);
+        assert(res);
+        res = shmap_log_set->set_durability(shmaps::Durability::Async);
+        assert(res);
+        for (int i = 0; i < 100; ++i) {
+            res = shmap_log->set(shmaps::String(std::to_string(i).data(), *shmaps::seg_alloc), i, false);
+            assert(res);
+        }
+        res = shmap_log->del(shmaps::String("0", *shmaps::seg_alloc));
+        assert(res);
+        res = shmap_log->set(shmaps::String("1", *shmaps::seg_alloc), 100, false);
+        assert(res);
+        shmap_log_set->add(1, 1);
+        shmap_log_set->add(1, 2);
+        shmap_log_set->add(1, 3);
+        res = shmap_log_set->remove(1, 3) && shmap_log_set->union_into(2, 1);
+        assert(res);
+        // an appender dying before it published its record: the writer gives up on it and goes on
+        pid_t dead_pid = fork();
+        if (dead_pid == 0) {
+            shmaps::ChangeLog *log = shmaps::change_log();
+            const uint64_t pos = log->head.fetch_add(64);
+            __atomic_store_n(reinterpret_cast<uint64_t *>(log->ring + pos % LOG_RING_SIZE),
+                             shmaps::LogRecord::RESERVED | (uint64_t(getpid()) << shmaps::LogRecord::OWNER_SHIFT) | 64,
+                             __ATOMIC_RELEASE);
+            _exit(0);
+        }
+        waitpid(dead_pid, &snap_status, 0);
+        // a Sync map's set returns once its record, behind the dead one, is fsynced
+        res = shmap_log->set(shmaps::String("after", *shmaps::seg_alloc), 1, false);
+        assert(res);
+        shmaps::close_log();
+        pid_t log_pid = fork();
+        if (log_pid == 0) {
+            shmaps::SegmentOptions log_opts;
+            log_opts.file = log_path + ".segment";
+            shmaps::detach();
+            shmaps::init(SHMAPS_SEG_SIZE, log_opts);
+            shmap_log = new shmaps::Map<shmaps::String, int>("ShMap_Log");
+            shmap_log_set = new shmaps::MapSet<int, int>("ShMap_LogSet");
+            res = shmap_log->replay(log_path) == 103 && shmap_log_set->replay(log_path) == 5;
+            assert(res);
+            assert(shmap_log->size() == 100);
+            res = shmap_log->get(shmaps::String("1", *shmaps::seg_alloc), &val);
+            assert(res && val == 100);
+            res = !shmap_log->exists(shmaps::String("0", *shmaps::seg_alloc));
+            assert(res);
+            std::set<int> log_members;
+            res = shmap_log_set->members(1, &log_members);
+            assert(res && log_members == std::set<int>({1, 2}));
+            log_members.clear();
+            res = shmap_log_set->members(2, &log_members);
+            assert(res && log_members == std::set<int>({1, 2}));
+            shmaps::reset();
+            _exit(0);
+        }
+        waitpid(log_pid, &snap_status, 0);
+        assert(WIFEXITED(snap_status) && WEXITSTATUS(snap_status) == 0);
+        unlink(log_path.c_str());
+
+        // named segment: maps of their own, sized on their own, seen by every process opening the segment
+        const std::string seg_name = "SharedMemorySegmentTest_" + std::to_string(getpid());
+        shmaps::Segment *segment = new shmaps::Segment(seg_name, 32 * 1024 * 1024);
+        assert(segment->size() == 32 * 1024 * 1024);
+        shmaps::Map<shmaps::String, int> *shmap_seg = new shmaps::Map<shmaps::String, int>(*segment, "ShMap_Segment");
+        shmaps::MapSet<int, int> *shmap_seg_set = new shmaps::MapSet<int, int>(*segment, "ShMap_SegmentSet");
+        const uint64_t seg_free = segment->free_memory();
+        for (int i = 0; i < 1000; ++i) {
+            res = shmap_seg->set(shmaps::String(std::to_string(i).append(100, 'a').data(), segment->alloc()), i, false);
+            assert(res);
+        }
+        shmap_seg_set->add(1, 1, std::chrono::seconds(60));
+        assert(segment->free_memory() < seg_free);
+        res = shmaps::map_directory()->find("ShMap_Segment") == nullptr;
+        assert(res);
+        pid_t seg_pid = fork();
+        if (seg_pid == 0) {
+            shmaps::Segment *child_segment = new shmaps::Segment(seg_name, 32 * 1024 * 1024);
+            shmap_seg = new shmaps::Map<shmaps::String, int>(*child_segment, "ShMap_Segment");
+            shmap_seg_set = new shmaps::MapSet<int, int>(*child_segment, "ShMap_SegmentSet");
+            assert(shmap_seg->size() == 1000);
+            res = shmap_seg->get(shmaps::String(std::string("999").append(100, 'a').data(), child_segment->alloc()),
+                                 &val);
+            assert(res && val == 999);
+            res = shmap_seg_set->is_member(1, 1);
+            assert(res);
+            res = shmap_seg->set(shmaps::String("child", child_segment->alloc()), 1, false);
+            assert(res);
+            _exit(0);
+        }
+        waitpid(seg_pid, &snap_status, 0);
+        assert(WIFEXITED(snap_status) && WEXITSTATUS(snap_status) == 0);
+        assert(shmap_seg->size() == 1001);
+        // a flat table spreads keys sharing their low bits, and running out of memory in a resize leaves no lock held
+        shmaps::Map<uint64_t, uint64_t> *shmap_seg_flat =
+                new shmaps::Map<uint64_t, uint64_t>(*segment, "ShMap_SegmentFlat", 1000);
+        const uint64_t flat_free = segment->free_memory();
+        uint64_t flat_key = 0;
+        for (; flat_key < 20000; ++flat_key) {
+            res = shmap_seg_flat->set(flat_key << 32, flat_key, false);
+            assert(res);
+        }
+        assert(flat_free - segment->free_memory() < 4 * 1024 * 1024);
+        try {
+            for (;; ++flat_key) {
+                shmap_seg_flat->set(flat_key << 32, flat_key, false);
+            }
+        } catch (const boost::interprocess::bad_alloc &) {
+        }
+        uint64_t flat_val = 0;
+        res = shmap_seg_flat->get(flat_key << 32, &flat_val);
+        assert(!res);
+        res = shmap_seg_flat->get(uint64_t(1) << 32, &flat_val);
+        assert(res && flat_val == 1);
+        // a set which can't grow keeps its members
+        shmaps::CompactSet<int> compact_full(segment->alloc());
+        int full_n = 0;
+        try {
+            for (;; ++full_n) {
+                compact_full.insert(full_n);
+            }
+        } catch (const boost::interprocess::bad_alloc &) {
+        }
+        res = compact_full.size() == uint(full_n) && compact_full.contains(0) && compact_full.contains(full_n - 1);
+        assert(res);
+        compact_full.clear();
+        // a shrunk hash set moved into another segment comes out sorted by hash
+        shmaps::CompactSet<int> compact_hashed(*shmaps::seg_alloc);
+        for (int i = 0; i < 300; ++i) {
+            compact_hashed.insert(i);
+        }
+        for (int i = 0; i < 100; ++i) {
+            compact_hashed.erase(i * 3);
+        }
+        shmaps::CompactSet<int> compact_moved(segment->alloc());
+        compact_moved = std::move(compact_hashed);
+        res = compact_moved.size() == 200 && compact_hashed.empty();
+        assert(res);
+        for (int i = 0; i < 300; ++i) {
+            res = compact_moved.contains(i) == (i % 3 != 0);
+            assert(res);
+        }
+        compact_moved.clear();
+        delete shmap_seg_flat;
+        segment->remove();
+        delete shmap_seg;
+        delete shmap_seg_set;
+        delete segment;
+#ifdef __linux__
+        // a segment beyond what its backing can hold: only what the backing has room for is free
+        struct statvfs shm_fs{};
+        if (statvfs("/dev/shm", &shm_fs) == 0) {
+            const uint64_t shm_room = static_cast<uint64_t>(shm_fs.f_bavail) * shm_fs.f_frsize;
+            shmaps::Segment *big_segment = new shmaps::Segment(seg_name + "_big", 2 * shm_room);
+            assert(big_segment->size() == 2 * shm_room);
+            assert(big_segment->free_memory() <= shm_room + 2 * SEGMENT_EXTENT);
+            big_segment->remove();
+            delete big_segment;
+        }
+#endif
+    }
+
     // expiration test
-    shmaps::Map<shmaps::String, int> *shmaps_exp = new shmaps::Map<shmaps::String, int>("ShMap_Expiration");
+    shmaps::Map<shmaps::String, int> *shmaps_exp =
+            new shmaps::Map<shmaps::String, int>("ShMap_Expiration_" + std::to_string(num_wrk));
     res = shmaps_exp->set(sk, 166, false, std::chrono::seconds(2));
     assert(res);
     res = shmaps_exp->get(sk, &val);
     assert(res && val == 166);
-    std::this_thread::sleep_for(std::chrono::milliseconds(2000));
+    // expiration is as precise as the coarse clock
+    std::this_thread::sleep_for(std::chrono::milliseconds(2000 + 2 * 1000 / COARSE_TICKS_PER_SEC));
     res = shmaps_exp->get(sk, &val);
     assert(!res);
+    // expiration metadata is a single 32-bit word
+    assert(sizeof(shmaps::MappedValType<int>) == 2 * sizeof(int));
+
+    // expiration sweeper: keys are reclaimed without any further writes to the map
+    shmaps::Map<int, int> *shmap_sweep = new shmaps::Map<int, int>("ShMap_Sweep_" + std::to_string(num_wrk));
+    shmap_sweep->start_sweeper(1000, std::chrono::milliseconds(50));
+    for (int i = 0; i < 100; ++i) {
+        res = shmap_sweep->set(i, i, false, std::chrono::seconds(1));
+        assert(res);
+    }
+    assert(shmap_sweep->size() == 100);
+    std::this_thread::sleep_for(std::chrono::milliseconds(3000));
+    assert(shmap_sweep->size() == 0);
+    shmap_sweep->stop_sweeper();
+    res = shmap_sweep->stats->snapshot().sweep_hit >= 100;
+    assert(res);
+
+    // bounded map: inserts evict cold entries, a key read between inserts stays
+    shmaps::Map<int, int> *shmap_evict = new shmaps::Map<int, int>("ShMap_Evict_" + std::to_string(num_wrk));
+    shmap_evict->set_limits(100);
+    for (int i = 0; i < 1000; ++i) {
+        res = shmap_evict->set(i, i, false);
+        assert(res);
+        res = shmap_evict->get(0, &val);
+        assert(res && val == 0);
+    }
+    assert(shmap_evict->size() <= 100);
+    res = shmap_evict->stats->snapshot().evict >= 900;
+    assert(res);
+    shmap_evict->set_limits(0);
+    for (int i = 1000; i < 1100; ++i) {
+        res = shmap_evict->set(i, i, false);
+        assert(res);
+    }
+    assert(shmap_evict->size() > 100);
+
+    // presized map: grown up front, then every shard's entries show up when iterating the locked table
+    shmaps::Map<int, int> *shmap_sized = new shmaps::Map<int, int>("ShMap_Sized_" + std::to_string(num_wrk), 10000);
+    shmap_sized->reserve(20000);
+    for (int i = 0; i < 1000; ++i) {
+        res = shmap_sized->set(i, i, false);
+        assert(res);
+    }
+    int sized_sum = 0;
+    {
+        auto sized_locked = shmap_sized->locked();
+        for (auto it = sized_locked.cbegin(); it != sized_locked.cend(); ++it) {
+            sized_sum += it->first;
+        }
+    }
+    assert(sized_sum == 999 * 1000 / 2);
+
+    // cursor scan: every key there for the whole walk is visited, the table growing from 16 entries meanwhile
+    shmaps::Map<int, int> *shmap_scan = new shmaps::Map<int, int>("ShMap_Scan_" + std::to_string(num_wrk), 16);
+    for (int i = 0; i < 1000; ++i) {
+        shmap_scan->set(i, i, false);
+    }
+    std::vector<bool> scanned(1000);
+    shmaps::ScanOptions scan_opts;
+    scan_opts.count = 4;
+    uint64_t cursor = 0;
+    int scan_calls = 0;
+    do {
+        cursor = shmap_scan->scan(cursor, [&](int k, int v) {
+            assert(k == v);
+            if (k < 1000) {
+                scanned[k] = true;
+            }
+        }, scan_opts);
+        for (int i = 0; i < 10; ++i, ++scan_calls) {
+            shmap_scan->set(1000 + scan_calls, 1000 + scan_calls, false);
+        }
+    } while (cursor != 0);
+    assert(std::find(scanned.begin(), scanned.end(), false) == scanned.end());
+    // expired entries are skipped unless asked for
+    for (int i = 0; i < 10; ++i) {
+        shmap_scan->set(-1 - i, -1 - i, false, std::chrono::seconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1000 + 2 * 1000 / COARSE_TICKS_PER_SEC));
+    int scan_expired[2] = {0, 0};
+    for (bool expired: {false, true}) {
+        scan_opts.expired = expired;
+        do {
+            cursor = shmap_scan->scan(cursor, [&](int k, int) {
+                scan_expired[expired] += k < 0;
+            }, scan_opts);
+        } while (cursor != 0);
+    }
+    assert(scan_expired[0] == 0 && scan_expired[1] == 10);
+    // partitioned scan of a libcuckoo map, a thread per partition: each key in exactly one of them
+    shmaps::Map<shmaps::String, int> *shmap_scan_parts =
+            new shmaps::Map<shmaps::String, int>("ShMap_ScanParts_" + std::to_string(num_wrk));
+    for (int i = 0; i < 1000; ++i) {
+        shmap_scan_parts->set(shmaps::String(std::to_string(i).c_str(), *shmaps::seg_alloc), i, false);
+    }
+    std::vector<std::set<int>> parts(4);
+    std::vector<std::thread> scanners;
+    for (uint part = 0; part < parts.size(); ++part) {
+        scanners.emplace_back([&, part] {
+            shmaps::ScanOptions part_opts;
+            part_opts.partition = part;
+            part_opts.partitions = parts.size();
+            uint64_t part_cursor = 0;
+            do {
+                part_cursor = shmap_scan_parts->scan(part_cursor, [&](const shmaps::String &, int v) {
+                    parts[part].insert(v);
+                }, part_opts);
+            } while (part_cursor != 0);
+        });
+    }
+    std::set<int> all_parts;
+    size_t parts_total = 0;
+    for (uint part = 0; part < parts.size(); ++part) {
+        scanners[part].join();
+        all_parts.insert(parts[part].begin(), parts[part].end());
+        parts_total += parts[part].size();
+    }
+    assert(all_parts.size() == 1000 && parts_total == 1000);
 
     // stress test
     shmaps::Map<uint64_t, uint64_t> *shmap_stress = new shmaps::Map<uint64_t, uint64_t>("ShMap_Stress");